@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <jeffpc/error.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN		16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void arena_init(struct arena *arena)
+{
+	arena->chunks = NULL;
+	arena->cur = NULL;
+	arena->avail = 0;
+	arena->used = 0;
+	arena->size = 0;
+}
+
+void arena_destroy(struct arena *arena)
+{
+	struct arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	arena_init(arena);
+}
+
+static struct arena_chunk *new_chunk(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+
+	chunk = malloc(sizeof(struct arena_chunk) + size);
+	ASSERT(chunk);
+
+	chunk->size = size;
+
+	arena->size += size;
+
+	return chunk;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	void *ret;
+
+	size = (MAX(size, 1) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+	arena->used += size;
+
+	if (size <= arena->avail) {
+		ret = arena->cur;
+		arena->cur += size;
+		arena->avail -= size;
+		return ret;
+	}
+
+	if (size > (ARENA_CHUNK_SIZE / 4)) {
+		/*
+		 * Large allocations get a chunk of their own.  It goes
+		 * behind the current chunk so that we don't throw away
+		 * the space left in it.
+		 */
+		chunk = new_chunk(arena, size);
+
+		if (arena->chunks) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = NULL;
+			arena->chunks = chunk;
+		}
+
+		return chunk->data;
+	}
+
+	chunk = new_chunk(arena, ARENA_CHUNK_SIZE);
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+
+	arena->cur = chunk->data + size;
+	arena->avail = ARENA_CHUNK_SIZE - size;
+
+	return chunk->data;
+}
+
+char *arena_strdup(struct arena *arena, const char *s)
+{
+	size_t len = strlen(s);
+	char *ret;
+
+	ret = arena_alloc(arena, len + 1);
+	memcpy(ret, s, len + 1);
+
+	return ret;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+/*
+ * A simple bump allocator.
+ *
+ * Allocations are carved out of large chunks and are never freed
+ * individually - everything goes away at once when the arena is
+ * destroyed.  This is meant for short-lived data with an obvious end of
+ * life (e.g., everything scratch allocated while handling a request).
+ */
+
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *chunks;	/* most recent first */
+	char *cur;			/* free space in the current chunk */
+	size_t avail;
+
+	/* stats */
+	size_t used;			/* bytes handed out */
+	size_t size;			/* bytes allocated for chunks */
+};
+
+#define ARENA_CHUNK_SIZE	(16 * 1024)
+
+extern void arena_init(struct arena *arena);
+extern void arena_destroy(struct arena *arena);
+extern void *arena_alloc(struct arena *arena, size_t size);
+extern char *arena_strdup(struct arena *arena, const char *s);
+
+#endif
@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Microbenchmark for the HTML/URL escaping code.
+ *
+ * It runs the escaping functions with each supported scan kernel and
+ * compares them against the old byte-at-a-time implementation (which
+ * always allocated a copy of the input).  The output of each kernel is
+ * also checked against the old implementation's output.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+
+#include <jeffpc/jeffpc.h>
+#include <jeffpc/error.h>
+#include <jeffpc/time.h>
+
+#include "mangle.h"
+
+#define DEFAULT_ITERS	200000
+
+static const char *inputs[] = {
+	/* typical titles & tag names - nothing to escape */
+	"blahgd",
+	"illumos",
+	"Sunday morning musings about file systems",
+	"Rebuilding the storage server, one disk at a time",
+	/* something to escape */
+	"Tips & tricks",
+	"Quoting \"things\" in <b>HTML</b>",
+	/* long paragraph with a few special chars near the end */
+	"Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do "
+	"eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut "
+	"enim ad minim veniam, quis nostrud exercitation ullamco laboris "
+	"nisi ut aliquip ex ea commodo consequat. <i>Duis aute</i> & co.",
+	NULL,
+};
+
+static char *ref_htmlescape(const char *in)
+{
+	char *out, *tmp;
+	int outlen;
+	const char *s;
+
+	outlen = strlen(in);
+
+	for (s = in; *s; s++) {
+		switch (*s) {
+			case '<':
+			case '>':
+				outlen += 3;
+				break;
+			case '&':
+				outlen += 4;
+				break;
+			case '"':
+				outlen += 5;
+				break;
+		}
+	}
+
+	out = malloc(outlen + 1);
+	ASSERT(out);
+
+	for (s = in, tmp = out; *s; s++, tmp++) {
+		switch (*s) {
+			case '<':
+				strcpy(tmp, "&lt;");
+				tmp += 3;
+				break;
+			case '>':
+				strcpy(tmp, "&gt;");
+				tmp += 3;
+				break;
+			case '&':
+				strcpy(tmp, "&amp;");
+				tmp += 4;
+				break;
+			case '"':
+				strcpy(tmp, "&quot;");
+				tmp += 5;
+				break;
+			default:
+				*tmp = *s;
+				break;
+		}
+	}
+
+	*tmp = '\0';
+
+	return out;
+}
+
+static char *ref_urlescape(const char *in)
+{
+	static const char hd[16] = "0123456789ABCDEF";
+
+	char *out, *tmp;
+	int outlen;
+	const char *s;
+
+	outlen = strlen(in);
+
+	for (s = in; *s; s++) {
+		char c = *s;
+
+		if (isalnum(c))
+			continue;
+
+		switch (c) {
+			case ' ':
+			case '-':
+			case '_':
+			case '.':
+			case '~':
+				continue;
+		}
+
+		outlen += 2;
+	}
+
+	out = malloc(outlen + 1);
+	ASSERT(out);
+
+	for (s = in, tmp = out; *s; s++, tmp++) {
+		unsigned char c = *s;
+
+		if (isalnum(c)) {
+			*tmp = c;
+			continue;
+		}
+
+		switch (c) {
+			case ' ':
+				*tmp = '+';
+				continue;
+			case '-':
+			case '_':
+			case '.':
+			case '~':
+				*tmp = c;
+				continue;
+		}
+
+		tmp[0] = '%';
+		tmp[1] = hd[c >> 4];
+		tmp[2] = hd[c & 0xf];
+
+		tmp += 2;
+	}
+
+	*tmp = '\0';
+
+	return out;
+}
+
+static void check(const char *name, const char *in,
+		  char *(*ref)(const char *),
+		  char *(*fxn)(const char *, size_t, struct arena *))
+{
+	char *exp, *got;
+
+	exp = ref(in);
+	got = fxn(in, strlen(in), NULL);
+
+	if (strcmp(exp, got ? got : in))
+		panic("%s mismatch on '%s': expected '%s', got '%s'", name,
+		      in, exp, got ? got : in);
+
+	free(exp);
+	free(got);
+}
+
+static void report(const char *kernel, const char *what, uint64_t start,
+		   unsigned long iters)
+{
+	uint64_t delta = gettime() - start;
+
+	printf("%-8s %-4s %10"PRIu64" ns total %8.1f ns/string\n", kernel,
+	       what, delta, (double) delta / iters / (ARRAY_LEN(inputs) - 1));
+}
+
+static void bench_ref(unsigned long iters)
+{
+	unsigned long i;
+	uint64_t start;
+	size_t j;
+
+	start = gettime();
+	for (i = 0; i < iters; i++)
+		for (j = 0; inputs[j]; j++)
+			free(ref_htmlescape(inputs[j]));
+	report("old", "html", start, iters);
+
+	start = gettime();
+	for (i = 0; i < iters; i++)
+		for (j = 0; inputs[j]; j++)
+			free(ref_urlescape(inputs[j]));
+	report("old", "url", start, iters);
+}
+
+static void bench_kernel(const struct mangle_scan_ops *ops,
+			 unsigned long iters)
+{
+	size_t lens[ARRAY_LEN(inputs)];
+	unsigned long i;
+	uint64_t start;
+	size_t j;
+
+	mangle_set_scan_ops(ops);
+
+	for (j = 0; inputs[j]; j++) {
+		lens[j] = strlen(inputs[j]);
+
+		check("html", inputs[j], ref_htmlescape, mangle_htmlescape);
+		check("url", inputs[j], ref_urlescape, mangle_urlescape);
+	}
+
+	start = gettime();
+	for (i = 0; i < iters; i++)
+		for (j = 0; inputs[j]; j++)
+			free(mangle_htmlescape(inputs[j], lens[j], NULL));
+	report(ops->name, "html", start, iters);
+
+	start = gettime();
+	for (i = 0; i < iters; i++)
+		for (j = 0; inputs[j]; j++)
+			free(mangle_urlescape(inputs[j], lens[j], NULL));
+	report(ops->name, "url", start, iters);
+}
+
+int main(int argc, char **argv)
+{
+	const struct mangle_scan_ops *ops;
+	unsigned long iters;
+
+	iters = DEFAULT_ITERS;
+	if ((argc > 1) && !(iters = strtoul(argv[1], NULL, 10))) {
+		fprintf(stderr, "usage: %s [<iterations>]\n", argv[0]);
+		return 1;
+	}
+
+	bench_ref(iters);
+
+	for (ops = mangle_scan_impls; ops->name; ops++) {
+		if (!ops->supported()) {
+			printf("%-8s (not supported by this CPU)\n", ops->name);
+			continue;
+		}
+
+		bench_kernel(ops, iters);
+	}
+
+	return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Microbenchmark for post index pagination.
+ *
+ * It grows an index of fake posts and times fetching the first, middle,
+ * and last page of both the by time index and a tag subindex.  With the
+ * rank trees, the time it takes to fetch a page should stay (nearly) flat
+ * regardless of how deep the page is or how large the index gets.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+
+#include <jeffpc/jeffpc.h>
+#include <jeffpc/error.h>
+#include <jeffpc/time.h>
+
+#include "post.h"
+
+#define POSTS_PER_PAGE	10
+#define NTAGS		4
+#define NITERS		1000
+
+static const unsigned int sizes[] = {
+	1000,
+	10000,
+	100000,
+	1000000,
+};
+
+static struct str *tags[NTAGS];
+static unsigned int nlisted;
+static unsigned int nlisted_tag[NTAGS];
+
+static int tag_cmp(const void *va, const void *vb)
+{
+	const struct post_tag *a = va;
+	const struct post_tag *b = vb;
+	int ret;
+
+	ret = strcasecmp(str_cstr(a->tag), str_cstr(b->tag));
+
+	if (ret > 0)
+		return 1;
+	if (ret < 0)
+		return -1;
+	return 0;
+}
+
+static void add_post(unsigned int id)
+{
+	struct post_tag *tag;
+	struct post *post;
+
+	post = malloc(sizeof(struct post));
+	ASSERT(post);
+
+	memset(post, 0, sizeof(struct post));
+
+	post->id = id;
+	post->time = id * 3600;
+	post->listed = (id % 10) != 0; /* every 10th post is unlisted */
+	refcnt_init(&post->refcnt, 1);
+
+	rb_create(&post->tags, tag_cmp, sizeof(struct post_tag),
+		  offsetof(struct post_tag, node));
+
+	tag = malloc(sizeof(struct post_tag));
+	ASSERT(tag);
+
+	tag->tag = str_getref(tags[id % NTAGS]);
+	ASSERT3P(rb_insert(&post->tags, tag), ==, NULL);
+
+	ASSERT0(index_insert_post(post));
+
+	if (post->listed) {
+		nlisted++;
+		nlisted_tag[id % NTAGS]++;
+	}
+
+	/* the index keeps its own reference, and we never free the post */
+}
+
+static void time_page(const char *what, struct str *tag, unsigned int page)
+{
+	struct post *posts[POSTS_PER_PAGE];
+	uint64_t start, delta;
+	int nposts;
+	int i, j;
+
+	nposts = 0;
+
+	start = gettime();
+	for (i = 0; i < NITERS; i++) {
+		nposts = index_get_posts(posts, tag, NULL, NULL,
+					 page * POSTS_PER_PAGE,
+					 POSTS_PER_PAGE);
+
+		for (j = 0; j < nposts; j++)
+			post_putref(posts[j]);
+	}
+	delta = gettime() - start;
+
+	ASSERT3S(nposts, >, 0);
+
+	printf("  %-4s page %7u: %8.1f ns/call\n", what, page,
+	       (double) delta / NITERS);
+}
+
+static void time_pages(const char *what, struct str *tag,
+		       unsigned int total)
+{
+	unsigned int npages;
+
+	npages = (total + POSTS_PER_PAGE - 1) / POSTS_PER_PAGE;
+
+	time_page(what, tag, 0);
+	time_page(what, tag, npages / 2);
+	time_page(what, tag, npages - 1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nposts;
+	size_t i;
+
+	for (i = 0; i < NTAGS; i++) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "tag%zu", i);
+
+		tags[i] = STR_DUP(name);
+		ASSERT(!IS_ERR(tags[i]));
+	}
+
+	init_post_subsys();
+
+	nposts = 0;
+
+	for (i = 0; i < ARRAY_LEN(sizes); i++) {
+		while (nposts < sizes[i])
+			add_post(++nposts);
+
+		printf("%u posts (%u listed)\n", nposts, nlisted);
+
+		time_pages("time", NULL, nlisted);
+		time_pages("tag", tags[0], nlisted_tag[0]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,45 @@
+#
+# Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+
+#
+# Run a test binary on an input file and compare its stdout with the
+# expected output.
+#
+# Expects BIN, INPUT, and EXPECTED to be set.
+#
+
+execute_process(
+	COMMAND ${BIN} ${INPUT}
+	OUTPUT_VARIABLE output
+	RESULT_VARIABLE res_var
+)
+
+if(NOT ${res_var} EQUAL 0)
+	message(FATAL_ERROR "${BIN} ${INPUT} failed: ${res_var}")
+endif()
+
+file(READ ${EXPECTED} expected)
+
+if(NOT output STREQUAL expected)
+	message(FATAL_ERROR "output of ${BIN} ${INPUT} does not match "
+		"${EXPECTED}:\n${output}")
+endif()
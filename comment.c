@@ -492,7 +492,7 @@ int blahg_comment(struct req *req)
 		tmpl = "{comment_saved}";
 	}
 
-	req->scgi->response.body = render_page(req, tmpl);
+	render_page(req, tmpl);
 
 	return 0;
 }
@@ -162,6 +162,21 @@ int config_load(const char *fname)
 			NULL);
 	config_load_list(lv, CONFIG_CATEGORY_TO_TAG,
 			 &config.category_to_tag);
+	config_load_u64(lv, CONFIG_PAGE_CACHE_TTL, &config.page_cache_ttl,
+			DEFAULT_PAGE_CACHE_TTL);
+	config_load_u64(lv, CONFIG_PAGE_CACHE_SIZE, &config.page_cache_size,
+			DEFAULT_PAGE_CACHE_SIZE);
+	config_load_u64(lv, CONFIG_REQUEST_LOG_SAMPLE,
+			&config.request_log_sample,
+			DEFAULT_REQUEST_LOG_SAMPLE);
+	config_load_u64(lv, CONFIG_REQUEST_LOG_QUEUE_SIZE,
+			&config.request_log_queue_size,
+			DEFAULT_REQUEST_LOG_QUEUE_SIZE);
+	config_load_u64(lv, CONFIG_REQUEST_LOG_SEGMENT_SIZE,
+			&config.request_log_segment_size,
+			DEFAULT_REQUEST_LOG_SEGMENT_SIZE);
+	config_load_u64(lv, CONFIG_POST_CACHE, &config.post_cache,
+			DEFAULT_POST_CACHE);
 
 	val_putref(lv);
 
@@ -184,6 +199,14 @@ int config_load(const char *fname)
 	DBG("config.tagcloud_max_size = %"PRIu64, config.tagcloud_max_size);
 	DBG("config.twitter_username = %s", str_cstr(config.twitter_username));
 	DBG("config.twitter_description = %s", str_cstr(config.twitter_description));
+	DBG("config.page_cache_ttl = %"PRIu64, config.page_cache_ttl);
+	DBG("config.page_cache_size = %"PRIu64, config.page_cache_size);
+	DBG("config.request_log_sample = %"PRIu64, config.request_log_sample);
+	DBG("config.request_log_queue_size = %"PRIu64,
+	    config.request_log_queue_size);
+	DBG("config.request_log_segment_size = %"PRIu64,
+	    config.request_log_segment_size);
+	DBG("config.post_cache = %"PRIu64, config.post_cache);
 
 	return 0;
 }
@@ -23,9 +23,11 @@
 include(CheckIncludeFiles)
 
 check_include_files(priv.h HAVE_PRIV_H)
+check_include_files(sys/inotify.h HAVE_SYS_INOTIFY_H)
 
 set(CMAKE_MODULE_PATH "${CMAKE_CURRENT_SOURCE_DIR}/cmake/Modules")
 find_package(jeffpc)
+find_package(ZLIB REQUIRED)
 
 macro(set_default name default)
 	if(NOT DEFINED ${name})
@@ -61,6 +63,15 @@ set_default(COND_STACK_DEPTH		10)
 set_default(DEFAULT_TAGCLOUD_MIN_SIZE	6)
 set_default(DEFAULT_TAGCLOUD_MAX_SIZE	18)
 
+set_default(DEFAULT_PAGE_CACHE_TTL	60)	# 1 minute
+set_default(DEFAULT_PAGE_CACHE_SIZE	1000)	# entries
+
+set_default(DEFAULT_REQUEST_LOG_SAMPLE		1)	# log every request
+set_default(DEFAULT_REQUEST_LOG_QUEUE_SIZE	4096)	# entries
+set_default(DEFAULT_REQUEST_LOG_SEGMENT_SIZE	16777216) # 16 MB
+
+set_default(DEFAULT_POST_CACHE		1)	# use the compiled post cache
+
 set_default(PREVIEW_SECRET		0x1985)
 
 configure_file(config.h.in config.h)
@@ -39,6 +39,12 @@
 #include "pipeline.h"
 #include "req.h"
 #include "post.h"
+#include "render.h"
+#include "sidebar.h"
+#include "pagecache.h"
+#include "static.h"
+#include "reqlog.h"
+#include "watch.h"
 #include "version.h"
 #include "debug.h"
 
@@ -138,13 +144,24 @@ static int main_blahgd(int argc, char **argv)
 
 	ASSERT0(file_cache_init());
 
+	init_vars_subsys();
+	init_req_subsys();
 	init_pipe_subsys();
+	init_render_subsys();
 	init_post_subsys();
+	init_sidebar_subsys();
+	init_pagecache_subsys();
+	init_static_subsys();
+	init_reqlog_subsys();
 
 	ret = load_all_posts();
 	if (ret)
 		goto err;
 
+	/* without a watcher, poll the post files for changes */
+	if (!init_watch_subsys())
+		post_deps_start();
+
 	ret = scgisvc(NULL, config.scgi_port, config.scgi_threads,
 		      &ops, NULL);
 	if (ret)
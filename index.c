@@ -39,19 +39,6 @@
 #include "utils.h"
 #include "debug.h"
 
-struct archive_filter_args {
-	unsigned int start;
-	unsigned int end;
-};
-
-/* return true iff post->time is in [start,end) */
-static bool archive_filter(struct post *post, void *private)
-{
-	struct archive_filter_args *args = private;
-
-	return (post->time >= args->start) && (post->time < args->end);
-}
-
 static void __load_posts(struct req *req, int page, int archid)
 {
 	const unsigned int posts_per_page = req->opts.index_stories;
@@ -65,29 +52,9 @@ static void __load_posts(struct req *req, int page, int archid)
 					 posts_per_page);
 	} else {
 		/* archive index */
-		struct archive_filter_args filter_args;
-		struct tm start;
-		struct tm end;
-
-		memset(&start, 0, sizeof(start));
-
-		start.tm_year = (archid / 100) - 1900;
-		start.tm_mon  = (archid % 100) - 1;
-		start.tm_mday = 1;
-
-		end = start;
-		end.tm_mon++;
-		if (end.tm_mon >= 12) {
-			end.tm_mon = 1;
-			end.tm_year++;
-		}
-
-		filter_args.start = mktime(&start);
-		filter_args.end   = mktime(&end);
-
-		nposts = index_get_posts(posts, NULL, archive_filter,
-					 &filter_args, page * posts_per_page,
-					 posts_per_page);
+		nposts = index_get_month_posts(posts, archid,
+					       page * posts_per_page,
+					       posts_per_page);
 	}
 
 	load_posts(req, posts, nposts, nposts == posts_per_page);
@@ -130,7 +97,7 @@ int blahg_index(struct req *req, int page)
 
 	__load_posts(req, page, 0);
 
-	req->scgi->response.body = render_page(req, "{index}");
+	render_page(req, "{index}");
 	return 0;
 }
 
@@ -184,6 +151,6 @@ int blahg_archive(struct req *req, int page)
 
 	__load_posts(req, page, m);
 
-	req->scgi->response.body = render_page(req, "{archive}");
+	render_page(req, "{archive}");
 	return 0;
 }
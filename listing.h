@@ -36,7 +36,9 @@ static inline struct str *listing_str(struct str *str)
 {
 	char *tmp;
 
-	tmp = mangle_htmlescape(str_cstr(str));
+	tmp = mangle_htmlescape(str_cstr(str), str_len(str), NULL);
+	if (!tmp)
+		return str; /* nothing to escape */
 
 	str_putref(str);
 
@@ -23,20 +23,301 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <jeffpc/error.h>
+
 #include "mangle.h"
 
-char *mangle_htmlescape(const char *in)
+#if defined(__x86_64__) || defined(__i386__)
+#define MANGLE_X86
+#include <immintrin.h>
+#endif
+
+static char *alloc_out(struct arena *arena, size_t len)
+{
+	char *out;
+
+	if (arena)
+		return arena_alloc(arena, len);
+
+	out = malloc(len);
+	ASSERT(out);
+
+	return out;
+}
+
+static inline bool html_special(unsigned char c)
+{
+	return (c == '<') || (c == '>') || (c == '&') || (c == '"');
+}
+
+/*
+ * Note: This intentionally uses ASCII ranges instead of isalnum() so that
+ * the vectorized kernels can implement the same test.
+ */
+static inline bool url_safe(unsigned char c)
+{
+	return ((c >= '0') && (c <= '9')) ||
+	       ((c >= 'a') && (c <= 'z')) ||
+	       ((c >= 'A') && (c <= 'Z')) ||
+	       (c == '-') || (c == '_') || (c == '.') || (c == '~');
+}
+
+/*
+ * Scalar kernels
+ */
+
+static bool scan_supported_always(void)
+{
+	return true;
+}
+
+static size_t scan_html_scalar(const char *in, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (html_special(in[i]))
+			break;
+
+	return i;
+}
+
+static size_t scan_url_scalar(const char *in, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (!url_safe(in[i]))
+			break;
+
+	return i;
+}
+
+#ifdef MANGLE_X86
+/*
+ * SSE2 kernels
+ *
+ * There is no unsigned byte compare, so range checks are done by
+ * subtracting the lower bound and checking that min(x, hi - lo) == x.
+ */
+
+#define SSE2	__attribute__((target("sse2")))
+
+static bool scan_supported_sse2(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("sse2");
+}
+
+static inline SSE2 __m128i sse2_range(__m128i v, char lo, char hi)
 {
+	__m128i t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+
+	return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(hi - lo)), t);
+}
+
+static SSE2 size_t scan_html_sse2(const char *in, size_t len)
+{
+	const __m128i lt = _mm_set1_epi8('<');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i amp = _mm_set1_epi8('&');
+	const __m128i quot = _mm_set1_epi8('"');
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) &in[i]);
+		__m128i m;
+		unsigned mask;
+
+		m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt),
+					      _mm_cmpeq_epi8(v, gt)),
+				 _mm_or_si128(_mm_cmpeq_epi8(v, amp),
+					      _mm_cmpeq_epi8(v, quot)));
+
+		mask = _mm_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + scan_html_scalar(&in[i], len - i);
+}
+
+static SSE2 size_t scan_url_sse2(const char *in, size_t len)
+{
+	const __m128i lower = _mm_set1_epi8(0x20);
+	const __m128i dash = _mm_set1_epi8('-');
+	const __m128i under = _mm_set1_epi8('_');
+	const __m128i dot = _mm_set1_epi8('.');
+	const __m128i tilde = _mm_set1_epi8('~');
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) &in[i]);
+		__m128i safe;
+		unsigned mask;
+
+		safe = _mm_or_si128(sse2_range(v, '0', '9'),
+				    sse2_range(_mm_or_si128(v, lower),
+					       'a', 'z'));
+		safe = _mm_or_si128(safe,
+				    _mm_or_si128(_mm_cmpeq_epi8(v, dash),
+						 _mm_cmpeq_epi8(v, under)));
+		safe = _mm_or_si128(safe,
+				    _mm_or_si128(_mm_cmpeq_epi8(v, dot),
+						 _mm_cmpeq_epi8(v, tilde)));
+
+		mask = ~_mm_movemask_epi8(safe) & 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + scan_url_scalar(&in[i], len - i);
+}
+
+/*
+ * AVX2 kernels - same as the SSE2 ones, just twice as wide
+ *
+ * Note: The tails are handled by the scalar code since calling the
+ * (non-VEX encoded) SSE2 kernels with dirty upper halves of the ymm
+ * registers is very slow.
+ */
+
+#define AVX2	__attribute__((target("avx2")))
+
+static bool scan_supported_avx2(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("avx2");
+}
+
+static inline AVX2 __m256i avx2_range(__m256i v, char lo, char hi)
+{
+	__m256i t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+
+	return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(hi - lo)),
+				 t);
+}
+
+static AVX2 size_t scan_html_avx2(const char *in, size_t len)
+{
+	const __m256i lt = _mm256_set1_epi8('<');
+	const __m256i gt = _mm256_set1_epi8('>');
+	const __m256i amp = _mm256_set1_epi8('&');
+	const __m256i quot = _mm256_set1_epi8('"');
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) &in[i]);
+		__m256i m;
+		unsigned mask;
+
+		m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, lt),
+						    _mm256_cmpeq_epi8(v, gt)),
+				    _mm256_or_si256(_mm256_cmpeq_epi8(v, amp),
+						    _mm256_cmpeq_epi8(v, quot)));
+
+		mask = _mm256_movemask_epi8(m);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + scan_html_scalar(&in[i], len - i);
+}
+
+static AVX2 size_t scan_url_avx2(const char *in, size_t len)
+{
+	const __m256i lower = _mm256_set1_epi8(0x20);
+	const __m256i dash = _mm256_set1_epi8('-');
+	const __m256i under = _mm256_set1_epi8('_');
+	const __m256i dot = _mm256_set1_epi8('.');
+	const __m256i tilde = _mm256_set1_epi8('~');
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) &in[i]);
+		__m256i safe;
+		unsigned mask;
+
+		safe = _mm256_or_si256(avx2_range(v, '0', '9'),
+				       avx2_range(_mm256_or_si256(v, lower),
+						  'a', 'z'));
+		safe = _mm256_or_si256(safe,
+				       _mm256_or_si256(_mm256_cmpeq_epi8(v, dash),
+						       _mm256_cmpeq_epi8(v, under)));
+		safe = _mm256_or_si256(safe,
+				       _mm256_or_si256(_mm256_cmpeq_epi8(v, dot),
+						       _mm256_cmpeq_epi8(v, tilde)));
+
+		mask = ~_mm256_movemask_epi8(safe);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + scan_url_scalar(&in[i], len - i);
+}
+#endif
+
+/* best first */
+const struct mangle_scan_ops mangle_scan_impls[] = {
+#ifdef MANGLE_X86
+	{ "avx2", scan_supported_avx2, scan_html_avx2, scan_url_avx2, },
+	{ "sse2", scan_supported_sse2, scan_html_sse2, scan_url_sse2, },
+#endif
+	{ "scalar", scan_supported_always, scan_html_scalar, scan_url_scalar, },
+	{ NULL, },
+};
+
+static const struct mangle_scan_ops *scan_ops;
+
+void mangle_set_scan_ops(const struct mangle_scan_ops *ops)
+{
+	scan_ops = ops;
+}
+
+/*
+ * Racing threads will all pick the same kernel, so there is no need for
+ * any locking.
+ */
+static const struct mangle_scan_ops *get_scan_ops(void)
+{
+	const struct mangle_scan_ops *ops;
+
+	if (scan_ops)
+		return scan_ops;
+
+	for (ops = mangle_scan_impls; ops->name; ops++)
+		if (ops->supported())
+			break;
+
+	ASSERT(ops->name);
+
+	scan_ops = ops;
+
+	return ops;
+}
+
+/*
+ * Most strings have nothing to escape, so we use the scan kernel to find
+ * the first special byte.  Everything before it gets copied as-is, and
+ * the rest is handled one byte at a time.
+ */
+char *mangle_htmlescape(const char *in, size_t len, struct arena *arena)
+{
+	size_t outlen;
+	size_t first;
+	size_t i;
 	char *out, *tmp;
-	int outlen;
-	const char *s;
 
-	outlen = strlen(in);
+	first = get_scan_ops()->html(in, len);
+	if (first == len)
+		return NULL;
 
-	for (s = in; *s; s++) {
-		char c = *s;
+	outlen = len;
 
-		switch (c) {
+	for (i = first; i < len; i++) {
+		switch (in[i]) {
 			case '<':
 			case '>':
 				/* "&lt;" "&gt;" */
@@ -53,32 +334,30 @@ char *mangle_htmlescape(const char *in)
 		}
 	}
 
-	out = malloc(outlen + 1);
-	if (!out)
-		return NULL;
+	out = alloc_out(arena, outlen + 1);
 
-	for (s = in, tmp = out; *s; s++, tmp++) {
-		unsigned char c = *s;
+	memcpy(out, in, first);
 
-		switch (c) {
+	for (i = first, tmp = out + first; i < len; i++, tmp++) {
+		switch (in[i]) {
 			case '<':
-				strcpy(tmp, "&lt;");
+				memcpy(tmp, "&lt;", 4);
 				tmp += 3;
 				break;
 			case '>':
-				strcpy(tmp, "&gt;");
+				memcpy(tmp, "&gt;", 4);
 				tmp += 3;
 				break;
 			case '&':
-				strcpy(tmp, "&amp;");
+				memcpy(tmp, "&amp;", 5);
 				tmp += 4;
 				break;
 			case '"':
-				strcpy(tmp, "&quot;");
+				memcpy(tmp, "&quot;", 6);
 				tmp += 5;
 				break;
 			default:
-				*tmp = c;
+				*tmp = in[i];
 				break;
 		}
 	}
@@ -87,3 +366,49 @@ char *mangle_htmlescape(const char *in)
 
 	return out;
 }
+
+char *mangle_urlescape(const char *in, size_t len, struct arena *arena)
+{
+	static const char hd[16] = "0123456789ABCDEF";
+
+	size_t outlen;
+	size_t first;
+	size_t i;
+	char *out, *tmp;
+
+	first = get_scan_ops()->url(in, len);
+	if (first == len)
+		return NULL;
+
+	outlen = len;
+
+	for (i = first; i < len; i++) {
+		/* spaces turn into '+', everything else unsafe gets %XX */
+		if (!url_safe(in[i]) && (in[i] != ' '))
+			outlen += 2;
+	}
+
+	out = alloc_out(arena, outlen + 1);
+
+	memcpy(out, in, first);
+
+	for (i = first, tmp = out + first; i < len; i++, tmp++) {
+		unsigned char c = in[i];
+
+		if (url_safe(c)) {
+			*tmp = c;
+		} else if (c == ' ') {
+			*tmp = '+';
+		} else {
+			tmp[0] = '%';
+			tmp[1] = hd[c >> 4];
+			tmp[2] = hd[c & 0xf];
+
+			tmp += 2;
+		}
+	}
+
+	*tmp = '\0';
+
+	return out;
+}
@@ -23,6 +23,36 @@
 #ifndef __MANGLE_H
 #define __MANGLE_H
 
-extern char *mangle_htmlescape(const char *in);
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+/*
+ * Escape @len bytes of @in.  If nothing needs escaping, NULL is returned
+ * and the caller can keep using the input as-is.  Otherwise, a newly
+ * allocated nul-terminated string is returned.  It is allocated from
+ * @arena if non-NULL, and with malloc otherwise.
+ */
+extern char *mangle_htmlescape(const char *in, size_t len,
+			       struct arena *arena);
+extern char *mangle_urlescape(const char *in, size_t len,
+			      struct arena *arena);
+
+/*
+ * The escaping functions use a scan kernel to find the next byte that
+ * needs escaping.  The best kernel supported by the CPU is picked at
+ * runtime.  The table & setter are exposed for benchmarking.
+ */
+struct mangle_scan_ops {
+	const char *name;
+	bool (*supported)(void);
+	/* return the offset of the first special byte, or len if none */
+	size_t (*html)(const char *in, size_t len);
+	size_t (*url)(const char *in, size_t len);
+};
+
+extern const struct mangle_scan_ops mangle_scan_impls[];
+extern void mangle_set_scan_ops(const struct mangle_scan_ops *ops);
 
 #endif
@@ -0,0 +1,522 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/file-cache.h>
+#include <jeffpc/list.h>
+#include <jeffpc/mem.h>
+#include <jeffpc/rbtree.h>
+#include <jeffpc/refcnt.h>
+#include <jeffpc/synch.h>
+#include <jeffpc/taskq.h>
+#include <jeffpc/time.h>
+
+#include "pagecache.h"
+#include "post.h"
+#include "utils.h"
+#include "debug.h"
+
+/*
+ * Rendered page cache
+ *
+ * The index, story, tag, and archive pages (in all formats) look the same
+ * to everyone, so there is no reason to render them over and over.  We
+ * keep the rendered body keyed by the page type, format, and the query
+ * parameters the page actually uses.
+ *
+ * While rendering a cacheable page, we collect the revisions of all the
+ * files (posts, comments, templates) the output was built from.  Along
+ * with the post index generation, these are checked on every hit and the
+ * entry is thrown away as soon as any of them changes.
+ *
+ * The one exception is the current time, which the comment form on story
+ * pages carries as the start of the think time.  It is left out of the
+ * cached body, and every hit gets a copy of the body with the time of
+ * that request filled in at the recorded offsets.  Such pages are never
+ * the same twice, so they go out without a gzip'd variant or validators.
+ *
+ * Entries also expire after page-cache-ttl seconds regardless, to bound
+ * the effect of any inputs we don't track.  A TTL of 0 disables the
+ * cache.
+ *
+ * The gzip'd variant of a body is produced by a taskq after the entry is
+ * inserted, so the request that missed doesn't pay for the compression.
+ * Until it is ready, hits are served uncompressed.
+ */
+
+struct pagecache_entry {
+	struct rb_node node;
+	struct list_node fifo;
+	refcnt_t refcnt;
+
+	/* key */
+	char *key;
+
+	/* value */
+	char *body;
+	size_t bodylen;
+	char *gz_body;			/* NULL if not (yet) compressed */
+	size_t gz_len;
+	uint64_t etag;
+	uint64_t last_modified;
+	size_t *now_offs;		/* where to insert {now} */
+	size_t nnow;
+
+	/* what it depends on */
+	struct nvlist *deps;
+	uint64_t index_gen;
+	uint64_t expires;
+};
+
+static void pagecache_entry_free(struct pagecache_entry *entry);
+
+REFCNT_INLINE_FXNS(struct pagecache_entry, pagecache_entry, refcnt,
+		   pagecache_entry_free, NULL)
+
+static struct rb_tree pagecache;
+static struct list pagecache_fifo;	/* oldest first */
+static struct lock pagecache_lock;
+static LOCK_CLASS(pagecache_lc);
+
+static struct mem_cache *pagecache_entry_cache;
+static struct taskq *gzip_tq;
+
+static int pagecache_cmp(const void *va, const void *vb)
+{
+	const struct pagecache_entry *a = va;
+	const struct pagecache_entry *b = vb;
+	int ret;
+
+	ret = strcmp(a->key, b->key);
+	if (ret < 0)
+		return -1;
+	if (ret > 0)
+		return 1;
+	return 0;
+}
+
+void init_pagecache_subsys(void)
+{
+	rb_create(&pagecache, pagecache_cmp, sizeof(struct pagecache_entry),
+		  offsetof(struct pagecache_entry, node));
+	list_create(&pagecache_fifo, sizeof(struct pagecache_entry),
+		    offsetof(struct pagecache_entry, fifo));
+
+	MXINIT(&pagecache_lock, &pagecache_lc);
+
+	pagecache_entry_cache = mem_cache_create("pagecache-entry-cache",
+						 sizeof(struct pagecache_entry),
+						 0);
+	ASSERT(!IS_ERR(pagecache_entry_cache));
+
+	gzip_tq = taskq_create_fixed("pagecache-gzip",
+				     MAX(sysconf(_SC_NPROCESSORS_ONLN) / 2, 1));
+	ASSERT(!IS_ERR(gzip_tq));
+}
+
+static void pagecache_entry_free(struct pagecache_entry *entry)
+{
+	free(entry->key);
+	free(entry->body);
+	free(entry->gz_body);
+	free(entry->now_offs);
+	nvl_putref(entry->deps);
+
+	mem_cache_free(pagecache_entry_cache, entry);
+}
+
+static void release_body(void *arg)
+{
+	pagecache_entry_putref(arg);
+}
+
+/*
+ * Give the request its own copy of @body with the current time filled in
+ * at each of the @nnow offsets in @offs.
+ */
+static void fill_now(struct req *req, const char *body, size_t bodylen,
+		     const size_t *offs, size_t nnow)
+{
+	char now[32];
+	size_t nowlen;
+	size_t prev;
+	size_t len;
+	char *out;
+	size_t i;
+
+	nowlen = snprintf(now, sizeof(now), "%"PRIu64,
+			  vars_lookup_int(&req->vars, "now"));
+
+	out = malloc(bodylen + nnow * nowlen + 1);
+	ASSERT(out);
+
+	len = 0;
+	prev = 0;
+
+	for (i = 0; i < nnow; i++) {
+		memcpy(out + len, body + prev, offs[i] - prev);
+		len += offs[i] - prev;
+		memcpy(out + len, now, nowlen);
+		len += nowlen;
+		prev = offs[i];
+	}
+
+	memcpy(out + len, body + prev, bodylen - prev);
+	len += bodylen - prev;
+	out[len] = '\0';
+
+	req->scgi->response.body = out;
+	req->scgi->response.bodylen = len;
+	req->uses_now = true;
+}
+
+/* the page isn't going into the cache after all, fill in its own body */
+static void fill_now_uncached(struct req *req)
+{
+	char *body = req->scgi->response.body;
+
+	if (!req->nnow)
+		return;
+
+	ASSERT(!req->body_release);
+
+	fill_now(req, body, req->scgi->response.bodylen, req->now_offs,
+		 req->nnow);
+
+	free(body);
+}
+
+static void __tq_gzip(void *arg)
+{
+	struct pagecache_entry *entry = arg;
+	size_t len;
+	char *gz;
+
+	gz = gzip_buf(entry->body, entry->bodylen, &len);
+	if (gz) {
+		/* the length must be visible before the body */
+		entry->gz_len = len;
+		__atomic_store_n(&entry->gz_body, gz, __ATOMIC_RELEASE);
+	}
+
+	pagecache_entry_putref(entry);
+}
+
+/* must be called with the lock held */
+static void __remove(struct pagecache_entry *entry)
+{
+	rb_remove(&pagecache, entry);
+	list_remove(&pagecache_fifo, entry);
+
+	pagecache_entry_putref(entry);
+}
+
+static bool __key_int(struct nvlist *query, const char *name, char **buf,
+		      size_t *len)
+{
+	uint64_t val;
+	int ret;
+
+	if (!nvl_exists(query, name))
+		return true;
+
+	/* if it is not a number, it is garbage and we won't cache it */
+	if (nvl_lookup_int(query, name, &val))
+		return false;
+
+	ret = snprintf(*buf, *len, "|%s=%"PRIu64, name, val);
+	if (ret >= *len)
+		return false;
+
+	*buf += ret;
+	*len -= ret;
+
+	return true;
+}
+
+static bool __key_str(struct nvlist *query, const char *name, char **buf,
+		      size_t *len)
+{
+	struct str *val;
+	int ret;
+
+	val = nvl_lookup_str(query, name);
+	if (IS_ERR(val))
+		return PTR_ERR(val) == -ENOENT;
+
+	/* length-prefixed, so that no value can masquerade as another key */
+	ret = snprintf(*buf, *len, "|%s=%zu:%s", name, str_len(val),
+		       str_cstr(val));
+
+	str_putref(val);
+
+	if (ret >= *len)
+		return false;
+
+	*buf += ret;
+	*len -= ret;
+
+	return true;
+}
+
+/*
+ * Figure out if the request is cacheable & if so, produce the key.  The
+ * query parameters that the pages don't look at are left out of the key.
+ */
+static char *pagecache_key(struct req *req)
+{
+	struct nvlist *query = req->scgi->request.query;
+	struct str *method;
+	char key[1024];
+	size_t len;
+	char *buf;
+	int ret;
+
+	if (!config.page_cache_ttl)
+		return NULL;
+
+	switch (req->page) {
+		case PAGE_INDEX:
+		case PAGE_STORY:
+		case PAGE_TAG:
+		case PAGE_ARCHIVE:
+			break;
+		default:
+			return NULL;
+	}
+
+	method = nvl_lookup_str(req->scgi->request.headers,
+				SCGI_REQUEST_METHOD);
+	if (IS_ERR(method))
+		return NULL;
+
+	ret = strcmp(str_cstr(method), "GET");
+
+	str_putref(method);
+
+	if (ret)
+		return NULL;
+
+	/* previews are never cached */
+	if (nvl_exists(query, "preview"))
+		return NULL;
+
+	buf = key;
+	len = sizeof(key);
+
+	ret = snprintf(buf, len, "%d|%s", req->page, str_cstr(req->fmt));
+	if (ret >= len)
+		return NULL;
+
+	buf += ret;
+	len -= ret;
+
+	if (!__key_int(query, "p", &buf, &len) ||
+	    !__key_int(query, "paged", &buf, &len) ||
+	    !__key_int(query, "m", &buf, &len) ||
+	    !__key_str(query, "tag", &buf, &len))
+		return NULL;
+
+	return xstrdup(key);
+}
+
+static bool pagecache_entry_valid(struct pagecache_entry *entry)
+{
+	const struct nvpair *pair;
+	bool valid;
+
+	if (gettime() >= entry->expires)
+		return false;
+
+	if (entry->index_gen != index_get_generation())
+		return false;
+
+	valid = true;
+
+	nvl_for_each(pair, entry->deps) {
+		struct str *name = nvpair_name_str(pair);
+		uint64_t rev;
+
+		ASSERT0(nvpair_value_int(pair, &rev));
+
+		if (file_cache_has_newer(str_cstr(name), rev))
+			valid = false;
+
+		str_putref(name);
+
+		if (!valid)
+			break;
+	}
+
+	return valid;
+}
+
+/*
+ * Try to satisfy the request from the cache.  If the request is cacheable
+ * but not in the cache, get it ready for pagecache_insert().
+ */
+bool pagecache_lookup(struct req *req)
+{
+	struct pagecache_entry *entry;
+	struct pagecache_entry key;
+
+	req->cache_key = pagecache_key(req);
+	if (!req->cache_key)
+		return false;
+
+	key.key = req->cache_key;
+
+	MXLOCK(&pagecache_lock);
+	entry = rb_find(&pagecache, &key, NULL);
+	if (entry)
+		entry = pagecache_entry_getref(entry);
+	MXUNLOCK(&pagecache_lock);
+
+	if (entry && !pagecache_entry_valid(entry)) {
+		MXLOCK(&pagecache_lock);
+		if (rb_find(&pagecache, &key, NULL) == entry)
+			__remove(entry);
+		MXUNLOCK(&pagecache_lock);
+
+		pagecache_entry_putref(entry);
+		entry = NULL;
+	}
+
+	if (entry && entry->nnow) {
+		/* hit - fill in a copy of the body */
+		fill_now(req, entry->body, entry->bodylen, entry->now_offs,
+			 entry->nnow);
+
+		pagecache_entry_putref(entry);
+
+		return true;
+	}
+
+	if (entry) {
+		/* hit - borrow the body from the cache entry */
+		req->scgi->response.body = entry->body;
+		req->scgi->response.bodylen = entry->bodylen;
+		req->body_release = release_body;
+		req->body_release_arg = entry;
+		req->gz_body = __atomic_load_n(&entry->gz_body,
+					       __ATOMIC_ACQUIRE);
+		req->gz_len = entry->gz_len;
+		req->etag = entry->etag;
+		req->etag_valid = true;
+		req->last_modified = entry->last_modified;
+
+		return true;
+	}
+
+	/* miss - start tracking dependencies */
+	req->cache_index_gen = index_get_generation();
+	req->deps = nvl_alloc();
+	if (IS_ERR(req->deps)) {
+		req->deps = NULL;
+		free(req->cache_key);
+		req->cache_key = NULL;
+	}
+
+	return false;
+}
+
+void pagecache_insert(struct req *req)
+{
+	struct pagecache_entry *entry;
+	struct pagecache_entry *old;
+	struct rb_cookie where;
+
+	if (!req->cache_key || !req->deps || req->body_release ||
+	    (req->scgi->response.status != SCGI_STATUS_OK)) {
+		fill_now_uncached(req);
+		return;
+	}
+
+	entry = mem_cache_alloc(pagecache_entry_cache);
+	if (!entry) {
+		fill_now_uncached(req);
+		return;
+	}
+
+	refcnt_init(&entry->refcnt, 1);
+
+	/* hash the body once, so that hits can answer conditional requests */
+	if (!req->nnow)
+		req_set_etag(req);
+	entry->etag = req->etag;
+
+	/* the entry takes over the key, body, and dependencies */
+	entry->key = req->cache_key;
+	entry->body = req->scgi->response.body;
+	entry->bodylen = req->scgi->response.bodylen;
+	entry->gz_body = NULL;
+	entry->gz_len = 0;
+	entry->last_modified = req->last_modified;
+	entry->deps = req->deps;
+	entry->index_gen = req->cache_index_gen;
+	entry->expires = gettime() + config.page_cache_ttl * 1000000000ull;
+	entry->now_offs = req->now_offs;
+	entry->nnow = req->nnow;
+
+	req->cache_key = NULL;
+	req->deps = NULL;
+	req->now_offs = NULL;
+	req->nnow = 0;
+
+	if (entry->nnow) {
+		/* the request gets a filled in copy of the body */
+		fill_now(req, entry->body, entry->bodylen, entry->now_offs,
+			 entry->nnow);
+	} else {
+		/* ...and the request borrows the body back */
+		req->body_release = release_body;
+		req->body_release_arg = pagecache_entry_getref(entry);
+
+		/* compress it in the background; this request goes out as-is */
+		if (taskq_dispatch(gzip_tq, __tq_gzip,
+				   pagecache_entry_getref(entry)))
+			pagecache_entry_putref(entry);
+	}
+
+	MXLOCK(&pagecache_lock);
+
+	old = rb_find(&pagecache, entry, &where);
+	if (old) {
+		__remove(old);
+		ASSERT3P(rb_find(&pagecache, entry, &where), ==, NULL);
+	}
+
+	rb_insert_here(&pagecache, entry, &where);
+	list_insert_tail(&pagecache_fifo, entry);
+
+	/* evict the oldest entries if we have too many */
+	while (rb_numnodes(&pagecache) > config.page_cache_size)
+		__remove(list_head(&pagecache_fifo));
+
+	MXUNLOCK(&pagecache_lock);
+}
@@ -28,26 +28,46 @@
 
 #include "req.h"
 #include "post.h"
+#include "template.h"
+#include "rope.h"
+
+/* a run of bytes in the input */
+struct fmt3_slice {
+	size_t off;
+	size_t len;
+};
+
+/*
+ * Text being assembled by the fmt3 grammar: whatever was built so far,
+ * followed by a run of the input that hasn't been copied yet.
+ */
+struct fmt3_text {
+	struct rope_node *rope;
+	struct fmt3_slice run;
+};
 
 struct parser_output {
 	struct req *req;
 	struct post *post;
 
 	void *scanner;
-	char *output;
 	struct str *stroutput;
 	struct val *valoutput;
 
 	const char *input;
 	size_t len;
 	size_t pos;
+	size_t tokpos;		/* input offset of the next fmt3 token */
 	int lineno;
 
 	/* template related */
-	bool cond_stack[COND_STACK_DEPTH];
+	struct tmpl *tmpl;
+	struct tmpl_insn *cond_stack[COND_STACK_DEPTH];
+	int cond_branch[COND_STACK_DEPTH];
 	int cond_stack_use;
 
 	/* fmt3 */
+	struct rope rope;	/* output being built */
 	int table_nesting;
 	int texttt_nesting;
 
@@ -70,29 +90,31 @@ extern void tmpl_set_extra(void * user_defined, yyscan_t yyscanner);
 extern int fmt3_lex_init(yyscan_t* scanner);
 extern int tmpl_lex_init(yyscan_t* scanner);
 
-static inline bool cond_value(struct parser_output *data)
+/* the block the template grammar is currently appending instructions to */
+static inline struct list *cond_block(struct parser_output *data)
 {
-	int i;
+	int i = data->cond_stack_use;
 
-	for (i = 0; i <= data->cond_stack_use; i++)
-		if (!data->cond_stack[i])
-			return false;
+	if (i < 0)
+		return &data->tmpl->insns;
 
-	return true;
+	return &data->cond_stack[i]->branch[data->cond_branch[i]];
 }
 
-static inline void cond_if(struct parser_output *data, bool val)
+static inline void cond_if(struct parser_output *data, struct tmpl_insn *insn)
 {
-	ASSERT3S(data->cond_stack_use, <, COND_STACK_DEPTH);
+	ASSERT3S(data->cond_stack_use, <, COND_STACK_DEPTH - 1);
 
-	data->cond_stack[++data->cond_stack_use] = val;
+	data->cond_stack_use++;
+	data->cond_stack[data->cond_stack_use] = insn;
+	data->cond_branch[data->cond_stack_use] = TMPL_BRANCH_TRUE;
 }
 
 static inline void cond_else(struct parser_output *data)
 {
 	ASSERT3S(data->cond_stack_use, >=, 0);
 
-	data->cond_stack[data->cond_stack_use] = !data->cond_stack[data->cond_stack_use];
+	data->cond_branch[data->cond_stack_use] ^= 1;
 }
 
 static inline void cond_endif(struct parser_output *data)
@@ -23,7 +23,6 @@
 #include <string.h>
 #include <stddef.h>
 #include <stdio.h>
-#include <ctype.h>
 
 #include <jeffpc/error.h>
 #include <jeffpc/val.h>
@@ -47,93 +46,27 @@ void init_pipe_subsys(void)
 	ASSERT(!IS_ERR(pipeline_cache));
 }
 
-static struct val *nop_fxn(struct val *val)
+static struct val *nop_fxn(struct val *val, struct arena *arena)
 {
 	return val;
 }
 
-static char *str_of_int(uint64_t v)
-{
-	return NULL;
-}
-
-static char *__urlescape_str(const char *in)
-{
-	static const char hd[16] = "0123456789ABCDEF";
-
-	char *out, *tmp;
-	int outlen;
-	const char *s;
-
-	outlen = strlen(in);
-
-	for (s = in; *s; s++) {
-		char c = *s;
-
-		if (isalnum(c))
-			continue;
-
-		switch (c) {
-			case ' ':
-			case '-':
-			case '_':
-			case '.':
-			case '~':
-				continue;
-		}
-
-		/* this char will be escaped */
-		outlen += 2;
-	}
-
-	out = malloc(outlen + 1);
-	ASSERT(out);
-
-	for (s = in, tmp = out; *s; s++, tmp++) {
-		unsigned char c = *s;
-
-		if (isalnum(c)) {
-			*tmp = c;
-			continue;
-		}
-
-		switch (c) {
-			case ' ':
-				*tmp = '+';
-				continue;
-			case '-':
-			case '_':
-			case '.':
-			case '~':
-				*tmp = c;
-				continue;
-		}
-
-		/* this char will be escaped */
-		tmp[0] = '%';
-		tmp[1] = hd[c >> 4];
-		tmp[2] = hd[c & 0xf];
-
-		tmp += 2;
-	}
-
-	*tmp = '\0';
-
-	return out;
-}
-
-static struct val *__escape(struct val *val, char *(*cvt)(const char*))
+static struct val *__escape(struct val *val, struct arena *arena,
+			   char *(*cvt)(const char *, size_t, struct arena *))
 {
+	struct str *str;
 	char *out;
 
-	out = NULL;
-
 	switch (val->type) {
 		case VT_INT:
-			out = str_of_int(val->i);
-			break;
+			/* integers never need escaping */
+			return val;
 		case VT_STR:
-			out = cvt(str_cstr(val_cast_to_str(val)));
+			str = val_cast_to_str(val);
+
+			out = cvt(str_cstr(str), str_len(str), arena);
+			if (!out)
+				return val; /* nothing to escape, reuse input */
 			break;
 		case VT_NULL:
 			val_putref(val);
@@ -151,22 +84,22 @@ static struct val *__escape(struct val *val, char *(*cvt)(const char*))
 
 	val_putref(val);
 
-	ASSERT(out);
-
-	return VAL_ALLOC_STR(out);
+	/* the string lives in the arena */
+	return str_cast_to_val(str_alloc_static(out));
 }
 
-static struct val *urlescape_fxn(struct val *val)
+static struct val *urlescape_fxn(struct val *val, struct arena *arena)
 {
-	return __escape(val, __urlescape_str);
+	return __escape(val, arena, mangle_urlescape);
 }
 
-static struct val *escape_fxn(struct val *val)
+static struct val *escape_fxn(struct val *val, struct arena *arena)
 {
-	return __escape(val, mangle_htmlescape);
+	return __escape(val, arena, mangle_htmlescape);
 }
 
-static struct val *__datetime(struct val *val, const char *fmt)
+static struct val *__datetime(struct val *val, struct arena *arena,
+			      const char *fmt)
 {
 	char buf[64];
 	struct tm tm;
@@ -180,27 +113,27 @@ static struct val *__datetime(struct val *val, const char *fmt)
 
 	val_putref(val);
 
-	return VAL_DUP_STR(buf);
+	return str_cast_to_val(str_alloc_static(arena_strdup(arena, buf)));
 }
 
-static struct val *time_fxn(struct val *val)
+static struct val *time_fxn(struct val *val, struct arena *arena)
 {
-	return __datetime(val, "%H:%M");
+	return __datetime(val, arena, "%H:%M");
 }
 
-static struct val *date_fxn(struct val *val)
+static struct val *date_fxn(struct val *val, struct arena *arena)
 {
-	return __datetime(val, "%B %e, %Y");
+	return __datetime(val, arena, "%B %e, %Y");
 }
 
-static struct val *zulu_fxn(struct val *val)
+static struct val *zulu_fxn(struct val *val, struct arena *arena)
 {
-	return __datetime(val, "%Y-%m-%dT%H:%M:%SZ");
+	return __datetime(val, arena, "%Y-%m-%dT%H:%M:%SZ");
 }
 
-static struct val *rfc822_fxn(struct val *val)
+static struct val *rfc822_fxn(struct val *val, struct arena *arena)
 {
-	return __datetime(val, "%a, %d %b %Y %H:%M:%S +0000");
+	return __datetime(val, arena, "%a, %d %b %Y %H:%M:%S +0000");
 }
 
 static const struct pipestageinfo stages[] = {
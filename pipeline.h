@@ -26,10 +26,16 @@
 #include <jeffpc/list.h>
 
 #include "vars.h"
+#include "arena.h"
 
+/*
+ * Stages consume the input value and return the output value.  Any
+ * scratch memory (including the output string) may be allocated from the
+ * arena, since the output is only used until the end of the request.
+ */
 struct pipestageinfo {
 	const char *name;
-	struct val *(*f)(struct val *);
+	struct val *(*f)(struct val *, struct arena *);
 };
 
 struct pipestage {
@@ -32,6 +32,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <dirent.h>
+#include <sched.h>
 
 #include <jeffpc/taskq.h>
 #include <jeffpc/error.h>
@@ -50,6 +51,19 @@ static struct mem_cache *post_cache;
 static struct mem_cache *comment_cache;
 
 static LOCK_CLASS(post_lc);
+static LOCK_CLASS(version_lc);
+
+/*
+ * Post versions are reclaimed with a simple two-phase epoch scheme.
+ * Readers register in the counter for the current epoch's parity for the
+ * few instructions it takes to grab a reference to a post's version.  A
+ * writer that swapped out a version flips the epoch and waits for the
+ * readers of the old parity to drain - after that, nobody can still be
+ * looking at the old pointer without holding a reference.
+ */
+static atomic_t version_epoch;
+static atomic_t version_readers[2];
+static struct lock version_lock;	/* serializes synchronizers */
 
 static void post_remove_all_tags(struct rb_tree *taglist);
 static void post_remove_all_comments(struct post *post);
@@ -78,15 +92,67 @@ void init_post_subsys(void)
 					 sizeof(struct comment), 0);
 	ASSERT(!IS_ERR(comment_cache));
 
+	MXINIT(&version_lock, &version_lc);
+
+	init_post_deps();
+	init_post_cache();
 	init_post_index();
 }
 
+static unsigned int version_read_enter(void)
+{
+	for (;;) {
+		unsigned int idx = atomic_read(&version_epoch) & 1;
+
+		atomic_inc(&version_readers[idx]);
+
+		/* make sure the epoch didn't flip before we registered */
+		if ((atomic_read(&version_epoch) & 1) == idx)
+			return idx;
+
+		atomic_dec(&version_readers[idx]);
+	}
+}
+
+static void version_read_exit(unsigned int idx)
+{
+	atomic_dec(&version_readers[idx]);
+}
+
+static void version_synchronize(void)
+{
+	unsigned int idx;
+
+	MXLOCK(&version_lock);
+
+	idx = atomic_read(&version_epoch) & 1;
+	atomic_inc(&version_epoch);
+
+	while (atomic_read(&version_readers[idx]))
+		sched_yield();
+
+	MXUNLOCK(&version_lock);
+}
+
+void post_version_free(struct post_version *version)
+{
+	str_putref(version->title);
+	str_putref(version->twitter_img);
+	nvl_putref(version->files);
+	nvl_putref(version->vars);
+	vars_frame_index_putref(version->frames);
+
+	free(version);
+}
+
 struct str *post_get_cached_file(struct post *post, const char *path)
 {
 	struct str *out;
 	uint64_t rev;
 	int err;
 
+	post_cache_stat(post, path);
+
 	out = file_cache_get(path, &rev);
 	if (IS_ERR(out))
 		return out;
@@ -94,22 +160,58 @@ struct str *post_get_cached_file(struct post *post, const char *path)
 	err = nvl_set_int(post->files, path, rev);
 	if (err) {
 		str_putref(out);
-		out = ERR_PTR(err);
+		return ERR_PTR(err);
 	}
 
+	post_deps_add(post, path, rev);
+
 	return out;
 }
 
-static void post_remove_all_filenames(struct post *post)
+/*
+ * Start over with an empty list of files.  The old list may still be
+ * referenced by the current version, so we replace it instead of
+ * emptying it.
+ */
+static int post_reset_filenames(struct post *post)
 {
-	const struct nvpair *pair;
+	struct nvlist *files;
+	struct nvlist *stats;
 
-	while ((pair = nvl_iter_start(post->files)) != NULL) {
-		struct str *name = nvpair_name_str(pair);
+	files = nvl_alloc();
+	if (IS_ERR(files))
+		return PTR_ERR(files);
 
-		VERIFY0(nvl_unset(post->files, str_cstr(name)));
+	stats = nvl_alloc();
+	if (IS_ERR(stats)) {
+		nvl_putref(files);
+		return PTR_ERR(stats);
+	}
+
+	post_deps_remove(post);
+
+	nvl_putref(post->files);
+	nvl_putref(post->file_stats);
+	post->files = files;
+	post->file_stats = stats;
+
+	return 0;
+}
+
+/* consumes the tag name reference */
+static void post_add_tag(struct rb_tree *taglist, struct str *name)
+{
+	struct post_tag *tag;
 
-		str_putref(name);
+	tag = malloc(sizeof(struct post_tag));
+	ASSERT(tag);
+
+	tag->tag = name;
+
+	if (rb_insert(taglist, tag)) {
+		/* found a duplicate */
+		str_putref(tag->tag);
+		free(tag);
 	}
 }
 
@@ -120,21 +222,10 @@ static void post_add_tags(struct rb_tree *taglist, struct val *list)
 	struct val *tmp;
 
 	sexpr_for_each_noref(tagval, tmp, list) {
-		struct post_tag *tag;
-
 		/* sanity check */
 		ASSERT3U(tagval->type, ==, VT_STR);
 
-		tag = malloc(sizeof(struct post_tag));
-		ASSERT(tag);
-
-		tag->tag = val_getref_str(tagval);
-
-		if (rb_insert(taglist, tag)) {
-			/* found a duplicate */
-			str_putref(tag->tag);
-			free(tag);
-		}
+		post_add_tag(taglist, val_getref_str(tagval));
 	}
 
 	val_putref(list);
@@ -243,6 +334,7 @@ static int __do_load_post_body_fmt3(struct post *post, const struct str *input)
 	x.input          = str_cstr(input);
 	x.len            = str_len(input);
 	x.pos            = 0;
+	x.tokpos         = 0;
 	x.lineno         = 0;
 	x.table_nesting  = 0;
 	x.texttt_nesting = 0;
@@ -251,6 +343,7 @@ static int __do_load_post_body_fmt3(struct post *post, const struct str *input)
 	x.sc_tags        = NULL;
 	x.sc_twitter_img = NULL;
 
+	rope_init(&x.rope);
 	fmt3_lex_init(&x.scanner);
 	fmt3_set_extra(&x, x.scanner);
 
@@ -259,6 +352,7 @@ static int __do_load_post_body_fmt3(struct post *post, const struct str *input)
 		panic("failed to parse post id %u", post->id);
 
 	fmt3_lex_destroy(x.scanner);
+	rope_destroy(&x.rope);
 
 	/*
 	 * Now update struct post based on what we got from the .tex file.
@@ -369,81 +463,332 @@ static int __refresh_published(struct post *post)
 	return 0;
 }
 
-static bool must_refresh(struct post *post)
+/* returns NULL instead of an error if @name isn't set */
+static struct str *__lookup_opt_str(struct nvlist *nvl, const char *name)
+{
+	struct str *str;
+
+	str = nvl_lookup_str(nvl, name);
+
+	return IS_ERR(str) ? NULL : str;
+}
+
+static void __restore_comment(struct post *post, struct nvlist *c)
+{
+	struct comment *comm;
+	uint64_t tmp;
+
+	comm = mem_cache_alloc(comment_cache);
+	ASSERT(comm);
+
+	VERIFY0(nvl_lookup_int(c, "id", &tmp));
+	comm->id = tmp;
+	VERIFY0(nvl_lookup_int(c, "time", &tmp));
+	comm->time = tmp;
+
+	comm->author = __lookup_opt_str(c, "author");
+	comm->email  = __lookup_opt_str(c, "email");
+	comm->ip     = __lookup_opt_str(c, "ip");
+	comm->url    = __lookup_opt_str(c, "url");
+	comm->body   = load_comment(post, comm->id);
+
+	if (!comm->author)
+		comm->author = STATIC_STR("[unknown]");
+
+	list_insert_tail(&post->comments, comm);
+
+	post->numcom++;
+}
+
+/*
+ * Restore the post from a compiled post cache entry (see post_cache.c).
+ * This replaces both __refresh_published() and __load_post_body().
+ */
+static int __refresh_cached(struct post *post, struct nvlist *entry)
 {
 	const struct nvpair *pair;
+	struct nvlist *files;
+	struct val **vals;
+	size_t nvals;
+	uint64_t tmp;
+	size_t i;
+	int ret;
+
+	files = nvl_lookup_nvl(entry, "files");
+	VERIFY(!IS_ERR(files));
+
+	/*
+	 * Pull all the files into the file cache without parsing them, so
+	 * that the dependencies are tracked just like for a parsed post.
+	 */
+	ret = 0;
+	nvl_for_each(pair, files) {
+		struct str *raw;
+
+		raw = post_get_cached_file(post, nvpair_name(pair));
+		if (IS_ERR(raw)) {
+			ret = PTR_ERR(raw);
+			break;
+		}
 
+		str_putref(raw);
+	}
+
+	nvl_putref(files);
+
+	if (ret)
+		return ret;
+
+	VERIFY0(nvl_lookup_int(entry, "time", &tmp));
+	post->time = tmp;
+	VERIFY0(nvl_lookup_int(entry, "fmt", &tmp));
+	post->fmt = tmp;
+	VERIFY0(nvl_lookup_int(entry, "listed", &tmp));
+	post->listed = tmp;
+
+	post->title = nvl_lookup_str(entry, "title");
+	VERIFY(!IS_ERR(post->title));
+
+	str_putref(post->body);
+	post->body = nvl_lookup_str(entry, "body");
+	VERIFY(!IS_ERR(post->body));
+
+	str_putref(post->twitter_img);
+	post->twitter_img = __lookup_opt_str(entry, "twitter_img");
+
+	post_remove_all_tags(&post->tags);
+	post_remove_all_comments(post);
+
+	VERIFY0(nvl_lookup_array(entry, "tags", &vals, &nvals));
+	for (i = 0; i < nvals; i++)
+		post_add_tag(&post->tags, val_getref_str(vals[i]));
+
+	VERIFY0(nvl_lookup_array(entry, "comments", &vals, &nvals));
+	for (i = 0; i < nvals; i++)
+		__restore_comment(post, val_cast_to_nvl(vals[i]));
+
+	return 0;
+}
+
+/* safe to call without the post lock held */
+static bool must_refresh(struct post *post)
+{
 	if (post->preview)
 		return true; /* always refresh previews */
 
-	if (nvl_iter_start(post->files) == NULL)
-		return true; /* no files means we have no idea what is needed */
+	if (!__atomic_load_n(&post->version, __ATOMIC_ACQUIRE))
+		return true; /* never successfully refreshed */
+
+	/* one of the files changed since we last refreshed */
+	return atomic_read(&post->gen) != atomic_read(&post->built_gen);
+}
+
+/*
+ * Build a new version from the post's current state and make it visible
+ * to readers.  Must be called with the post locked.
+ */
+static int post_publish(struct post *post)
+{
+	struct post_version *version;
+	struct post_version *old;
+	struct comment *comm;
 
-	nvl_for_each(pair, post->files) {
-		struct str *name = nvpair_name_str(pair);
-		uint64_t file_rev;
+	version = malloc(sizeof(struct post_version));
+	if (!version)
+		return -ENOMEM;
 
-		ASSERT0(nvpair_value_int(pair, &file_rev));
+	version->vars = post_build_vars(post);
+	if (IS_ERR(version->vars)) {
+		int ret = PTR_ERR(version->vars);
 
-		if (!file_cache_has_newer(str_cstr(name), file_rev)) {
-			str_putref(name);
-			continue;
-		}
+		free(version);
+		return ret;
+	}
+
+	refcnt_init(&version->refcnt, 1);
+	version->frames = vars_frame_index_alloc(version->vars);
+	version->time = post->time;
+	version->title = str_getref(post->title);
+	version->twitter_img = str_getref(post->twitter_img);
+	version->files = nvl_getref(post->files);
 
-		cmn_err(CE_DEBUG, "post %u needs a refresh "
-			"('%s' changed, old rev %"PRIu64")", post->id,
-			str_cstr(name), file_rev);
+	/*
+	 * All of the files were read before we got here, so the build time
+	 * is never older than any of their mtimes.  (Posts & comments can
+	 * be dated in the future, so they count as well.)
+	 */
+	version->last_modified = MAX(post->time, time(NULL));
+	list_for_each(comm, &post->comments)
+		version->last_modified = MAX(version->last_modified,
+					     comm->time);
 
-		str_putref(name);
+	old = __atomic_exchange_n(&post->version, version, __ATOMIC_ACQ_REL);
+	if (!old)
+		return 0;
 
-		return true; /* no need to check oher files, we are refreshing */
+	/* previews are private to the request, so nobody else can see it */
+	if (post->preview) {
+		post_version_putref(old);
+		return 0;
 	}
 
-	return false;
+	/*
+	 * Readers may still be looking at the old version.  Waiting for
+	 * them is left to post_unlock(), so that nobody who wants the post
+	 * lock has to wait along with us.
+	 */
+	ASSERT3P(post->retired, ==, NULL);
+	post->retired = old;
+
+	return 0;
+}
+
+void post_unlock(struct post *post)
+{
+	struct post_version *old;
+
+	old = post->retired;
+	post->retired = NULL;
+
+	MXUNLOCK(&post->lock);
+
+	if (!old)
+		return;
+
+	version_synchronize();
+
+	post_version_putref(old);
+}
+
+/*
+ * Refresh the post unless someone else already is, in which case we
+ * return -EBUSY right away.  If the files change again while the other
+ * refresh is running, the post simply stays stale until the next
+ * post_get_version() (or watcher event) notices.
+ */
+int post_try_refresh(struct post *post)
+{
+	int ret;
+
+	if (atomic_cas(&post->refreshing, 0, 1) != 0)
+		return -EBUSY;
+
+	post_lock(post);
+	ret = post_refresh(post);
+	post_unlock(post);
+
+	atomic_set(&post->refreshing, 0);
+
+	return ret;
+}
+
+/*
+ * Returns a reference to the current version of the post.  If any of the
+ * files it was built from changed, one caller refreshes it while everyone
+ * else keeps getting the previous version.  The only time a caller waits
+ * is when there is no previous version at all.
+ */
+struct post_version *post_get_version(struct post *post)
+{
+	struct post_version *version;
+	unsigned int idx;
+
+	/* previews were just refreshed by load_post() */
+	if (!post->preview && must_refresh(post)) {
+		if (__atomic_load_n(&post->version, __ATOMIC_ACQUIRE)) {
+			int ret;
+
+			/*
+			 * A failed refresh leaves the published version in
+			 * place, so keep serving it; the next request will
+			 * retry since the generation is still stale.
+			 */
+			ret = post_try_refresh(post);
+			if (ret && (ret != -EBUSY))
+				cmn_err(CE_ERROR, "failed to refresh post "
+					"%u: %s", post->id, xstrerror(ret));
+		} else {
+			post_lock(post);
+			ASSERT0(post_refresh(post));
+			post_unlock(post);
+		}
+	}
+
+	idx = version_read_enter();
+	version = post_version_getref(__atomic_load_n(&post->version,
+						      __ATOMIC_ACQUIRE));
+	version_read_exit(idx);
+
+	ASSERT(version);
+
+	return version;
 }
 
 int post_refresh(struct post *post)
 {
+	struct nvlist *entry;
+	bool restored;
+	bool first;
+	uint32_t gen;
 	int ret;
 
 	if (!must_refresh(post))
 		return 0;
 
-	post_remove_all_filenames(post);
+	/* any changes from now on will require another refresh */
+	gen = atomic_read(&post->gen);
+
+	if ((ret = post_reset_filenames(post)))
+		return ret;
 
 	str_putref(post->title);
 	post->title = NULL;
 
+	restored = false;
+
 	if (post->preview) {
 		post->title = STATIC_STR("PREVIEW");
 		post->time  = time(NULL);
 		post->fmt   = 3;
+	} else if ((entry = post_cache_lookup(post->id))) {
+		ret = __refresh_cached(post, entry);
+		nvl_putref(entry);
+		if (ret)
+			return ret;
+
+		restored = true;
 	} else {
 		ret = __refresh_published(post);
 		if (ret)
 			return ret;
 	}
 
-	if ((ret = __load_post_body(post)))
+	if (!restored && (ret = __load_post_body(post)))
+		return ret;
+
+	/* posts are added to the index only after their first refresh */
+	first = !post->version;
+
+	if ((ret = post_publish(post)))
 		return ret;
 
+	atomic_set(&post->built_gen, gen);
+
+	if (!post->preview) {
+		post_cache_update(post, restored);
+		if (!first)
+			index_update_post(post);
+	}
+
 	return 0;
 }
 
-struct post *load_post(int postid, bool preview)
+/* allocate & refresh a post without adding it to the index */
+static struct post *__load_post(int postid, bool preview)
 {
 	struct post *post;
 	int err;
 
-	/*
-	 * If it is *not* a preview, try to get it from the cache.
-	 */
-	if (!preview) {
-		post = index_lookup_post(postid);
-		if (post)
-			return post;
-	}
-
 	post = mem_cache_alloc(post_cache);
 	if (!post) {
 		err = -ENOMEM;
@@ -475,9 +820,6 @@ struct post *load_post(int postid, bool preview)
 	if ((err = post_refresh(post)))
 		goto err_free;
 
-	if (!post->preview)
-		ASSERT0(index_insert_post(post));
-
 	return post;
 
 err_free:
@@ -489,6 +831,27 @@ err:
 	return NULL;
 }
 
+struct post *load_post(int postid, bool preview)
+{
+	struct post *post;
+
+	/*
+	 * If it is *not* a preview, try to get it from the cache.
+	 */
+	if (!preview) {
+		post = index_lookup_post(postid);
+		if (post)
+			return post;
+	}
+
+	post = __load_post(postid, preview);
+
+	if (post && !preview)
+		ASSERT0(index_insert_post(post));
+
+	return post;
+}
+
 static void post_remove_all_tags(struct rb_tree *taglist)
 {
 	struct post_tag *tag;
@@ -509,7 +872,16 @@ void post_destroy(struct post *post)
 	post_remove_all_tags(&post->tags);
 	post_remove_all_comments(post);
 
+	if (post->files)
+		post_deps_remove(post);
+
 	nvl_putref(post->files);
+	nvl_putref(post->file_stats);
+
+	if (post->version)
+		post_version_putref(post->version);
+	if (post->retired)
+		post_version_putref(post->retired);
 
 	str_putref(post->title);
 	str_putref(post->body);
@@ -519,88 +891,362 @@ void post_destroy(struct post *post)
 	mem_cache_free(post_cache, post);
 }
 
+/*
+ * Startup loading is split into four stages:
+ *
+ *  1. enumerate - walk the posts directory relative to its fd and collect
+ *     the ids of all post directories
+ *  2. prefetch  - pull each post's files into the file cache, a batch of
+ *     posts per task, using more threads than there are CPUs since these
+ *     tasks mostly wait on I/O
+ *  3. parse     - as soon as a batch is prefetched, its posts are handed to
+ *     a CPU-sized taskq which loads them without touching the disk
+ *  4. index     - once everything is loaded, all the posts are added to the
+ *     indices in one go
+ *
+ * Stages 2 and 3 overlap, so while the later batches are still being read
+ * in, the earlier ones are already being parsed.  The parse tasks don't
+ * touch the index (and its lock) at all - each stores the post in its own
+ * slot for the index stage to pick up.
+ *
+ * Because of the overlap, the wall clock time of the parse stage is only
+ * the tail after the last prefetch finished.  So, we also add up how long
+ * the tasks of each of the two stages spent working.
+ */
+#define LOAD_BATCH		32
+
+static atomic64_t load_prefetch_busy;
+static atomic64_t load_parse_busy;
+
+struct load_slot {
+	uint32_t postid;
+	struct post *post;
+};
+
+struct load_batch {
+	struct taskq *parse_tq;
+	int postsfd;
+	size_t nslots;
+	struct load_slot *slots;
+};
+
+static void __prefetch_file(const char *path)
+{
+	struct str *str;
+	uint64_t rev;
+
+	str = file_cache_get(path, &rev);
+	if (!IS_ERR(str))
+		str_putref(str);
+}
+
+static void __prefetch_comments(int postsfd, uint32_t postid)
+{
+	const char *data_dir = str_cstr(config.data_dir);
+	char path[FILENAME_MAX];
+	struct dirent *de;
+	uint32_t commid;
+	DIR *dir;
+	int fd;
+
+	snprintf(path, sizeof(path), "%u/comments", postid);
+
+	fd = openat(postsfd, path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return; /* no comments */
+
+	dir = fdopendir(fd);
+	if (!dir) {
+		close(fd);
+		return;
+	}
+
+	while ((de = readdir(dir))) {
+		if (str2u32(de->d_name, &commid))
+			continue;
+
+		/* these must match the paths used by post_add_comment() */
+		snprintf(path, sizeof(path), "%s/posts/%u/comments/%u/meta.lisp",
+			 data_dir, postid, commid);
+		__prefetch_file(path);
+
+		snprintf(path, sizeof(path), "%s/posts/%u/comments/%u/text.txt",
+			 data_dir, postid, commid);
+		__prefetch_file(path);
+	}
+
+	closedir(dir);
+}
+
 static void __tq_load_post(void *arg)
 {
-	int postid = (uintptr_t) arg;
+	struct load_slot *slot = arg;
+	uint64_t start;
+
+	start = gettime();
 
-	/* load the post, but then free it since we don't need it */
-	post_putref(load_post(postid, false));
+	slot->post = __load_post(slot->postid, false);
+
+	atomic_add(&load_parse_busy, gettime() - start);
 }
 
-int load_all_posts(void)
+static void __tq_prefetch_batch(void *arg)
 {
 	const char *data_dir = str_cstr(config.data_dir);
+	struct load_batch *batch = arg;
 	char path[FILENAME_MAX];
+	uint64_t start;
+	size_t i;
+
+	start = gettime();
+
+	for (i = 0; i < batch->nslots; i++) {
+		uint32_t postid = batch->slots[i].postid;
+
+		snprintf(path, sizeof(path), "%s/posts/%u/post.lisp",
+			 data_dir, postid);
+		__prefetch_file(path);
+
+		/* fmt3 is the only supported format */
+		snprintf(path, sizeof(path), "%s/posts/%u/post.tex",
+			 data_dir, postid);
+		__prefetch_file(path);
+
+		__prefetch_comments(batch->postsfd, postid);
+	}
+
+	atomic_add(&load_prefetch_busy, gettime() - start);
+
+	for (i = 0; i < batch->nslots; i++) {
+		struct load_slot *slot = &batch->slots[i];
+
+		if (taskq_dispatch(batch->parse_tq, __tq_load_post, slot))
+			__tq_load_post(slot);
+	}
+
+	free(batch);
+}
+
+static int enumerate_posts(int postsfd, struct load_slot **slots_r,
+			   size_t *nposts_r)
+{
+	struct load_slot *slots;
 	struct stat statbuf;
 	struct dirent *de;
-	uint32_t postid;
-	uint64_t start_ts, end_ts;
-	unsigned nposts;
-	struct taskq *tq;
+	size_t nposts;
+	size_t size;
 	DIR *dir;
-	int ret;
+	int fd;
 
-	snprintf(path, sizeof(path), "%s/posts", data_dir);
-	dir = opendir(path);
-	if (!dir)
+	/* fdopendir takes ownership of the fd, so give it a copy */
+	fd = dup(postsfd);
+	if (fd < 0)
 		return -errno;
 
-	tq = taskq_create_fixed("load-all-posts", -1);
-	if (IS_ERR(tq)) {
-		closedir(dir);
-		return PTR_ERR(tq);
+	dir = fdopendir(fd);
+	if (!dir) {
+		int ret = -errno;
+
+		close(fd);
+		return ret;
 	}
 
+	slots = NULL;
 	nposts = 0;
-	start_ts = gettime();
+	size = 0;
 
 	while ((de = readdir(dir))) {
+		uint32_t postid;
+
 		if (!strcmp(de->d_name, ".") ||
 		    !strcmp(de->d_name, ".."))
 			continue;
 
-		ret = str2u32(de->d_name, &postid);
-		if (ret) {
-			cmn_err(CE_INFO, "skipping '%s/%s' - not a number",
-				data_dir, de->d_name);
+		if (str2u32(de->d_name, &postid)) {
+			cmn_err(CE_INFO, "skipping 'posts/%s' - not a number",
+				de->d_name);
 			continue;
 		}
 
-		snprintf(path, FILENAME_MAX, "%s/posts/%u", data_dir, postid);
-
 		/* check that it is a directory */
-		ret = xlstat(path, &statbuf);
-		if (ret) {
-			cmn_err(CE_INFO, "skipping '%s' - failed to xlstat: %s",
-				path, xstrerror(ret));
+		if (fstatat(postsfd, de->d_name, &statbuf,
+			    AT_SYMLINK_NOFOLLOW) == -1) {
+			cmn_err(CE_INFO, "skipping 'posts/%s' - failed to "
+				"fstatat: %s", de->d_name, xstrerror(-errno));
 			continue;
 		}
 
 		if (!S_ISDIR(statbuf.st_mode)) {
-			cmn_err(CE_INFO, "skipping '%s' - not a directory; "
-				"mode = %o", path,
+			cmn_err(CE_INFO, "skipping 'posts/%s' - not a directory; "
+				"mode = %o", de->d_name,
 				(unsigned int) statbuf.st_mode);
 			continue;
 		}
 
-		/* load the post asynchronously */
-		if (taskq_dispatch(tq, __tq_load_post, (void *)(uintptr_t) postid))
-			__tq_load_post((void *)(uintptr_t) postid);
+		if (nposts == size) {
+			struct load_slot *tmp;
+
+			size = size ? size * 2 : 1024;
+
+			tmp = mem_reallocarray(slots, size,
+					       sizeof(struct load_slot));
+			if (!tmp) {
+				free(slots);
+				closedir(dir);
+				return -ENOMEM;
+			}
 
+			slots = tmp;
+		}
+
+		slots[nposts].postid = postid;
+		slots[nposts].post = NULL;
 		nposts++;
 	}
 
-	taskq_wait(tq);
-	taskq_destroy(tq);
+	closedir(dir);
+
+	*slots_r = slots;
+	*nposts_r = nposts;
+
+	return 0;
+}
+
+static void load_stages(int postsfd, struct load_slot *slots, size_t nposts,
+			struct taskq *io_tq, struct taskq *parse_tq,
+			uint64_t *prefetch_ts)
+{
+	size_t i;
+
+	for (i = 0; i < nposts; i += LOAD_BATCH) {
+		struct load_batch *batch;
+
+		batch = malloc(sizeof(struct load_batch));
+		ASSERT(batch);
+
+		batch->parse_tq = parse_tq;
+		batch->postsfd = postsfd;
+		batch->nslots = MIN(nposts - i, LOAD_BATCH);
+		batch->slots = &slots[i];
+
+		if (taskq_dispatch(io_tq, __tq_prefetch_batch, batch))
+			__tq_prefetch_batch(batch);
+	}
+
+	/* every prefetch task dispatches its parse tasks before finishing */
+	taskq_wait(io_tq);
+	*prefetch_ts = gettime();
+
+	taskq_wait(parse_tq);
+}
+
+static void index_loaded_posts(struct load_slot *slots, size_t nposts)
+{
+	struct post **posts;
+	size_t i;
+
+	posts = mem_reallocarray(NULL, nposts, sizeof(struct post *));
+	ASSERT(!nposts || posts);
+
+	for (i = 0; i < nposts; i++)
+		posts[i] = slots[i].post;
+
+	index_insert_posts(posts, nposts);
+
+	/* the index has its own references */
+	for (i = 0; i < nposts; i++)
+		post_putref(posts[i]);
+
+	free(posts);
+}
+
+#define TS_FMT			"%"PRIu64".%09"PRIu64
+#define TS_ARGS(ns)		((ns) / 1000000000UL), ((ns) % 1000000000UL)
+
+int load_all_posts(void)
+{
+	const char *data_dir = str_cstr(config.data_dir);
+	uint64_t start_ts, enum_ts, prefetch_ts, parse_ts, index_ts, end_ts;
+	struct taskq *parse_tq;
+	struct taskq *io_tq;
+	struct load_slot *slots;
+	char path[FILENAME_MAX];
+	size_t nposts;
+	long ncpus;
+	int postsfd;
+	int ret;
+
+	snprintf(path, sizeof(path), "%s/posts", data_dir);
+	postsfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (postsfd < 0)
+		return -errno;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1)
+		ncpus = 1;
+
+	parse_tq = taskq_create_fixed("load-parse", ncpus);
+	if (IS_ERR(parse_tq)) {
+		ret = PTR_ERR(parse_tq);
+		goto err_close;
+	}
+
+	io_tq = taskq_create_fixed("load-prefetch", 2 * ncpus);
+	if (IS_ERR(io_tq)) {
+		ret = PTR_ERR(io_tq);
+		goto err_parse;
+	}
+
+	post_cache_load();
+
+	start_ts = gettime();
+
+	ret = enumerate_posts(postsfd, &slots, &nposts);
+	if (ret)
+		goto err_io;
+
+	enum_ts = gettime();
+
+	load_stages(postsfd, slots, nposts, io_tq, parse_tq, &prefetch_ts);
+
+	parse_ts = gettime();
+
+	index_loaded_posts(slots, nposts);
+
+	index_ts = gettime();
+
+	free(slots);
+	taskq_destroy(io_tq);
+	taskq_destroy(parse_tq);
+	close(postsfd);
+
+	post_cache_save();
 
 	end_ts = gettime();
 
-	cmn_err(CE_INFO, "Loaded %u posts in %"PRIu64".%09"PRIu64" seconds",
+	cmn_err(CE_INFO, "Loaded %zu posts in "TS_FMT" seconds (enumerate "
+		TS_FMT", prefetch "TS_FMT" (busy "TS_FMT"), parse tail "TS_FMT
+		" (busy "TS_FMT"), index "TS_FMT", cache save "TS_FMT")",
 		nposts,
-		(end_ts - start_ts) / 1000000000UL,
-		(end_ts - start_ts) % 1000000000UL);
-
-	closedir(dir);
+		TS_ARGS(end_ts - start_ts),
+		TS_ARGS(enum_ts - start_ts),
+		TS_ARGS(prefetch_ts - enum_ts),
+		TS_ARGS(atomic_read(&load_prefetch_busy)),
+		TS_ARGS(parse_ts - prefetch_ts),
+		TS_ARGS(atomic_read(&load_parse_busy)),
+		TS_ARGS(index_ts - parse_ts),
+		TS_ARGS(end_ts - index_ts));
 
 	return 0;
+
+err_io:
+	taskq_destroy(io_tq);
+
+err_parse:
+	taskq_destroy(parse_tq);
+
+err_close:
+	close(postsfd);
+
+	return ret;
 }
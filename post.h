@@ -26,6 +26,7 @@
 #include <time.h>
 #include <stdbool.h>
 
+#include <jeffpc/atomic.h>
 #include <jeffpc/synch.h>
 #include <jeffpc/refcnt.h>
 #include <jeffpc/list.h>
@@ -50,6 +51,28 @@ struct comment {
 	struct str *body;
 };
 
+/*
+ * An immutable snapshot of everything readers need from a post.  Every
+ * refresh builds a new one and publishes it with an atomic pointer swap,
+ * so readers never have to take the post lock (see post_get_version()).
+ */
+struct post_version {
+	refcnt_t refcnt;
+
+	unsigned int time;
+	uint64_t last_modified;	/* when this version was built */
+	struct str *title;
+	struct str *twitter_img;
+
+	struct nvlist *files;	/* files (& revisions) it was built from */
+	struct nvlist *vars;	/* what templates see */
+	struct vars_frame_index *frames; /* symbol-indexed vars */
+};
+
+/*
+ * Other than the version pointer and the generations, everything here is
+ * the working state of post_refresh() and is protected by the lock.
+ */
 struct post {
 	refcnt_t refcnt;
 
@@ -79,6 +102,23 @@ struct post {
 
 	/* filenames used to construct this post */
 	struct nvlist *files;
+	struct nvlist *file_stats;	/* their sizes & mtimes (post_cache.c) */
+
+	/*
+	 * Bumped whenever one of the files changes (see post_deps.c).  If
+	 * it differs from built_gen, the post needs a refresh.
+	 */
+	atomic_t gen;
+	atomic_t built_gen;
+
+	/* set while someone is in post_try_refresh() */
+	atomic_t refreshing;
+
+	/* the current version - readers use post_get_version() */
+	struct post_version *version;
+
+	/* replaced by the last refresh, freed by post_unlock() */
+	struct post_version *retired;
 };
 
 struct req;
@@ -87,7 +127,12 @@ extern void init_post_subsys(void);
 extern struct str *post_get_cached_file(struct post *post, const char *path);
 extern struct post *load_post(int postid, bool preview);
 extern int post_refresh(struct post *post);
+extern int post_try_refresh(struct post *post);
+extern void post_unlock(struct post *post);
 extern void post_destroy(struct post *post);
+extern struct post_version *post_get_version(struct post *post);
+extern void post_version_free(struct post_version *version);
+extern struct nvlist *post_build_vars(struct post *post);
 extern void load_posts(struct req *req, struct post **posts, int nposts,
 		       bool moreposts);
 extern int load_all_posts(void);
@@ -95,29 +140,47 @@ extern void free_all_posts(void);
 extern struct nvlist *get_post(struct req *req, int postid,
 			       const char *titlevar, bool preview);
 
+extern void init_post_deps(void);
+extern void post_deps_start(void);
+extern void post_deps_add(struct post *post, const char *path, uint64_t rev);
+extern void post_deps_remove(struct post *post);
+extern void post_deps_changed(const char *path);
+extern void post_deps_changed_all(void);
+
+extern void init_post_cache(void);
+extern void post_cache_load(void);
+extern void post_cache_stat(struct post *post, const char *path);
+extern struct nvlist *post_cache_lookup(unsigned int postid);
+extern void post_cache_update(struct post *post, bool restored);
+extern void post_cache_save(void);
+
 extern void init_post_index(void);
 extern struct post *index_lookup_post(unsigned int postid);
 extern int index_get_posts(struct post **ret, struct str *tagname,
 			   bool (*pred)(struct post *, void *),
 			   void *private, int skip, int nposts);
+extern int index_get_month_posts(struct post **ret, unsigned int archid,
+				 int skip, int nposts);
 extern void index_for_each_tag(int (*init)(void *, unsigned long),
 			       void (*step)(void *, struct str *, unsigned long,
 					    unsigned long, unsigned long),
 			       void *private);
 extern int index_insert_post(struct post *post);
+extern void index_insert_posts(struct post **posts, size_t nposts);
+extern void index_update_post(struct post *post);
+extern uint64_t index_get_generation(void);
+extern uint64_t index_get_last_change(void);
+extern void index_get_lock_stats(uint64_t *acquires, uint64_t *wait_time);
 
 REFCNT_INLINE_FXNS(struct post, post, refcnt, post_destroy, NULL)
+REFCNT_INLINE_FXNS(struct post_version, post_version, refcnt,
+		   post_version_free, NULL)
 
 static inline void post_lock(struct post *post)
 {
 	MXLOCK(&post->lock);
 }
 
-static inline void post_unlock(struct post *post)
-{
-	MXUNLOCK(&post->lock);
-}
-
 #define max(a,b)	((a)<(b)? (b) : (a))
 
 #endif
@@ -0,0 +1,547 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/io.h>
+#include <jeffpc/mem.h>
+#include <jeffpc/nvl.h>
+#include <jeffpc/synch.h>
+
+#include "config.h"
+#include "post.h"
+#include "version.h"
+#include "debug.h"
+
+/*
+ * Compiled post cache
+ *
+ * Parsing every post (and every comment's metadata) at startup takes a
+ * while with a big archive.  So, once all the posts are loaded we save
+ * what we got out of them - the rendered body, title, tags, comment
+ * metadata, etc. - in a single CBOR file in the data directory along with
+ * the size and mtime of every file each post was built from.
+ *
+ * On the next startup, a post whose files all still have the same size
+ * and mtime is restored from the cache instead of being parsed.  The
+ * files are still read into the file cache so that dependency tracking
+ * works the same as for a parsed post.
+ *
+ * The rendered body depends on the blahgd version and on a few config
+ * options, so those (along with the layout of the entries) make up the
+ * cache key and a mismatch throws away the whole cache.  Since the version
+ * doesn't change across local rebuilds, each entry is also checked before
+ * use and anything that doesn't look right is simply parsed again.
+ *
+ * Only startup uses the cache - posts refreshed while the daemon runs are
+ * simply parsed again on the next startup.
+ */
+
+#define POST_CACHE_FNAME	"post-cache.cbor"
+
+/* bump whenever the layout of the entries changes */
+#define POST_CACHE_SCHEMA	"1"
+
+static struct lock cache_lock;
+static LOCK_CLASS(cache_lc);
+
+static struct nvlist *old_cache;	/* loaded at startup, read-only */
+static struct nvlist *new_cache;	/* being built, protected by lock */
+static bool dirty;			/* some posts had to be parsed */
+
+static struct str *cache_key(void)
+{
+	return str_cat(11, STATIC_STR(POST_CACHE_SCHEMA), STATIC_STR("\n"),
+		       STR_DUP(version_string), STATIC_STR("\n"),
+		       str_getref(config.base_url), STATIC_STR("\n"),
+		       str_getref(config.photo_base_url), STATIC_STR("\n"),
+		       str_getref(config.wiki_base_url), STATIC_STR("\n"),
+		       str_getref(config.bug_base_url));
+}
+
+static void cache_path(char *path, size_t len, const char *suffix)
+{
+	snprintf(path, len, "%s/%s%s", str_cstr(config.data_dir),
+		 POST_CACHE_FNAME, suffix);
+}
+
+static struct nvlist *__load(struct str *key)
+{
+	char path[FILENAME_MAX];
+	struct nvlist *posts;
+	struct nvlist *nvl;
+	struct str *tmp;
+	size_t len;
+	char *raw;
+
+	cache_path(path, sizeof(path), "");
+
+	raw = read_file_len(path, &len);
+	if (IS_ERR(raw)) {
+		cmn_err(CE_INFO, "Not using post cache '%s': %s", path,
+			xstrerror(PTR_ERR(raw)));
+		return NULL;
+	}
+
+	nvl = nvl_unpack(raw, len, VF_CBOR);
+
+	free(raw);
+
+	if (IS_ERR(nvl)) {
+		cmn_err(CE_WARN, "Failed to unpack post cache '%s': %s", path,
+			xstrerror(PTR_ERR(nvl)));
+		return NULL;
+	}
+
+	posts = NULL;
+
+	tmp = nvl_lookup_str(nvl, "key");
+	if (IS_ERR(tmp)) {
+		cmn_err(CE_WARN, "Post cache '%s' is missing a key", path);
+	} else if (strcmp(str_cstr(tmp), str_cstr(key))) {
+		cmn_err(CE_INFO, "Not using post cache '%s': different "
+			"version or config", path);
+		str_putref(tmp);
+	} else {
+		posts = nvl_lookup_nvl(nvl, "posts");
+		if (IS_ERR(posts))
+			posts = NULL;
+		str_putref(tmp);
+	}
+
+	nvl_putref(nvl);
+
+	return posts;
+}
+
+void init_post_cache(void)
+{
+	MXINIT(&cache_lock, &cache_lc);
+}
+
+/*
+ * Load the cache saved by the previous run and start collecting entries
+ * for the next one.
+ */
+void post_cache_load(void)
+{
+	struct str *key;
+
+	if (!config.post_cache)
+		return;
+
+	key = cache_key();
+
+	old_cache = __load(key);
+
+	new_cache = nvl_alloc();
+	ASSERT(new_cache);
+
+	VERIFY0(nvl_set_str(new_cache, "key", key));
+	VERIFY0(nvl_set_nvl(new_cache, "posts", nvl_alloc()));
+}
+
+static uint64_t __mtime(const struct stat *st)
+{
+	return st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec;
+}
+
+/*
+ * Remember the size & mtime of a file the post is about to be built from.
+ * This happens *before* the file is read, so that a change racing with the
+ * read makes the entry look stale rather than fresh.
+ */
+void post_cache_stat(struct post *post, const char *path)
+{
+	struct nvlist *nvl;
+	struct stat st;
+
+	if (!new_cache || post->preview)
+		return;
+
+	if (xstat(path, &st))
+		return; /* the entry won't be saved, see post_cache_update() */
+
+	nvl = nvl_alloc();
+	ASSERT(nvl);
+
+	VERIFY0(nvl_set_int(nvl, "size", st.st_size));
+	VERIFY0(nvl_set_int(nvl, "mtime", __mtime(&st)));
+	VERIFY0(nvl_set_nvl(post->file_stats, path, nvl));
+}
+
+static bool __file_unchanged(const char *path, struct nvlist *saved)
+{
+	uint64_t size, mtime;
+	struct stat st;
+
+	if (nvl_lookup_int(saved, "size", &size) ||
+	    nvl_lookup_int(saved, "mtime", &mtime))
+		return false;
+
+	if (xstat(path, &st))
+		return false;
+
+	return (size == st.st_size) && (mtime == __mtime(&st));
+}
+
+static bool __has_int(struct nvlist *nvl, const char *name)
+{
+	uint64_t tmp;
+
+	return !nvl_lookup_int(nvl, name, &tmp);
+}
+
+static bool __has_str(struct nvlist *nvl, const char *name)
+{
+	struct str *str;
+
+	str = nvl_lookup_str(nvl, name);
+	if (IS_ERR(str))
+		return false;
+
+	str_putref(str);
+
+	return true;
+}
+
+/* optional values may be missing, but must have the right type if present */
+static bool __opt_str_ok(struct nvlist *nvl, const char *name)
+{
+	return !nvl_exists(nvl, name) || __has_str(nvl, name);
+}
+
+static bool __array_ok(struct nvlist *nvl, const char *name,
+		       bool (*item_ok)(struct val *))
+{
+	struct val **vals;
+	size_t nvals;
+	size_t i;
+
+	if (nvl_lookup_array(nvl, name, &vals, &nvals))
+		return false;
+
+	for (i = 0; i < nvals; i++)
+		if (!item_ok(vals[i]))
+			return false;
+
+	return true;
+}
+
+static bool __tag_ok(struct val *val)
+{
+	return val->type == VT_STR;
+}
+
+static bool __comment_ok(struct val *val)
+{
+	struct nvlist *c;
+
+	if (val->type != VT_NVL)
+		return false;
+
+	c = val_cast_to_nvl(val);
+
+	return __has_int(c, "id") &&
+		__has_int(c, "time") &&
+		__opt_str_ok(c, "author") &&
+		__opt_str_ok(c, "email") &&
+		__opt_str_ok(c, "ip") &&
+		__opt_str_ok(c, "url");
+}
+
+/*
+ * Make sure the entry has everything __refresh_cached() needs, with the
+ * right types.  (The files are checked separately.)
+ */
+static bool __entry_ok(struct nvlist *entry)
+{
+	return __has_int(entry, "time") &&
+		__has_int(entry, "fmt") &&
+		__has_int(entry, "listed") &&
+		__has_str(entry, "title") &&
+		__has_str(entry, "body") &&
+		__opt_str_ok(entry, "twitter_img") &&
+		__array_ok(entry, "tags", __tag_ok) &&
+		__array_ok(entry, "comments", __comment_ok);
+}
+
+/*
+ * Returns the cache entry for @postid if it is intact and none of the
+ * files it was built from changed, NULL otherwise.
+ */
+struct nvlist *post_cache_lookup(unsigned int postid)
+{
+	const struct nvpair *pair;
+	struct nvlist *entry;
+	struct nvlist *files;
+	char name[16];
+	bool ok;
+
+	if (!old_cache)
+		return NULL;
+
+	snprintf(name, sizeof(name), "%u", postid);
+
+	entry = nvl_lookup_nvl(old_cache, name);
+	if (IS_ERR(entry))
+		return NULL;
+
+	if (!__entry_ok(entry)) {
+		cmn_err(CE_WARN, "Ignoring damaged post cache entry for post "
+			"id %u", postid);
+		nvl_putref(entry);
+		return NULL;
+	}
+
+	files = nvl_lookup_nvl(entry, "files");
+	if (IS_ERR(files)) {
+		nvl_putref(entry);
+		return NULL;
+	}
+
+	ok = true;
+
+	nvl_for_each(pair, files) {
+		struct nvlist *saved;
+
+		saved = nvl_lookup_nvl(files, nvpair_name(pair));
+		ok = !IS_ERR(saved) && __file_unchanged(nvpair_name(pair),
+							 saved);
+		if (!IS_ERR(saved))
+			nvl_putref(saved);
+
+		if (!ok)
+			break;
+	}
+
+	nvl_putref(files);
+
+	if (!ok) {
+		nvl_putref(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+static struct nvlist *__build_entry(struct post *post)
+{
+	const struct nvpair *pair;
+	struct post_tag *tag;
+	struct comment *comm;
+	struct nvlist *files;
+	struct nvlist *entry;
+	struct val **tags;
+	struct val **comments;
+	size_t i;
+
+	/* we need the stats of all the files */
+	nvl_for_each(pair, post->files)
+		if (!nvl_exists(post->file_stats, nvpair_name(pair)))
+			return NULL;
+
+	entry = nvl_alloc();
+	ASSERT(entry);
+
+	files = nvl_alloc();
+	ASSERT(files);
+
+	VERIFY0(nvl_merge(files, post->file_stats));
+
+	VERIFY0(nvl_set_nvl(entry, "files", files));
+	VERIFY0(nvl_set_int(entry, "time", post->time));
+	VERIFY0(nvl_set_int(entry, "fmt", post->fmt));
+	VERIFY0(nvl_set_int(entry, "listed", post->listed));
+	VERIFY0(nvl_set_str(entry, "title", str_getref(post->title)));
+	VERIFY0(nvl_set_str(entry, "body", str_getref(post->body)));
+	if (post->twitter_img)
+		VERIFY0(nvl_set_str(entry, "twitter_img",
+				    str_getref(post->twitter_img)));
+
+	tags = mem_reallocarray(NULL, rb_numnodes(&post->tags),
+				sizeof(struct val *));
+	ASSERT(tags);
+
+	i = 0;
+	rb_for_each(&post->tags, tag)
+		tags[i++] = str_getref_val(tag->tag);
+
+	VERIFY0(nvl_set_array(entry, "tags", tags, i));
+
+	/* the comment text itself comes from the file cache on restore */
+	comments = mem_reallocarray(NULL, post->numcom, sizeof(struct val *));
+	ASSERT(comments || !post->numcom);
+
+	i = 0;
+	list_for_each(comm, &post->comments) {
+		struct nvlist *c;
+
+		c = nvl_alloc();
+		ASSERT(c);
+
+		VERIFY0(nvl_set_int(c, "id", comm->id));
+		VERIFY0(nvl_set_int(c, "time", comm->time));
+		VERIFY0(nvl_set_str(c, "author", str_getref(comm->author)));
+		if (comm->email)
+			VERIFY0(nvl_set_str(c, "email",
+					    str_getref(comm->email)));
+		if (comm->ip)
+			VERIFY0(nvl_set_str(c, "ip", str_getref(comm->ip)));
+		if (comm->url)
+			VERIFY0(nvl_set_str(c, "url", str_getref(comm->url)));
+
+		comments[i++] = nvl_cast_to_val(c);
+	}
+
+	VERIFY0(nvl_set_array(entry, "comments", comments, i));
+
+	return entry;
+}
+
+/*
+ * Add the freshly built (or restored) @post to the cache being collected.
+ * Must be called with the post locked.
+ */
+void post_cache_update(struct post *post, bool restored)
+{
+	struct nvlist *entry;
+	struct nvlist *posts;
+	char name[16];
+
+	if (!new_cache || post->preview)
+		return;
+
+	entry = __build_entry(post);
+	if (!entry)
+		return;
+
+	snprintf(name, sizeof(name), "%u", post->id);
+
+	MXLOCK(&cache_lock);
+	if (new_cache) {
+		posts = nvl_lookup_nvl(new_cache, "posts");
+		VERIFY(!IS_ERR(posts));
+
+		VERIFY0(nvl_set_nvl(posts, name, entry));
+
+		nvl_putref(posts);
+
+		if (!restored)
+			dirty = true;
+	} else {
+		nvl_putref(entry);
+	}
+	MXUNLOCK(&cache_lock);
+}
+
+static int __save(struct nvlist *cache)
+{
+	char tmppath[FILENAME_MAX];
+	char path[FILENAME_MAX];
+	struct buffer *buf;
+	FILE *f;
+	int ret;
+
+	cache_path(path, sizeof(path), "");
+	cache_path(tmppath, sizeof(tmppath), ".tmp");
+
+	buf = nvl_pack(cache, VF_CBOR);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	f = fopen(tmppath, "w");
+	if (!f) {
+		ret = -errno;
+		goto err_buf;
+	}
+
+	if (fwrite(buffer_data(buf), 1, buffer_size(buf), f) !=
+	    buffer_size(buf)) {
+		ret = -EIO;
+		fclose(f);
+		goto err_unlink;
+	}
+
+	if (fclose(f)) {
+		ret = -errno;
+		goto err_unlink;
+	}
+
+	/* replace the old cache atomically */
+	if (rename(tmppath, path)) {
+		ret = -errno;
+		goto err_unlink;
+	}
+
+	buffer_free(buf);
+
+	return 0;
+
+err_unlink:
+	unlink(tmppath);
+
+err_buf:
+	buffer_free(buf);
+
+	return ret;
+}
+
+/*
+ * Stop collecting entries and, if anything had to be parsed, write out
+ * the new cache for the next startup.
+ */
+void post_cache_save(void)
+{
+	struct nvlist *cache;
+	bool write;
+	int ret;
+
+	MXLOCK(&cache_lock);
+	cache = new_cache;
+	write = dirty;
+	new_cache = NULL;
+	MXUNLOCK(&cache_lock);
+
+	if (old_cache) {
+		nvl_putref(old_cache);
+		old_cache = NULL;
+	}
+
+	if (!cache)
+		return;
+
+	if (write) {
+		ret = __save(cache);
+		if (ret)
+			cmn_err(CE_WARN, "Failed to save post cache: %s",
+				xstrerror(ret));
+	}
+
+	nvl_putref(cache);
+}
@@ -0,0 +1,295 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/atomic.h>
+#include <jeffpc/synch.h>
+#include <jeffpc/thread.h>
+#include <jeffpc/rbtree.h>
+#include <jeffpc/file-cache.h>
+
+#include "post.h"
+#include "utils.h"
+#include "debug.h"
+
+/*
+ * Post file dependencies
+ *
+ * Every file a (non-preview) post was built from is registered here along
+ * with the revision that was used.  When one changes, the generation of
+ * the post that depends on it is bumped.  Changes are normally reported
+ * by the filesystem watcher (see watch.c); without it, a background
+ * thread periodically checks all the registered files.  Deciding whether
+ * a post needs a refresh is then a single integer comparison on the
+ * request path, instead of a file cache check for every file the post
+ * uses.
+ *
+ * Every file lives in its post's directory, so each file has exactly one
+ * dependent post.
+ *
+ * The checker walks the files in batches, checking each batch without
+ * holding the lock, so that posts being refreshed can update their
+ * dependencies in the meantime.
+ */
+
+#define POST_DEPS_CHECK_USEC	1000000	/* how often to check the files */
+#define POST_DEPS_CHECK_BATCH	32	/* files per batch */
+
+struct dep_check {
+	char *path;
+	uint64_t rev;
+};
+
+struct post_dep {
+	struct rb_node node;
+	char *path;
+	uint64_t rev;
+	struct post *post;	/* not referenced, see post_deps_remove() */
+	bool stale;
+};
+
+static struct rb_tree deps;
+static struct lock deps_lock;
+static LOCK_CLASS(deps_lc);
+
+static int dep_cmp(const void *va, const void *vb)
+{
+	const struct post_dep *a = va;
+	const struct post_dep *b = vb;
+	int ret;
+
+	ret = strcmp(a->path, b->path);
+	if (ret < 0)
+		return -1;
+	if (ret > 0)
+		return 1;
+	return 0;
+}
+
+void init_post_deps(void)
+{
+	rb_create(&deps, dep_cmp, sizeof(struct post_dep),
+		  offsetof(struct post_dep, node));
+
+	MXINIT(&deps_lock, &deps_lc);
+}
+
+void post_deps_add(struct post *post, const char *path, uint64_t rev)
+{
+	struct post_dep key = {
+		.path = (char *) path,
+	};
+	struct rb_cookie where;
+	struct post_dep *dep;
+
+	if (post->preview)
+		return; /* previews are always refreshed */
+
+	MXLOCK(&deps_lock);
+	dep = rb_find(&deps, &key, &where);
+	if (!dep) {
+		dep = malloc(sizeof(struct post_dep));
+		ASSERT(dep);
+
+		dep->path = xstrdup(path);
+
+		rb_insert_here(&deps, dep, &where);
+	}
+
+	dep->rev = rev;
+	dep->post = post;
+	dep->stale = false;
+	MXUNLOCK(&deps_lock);
+}
+
+/*
+ * Forget all the files @post depends on.  This must be done before the
+ * post is freed.
+ */
+void post_deps_remove(struct post *post)
+{
+	const struct nvpair *pair;
+
+	if (post->preview)
+		return;
+
+	MXLOCK(&deps_lock);
+	nvl_for_each(pair, post->files) {
+		struct post_dep key = {
+			.path = (char *) nvpair_name(pair),
+		};
+		struct post_dep *dep;
+
+		dep = rb_find(&deps, &key, NULL);
+		if (!dep || (dep->post != post))
+			continue;
+
+		rb_remove(&deps, dep);
+		free(dep->path);
+		free(dep);
+	}
+	MXUNLOCK(&deps_lock);
+}
+
+/* must be called with deps_lock held */
+static void __changed(struct post_dep *dep)
+{
+	if (dep->stale)
+		return;
+
+	cmn_err(CE_DEBUG, "post %u needs a refresh ('%s' changed, old rev "
+		"%"PRIu64")", dep->post->id, dep->path, dep->rev);
+
+	dep->stale = true;
+	atomic_inc(&dep->post->gen);
+}
+
+/*
+ * Mark the post depending on @path as needing a refresh.
+ */
+void post_deps_changed(const char *path)
+{
+	struct post_dep key = {
+		.path = (char *) path,
+	};
+	struct post_dep *dep;
+
+	MXLOCK(&deps_lock);
+	dep = rb_find(&deps, &key, NULL);
+	if (dep)
+		__changed(dep);
+	MXUNLOCK(&deps_lock);
+}
+
+/*
+ * Grab the next batch of non-stale files after @last (or from the start if
+ * @last is NULL).  Returns the number of files in the batch.
+ */
+static size_t __get_batch(const char *last, struct dep_check *batch)
+{
+	struct post_dep key = {
+		.path = (char *) last,
+	};
+	struct rb_cookie where;
+	struct post_dep *dep;
+	size_t n;
+
+	MXLOCK(&deps_lock);
+	if (!last) {
+		dep = rb_first(&deps);
+	} else {
+		dep = rb_find(&deps, &key, &where);
+		if (dep)
+			dep = rb_next(&deps, dep);
+		else
+			dep = rb_nearest_gt(&deps, &where);
+	}
+
+	for (n = 0; dep && (n < POST_DEPS_CHECK_BATCH);
+	     dep = rb_next(&deps, dep)) {
+		if (dep->stale)
+			continue;
+
+		batch[n].path = xstrdup(dep->path);
+		batch[n].rev = dep->rev;
+		n++;
+	}
+	MXUNLOCK(&deps_lock);
+
+	return n;
+}
+
+static void check_file(struct dep_check *check)
+{
+	struct post_dep key = {
+		.path = check->path,
+	};
+	struct post_dep *dep;
+
+	if (!file_cache_has_newer(check->path, check->rev))
+		return;
+
+	MXLOCK(&deps_lock);
+	dep = rb_find(&deps, &key, NULL);
+	/* skip it if the post was refreshed or removed in the meantime */
+	if (dep && (dep->rev == check->rev))
+		__changed(dep);
+	MXUNLOCK(&deps_lock);
+}
+
+/*
+ * Mark every post as needing a refresh.  Used when we may have missed
+ * change notifications.
+ */
+void post_deps_changed_all(void)
+{
+	struct post_dep *dep;
+
+	MXLOCK(&deps_lock);
+	rb_for_each(&deps, dep)
+		__changed(dep);
+	MXUNLOCK(&deps_lock);
+}
+
+static void *post_deps_checker(void *arg)
+{
+	struct dep_check batch[POST_DEPS_CHECK_BATCH];
+
+	for (;;) {
+		char *last = NULL;
+		size_t n;
+
+		while ((n = __get_batch(last, batch))) {
+			size_t i;
+
+			free(last);
+
+			for (i = 0; i < n; i++)
+				check_file(&batch[i]);
+
+			for (i = 0; i < n - 1; i++)
+				free(batch[i].path);
+
+			last = batch[n - 1].path;
+		}
+
+		free(last);
+
+		usleep(POST_DEPS_CHECK_USEC);
+	}
+
+	return NULL;
+}
+
+void post_deps_start(void)
+{
+	pthread_t checker;
+	int ret;
+
+	ret = xthr_create(&checker, post_deps_checker, NULL);
+	if (ret)
+		panic("failed to create post dependency checker thread: %s",
+		      xstrerror(ret));
+}
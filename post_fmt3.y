@@ -78,88 +78,146 @@ static const char *cquotes[3] = {
 	[2] = "&rdquo;",
 };
 
-static struct str *__char_cvt(struct str *val, const char **outstr, size_t nouts)
+static struct rope_node *__char_cvt(struct parser_output *data,
+				    struct fmt3_slice s, const char **outstr,
+				    size_t nouts)
 {
-	size_t len;
+	ASSERT3U(s.len, <, nouts);
 
-	len = str_len(val);
+	return LIT(outstr[s.len]);
+}
+
+#define dash(v)		__char_cvt(data, (v), dashes, ARRAY_LEN(dashes))
+#define oquote(v)	__char_cvt(data, (v), oquotes, ARRAY_LEN(oquotes))
+#define cquote(v)	__char_cvt(data, (v), cquotes, ARRAY_LEN(cquotes))
+
+static struct rope_node *special_char(struct parser_output *data,
+				      struct fmt3_slice s)
+{
+	char c;
 
-	ASSERT3U(len, <=, nouts);
+	ASSERT3U(s.len, ==, 1);
 
-	str_putref(val);
+	c = data->input[s.off];
 
-	return STR_DUP(outstr[len]);
+	switch (c) {
+		case '"': return LIT("&quot;");
+		case '<': return LIT("&lt;");
+		case '>': return LIT("&gt;");
+	}
+
+	panic("%s given an unexpected character '%c'", __func__, c);
 }
 
-#define dash(v)		__char_cvt((v), dashes, ARRAY_LEN(dashes))
-#define oquote(v)	__char_cvt((v), oquotes, ARRAY_LEN(oquotes))
-#define cquote(v)	__char_cvt((v), cquotes, ARRAY_LEN(cquotes))
+static struct str *slice_str(struct parser_output *data, struct fmt3_slice s)
+{
+	return str_dup_len(data->input + s.off, s.len);
+}
 
-static struct str *special_char(struct str *val)
+/* the input outlives the rope, so the bytes stay where they are */
+static struct rope_node *slice_rope(struct parser_output *data,
+				    struct fmt3_slice s)
 {
-	struct str *ret;
+	return rope_mem(&data->rope, data->input + s.off, s.len);
+}
+
+static void text_init(struct fmt3_text *text)
+{
+	text->rope = NULL;
+	text->run.off = 0;
+	text->run.len = 0;
+}
 
-	ASSERT3U(str_len(val), ==, 1);
+static void text_flush(struct parser_output *data, struct fmt3_text *text)
+{
+	if (!text->run.len)
+		return;
+
+	text->rope = CAT(2, text->rope, slice_rope(data, text->run));
+	text->run.len = 0;
+}
 
-	switch (str_cstr(val)[0]) {
-		case '"': ret = STATIC_STR("&quot;"); break;
-		case '<': ret = STATIC_STR("&lt;"); break;
-		case '>': ret = STATIC_STR("&gt;"); break;
-		default:
-			panic("%s given an unexpected character '%c'",
-			      __func__, str_cstr(val)[0]);
+/* append a piece of the input, extending the pending run if adjacent */
+static void text_run(struct parser_output *data, struct fmt3_text *text,
+		     struct fmt3_slice s)
+{
+	if (text->run.len && (text->run.off + text->run.len == s.off)) {
+		text->run.len += s.len;
+		return;
 	}
 
-	str_putref(val);
+	text_flush(data, text);
+
+	text->run = s;
+}
+
+/* append generated text */
+static void text_rope(struct parser_output *data, struct fmt3_text *text,
+		      struct rope_node *rope)
+{
+	if (!rope)
+		return;
+
+	text_flush(data, text);
+
+	text->rope = CAT(2, text->rope, rope);
+}
+
+static struct rope_node *text_finish(struct parser_output *data,
+				     struct fmt3_text *text)
+{
+	text_flush(data, text);
 
-	return ret;
+	return text->rope;
 }
 
 static void special_cmd(struct parser_output *data, struct str **var,
-			struct str *value, bool photo)
+			struct rope_node *value, bool photo)
 {
 	str_putref(*var);
 
 	if (photo)
-		*var = str_cat(3, str_getref(config.photo_base_url),
-			       STATIC_STR("/"),
-			       value);
-	else
-		*var = value;
+		value = CAT(3, STR(str_getref(config.photo_base_url)),
+			    LIT("/"), value);
+
+	*var = rope_flatten(value);
 }
 
 static void special_cmd_list(struct parser_output *data, struct val **var,
-			     struct str *value)
+			     struct rope_node *value)
 {
 	/* extend the list */
-	*var = VAL_ALLOC_CONS(str_cast_to_val(value), *var);
+	*var = VAL_ALLOC_CONS(str_cast_to_val(rope_flatten(value)), *var);
 }
 
-static struct str *math_apply(struct str *op, struct str *a, struct str *b)
+static struct rope_node *math_apply(struct parser_output *data,
+				    const char *op, struct rope_node *a,
+				    struct rope_node *b)
 {
-	str_getref(op);
 	if (b)
-		return str_cat(9,
-			       STATIC_STR("<"), op, STATIC_STR("><mrow>"),
-			       a, STATIC_STR("</mrow><mrow>"), b,
-			       STATIC_STR("</mrow></"), op, STATIC_STR(">"));
+		return CAT(9,
+			   LIT("<"), LIT(op), LIT("><mrow>"),
+			   a, LIT("</mrow><mrow>"), b,
+			   LIT("</mrow></"), LIT(op), LIT(">"));
 	else
-		return str_cat(7,
-			       STATIC_STR("<"), op, STATIC_STR("><mrow>"),
-			       a,
-			       STATIC_STR("</mrow></"), op, STATIC_STR(">"));
+		return CAT(7,
+			   LIT("<"), LIT(op), LIT("><mrow>"),
+			   a,
+			   LIT("</mrow></"), LIT(op), LIT(">"));
 }
 
 %}
 
 %union {
-	struct str *ptr;
+	struct rope_node *rope;
+	struct fmt3_slice slice;
+	struct fmt3_text text;
 };
 
 /* generic tokens */
-%token <ptr> WSPACE
-%token <ptr> DASH OQUOT CQUOT SCHAR CHAR
-%token <ptr> UTF8CHAR WORD NUMBER
+%token <slice> WSPACE
+%token <slice> DASH OQUOT CQUOT SCHAR CHAR
+%token <slice> UTF8CHAR WORD NUMBER
 %token PERCENT ELLIPSIS
 %token PAREND
 
@@ -169,15 +227,16 @@ static struct str *math_apply(struct str *op, struct str *a, struct str *b)
 %token MATHPROPTO
 
 /* verbose & listing environment */
-%token <ptr> VERBTEXT
+%token <slice> VERBTEXT
 %token VERBSTART VERBEND DOLLAR
 %token LISTSTART LISTEND
 %token TITLESTART TAGSTART PUBSTART TWITTERIMGSTART
 %token TWITTERPHOTOSTART
 %token SPECIALCMDEND
 
-%type <ptr> paragraphs paragraph thing cmd cmdarg optcmdarg math mexpr
-%type <ptr> verb
+%type <rope> paragraphs thing cmd cmdarg optcmdarg math mexpr
+%type <text> paragraph verb
+%type <slice> lit
 
 %left '=' '<' '>'
 %left '*' '/'
@@ -187,99 +246,105 @@ static struct str *math_apply(struct str *op, struct str *a, struct str *b)
 
 %%
 
-post : paragraphs PAREND		{ data->stroutput = $1; }
-     | paragraphs			{ data->stroutput = $1; }
+post : paragraphs PAREND		{ data->stroutput = rope_flatten($1); }
+     | paragraphs			{ data->stroutput = rope_flatten($1); }
      | PAREND				{ data->stroutput = str_empty_string(); }
      ;
 
-paragraphs : paragraphs PAREND paragraph	{ $$ = str_cat(4, $1, STATIC_STR("<p>"), $3, STATIC_STR("</p>\n")); }
-	   | paragraph				{ $$ = str_cat(3, STATIC_STR("<p>"), $1, STATIC_STR("</p>\n")); }
+paragraphs : paragraphs PAREND paragraph	{ $$ = CAT(4, $1, LIT("<p>"), text_finish(data, &$3), LIT("</p>\n")); }
+	   | paragraph				{ $$ = CAT(3, LIT("<p>"), text_finish(data, &$1), LIT("</p>\n")); }
 	   ;
 
-paragraph : paragraph thing		{ $$ = str_cat(2, $1, $2); }
-          | thing			{ $$ = $1; }
+paragraph : paragraph lit		{ $$ = $1; text_run(data, &$$, $2); }
+          | paragraph thing		{ $$ = $1; text_rope(data, &$$, $2); }
+          | lit				{ text_init(&$$); text_run(data, &$$, $1); }
+          | thing			{ text_init(&$$); text_rope(data, &$$, $1); }
           ;
 
-thing : WORD				{ $$ = $1; }
-      | UTF8CHAR			{ $$ = $1; }
-      | '\n'				{ $$ = data->texttt_nesting ? STATIC_STR("\n") : STATIC_STR(" "); }
-      | WSPACE				{ $$ = $1; }
+/* input that is copied to the output verbatim */
+lit : WORD
+    | UTF8CHAR
+    | WSPACE
+    | CHAR
+    ;
+
+thing : '\n'				{ $$ = data->texttt_nesting ? LIT("\n") : LIT(" "); }
       | DASH				{ $$ = dash($1); }
       | OQUOT				{ $$ = oquote($1); }
       | CQUOT				{ $$ = cquote($1); }
-      | CHAR				{ $$ = $1; }
-      | SCHAR				{ $$ = special_char($1); }
-      | ELLIPSIS			{ $$ = STATIC_STR("&hellip;"); }
-      | '~'				{ $$ = STATIC_STR("&nbsp;"); }
-      | '&'				{ $$ = STATIC_STR("</td><td>"); }
-      | DOLLAR				{ $$ = STATIC_STR("$"); }
-      | PERCENT				{ $$ = STATIC_STR("%"); }
+      | SCHAR				{ $$ = special_char(data, $1); }
+      | ELLIPSIS			{ $$ = LIT("&hellip;"); }
+      | '~'				{ $$ = LIT("&nbsp;"); }
+      | '&'				{ $$ = LIT("</td><td>"); }
+      | DOLLAR				{ $$ = LIT("$"); }
+      | PERCENT				{ $$ = LIT("%"); }
       | '\\' cmd			{ $$ = $2; }
-      | MATHSTART math MATHEND		{ $$ = str_cat(3, STATIC_STR("<math>"), $2, STATIC_STR("</math>")); }
-      | VERBSTART verb VERBEND		{ $$ = str_cat(3, STATIC_STR("</p>"), $2, STATIC_STR("<p>")); }
-      | LISTSTART verb LISTEND		{ $$ = str_cat(3, STATIC_STR("</p><pre>"),
-						       listing_str($2),
-						       STATIC_STR("</pre><p>")); }
-      | TITLESTART verb SPECIALCMDEND	{ $$ = NULL; special_cmd(data, &data->sc_title, $2, false); }
-      | PUBSTART verb SPECIALCMDEND	{ $$ = NULL; special_cmd(data, &data->sc_pub, $2, false); }
-      | TAGSTART verb SPECIALCMDEND	{ $$ = NULL; special_cmd_list(data, &data->sc_tags, $2); }
+      | MATHSTART math MATHEND		{ $$ = CAT(3, LIT("<math>"), $2, LIT("</math>")); }
+      | VERBSTART verb VERBEND		{ $$ = CAT(3, LIT("</p>"), text_finish(data, &$2), LIT("<p>")); }
+      | LISTSTART verb LISTEND		{ $$ = CAT(3, LIT("</p><pre>"),
+						       STR(listing_str(rope_flatten(text_finish(data, &$2)))),
+						       LIT("</pre><p>")); }
+      | TITLESTART verb SPECIALCMDEND	{ $$ = NULL; special_cmd(data, &data->sc_title, text_finish(data, &$2), false); }
+      | PUBSTART verb SPECIALCMDEND	{ $$ = NULL; special_cmd(data, &data->sc_pub, text_finish(data, &$2), false); }
+      | TAGSTART verb SPECIALCMDEND	{ $$ = NULL; special_cmd_list(data, &data->sc_tags, text_finish(data, &$2)); }
       | TWITTERIMGSTART verb SPECIALCMDEND
-					{ $$ = NULL; special_cmd(data, &data->sc_twitter_img, $2, false); }
+					{ $$ = NULL; special_cmd(data, &data->sc_twitter_img, text_finish(data, &$2), false); }
       | TWITTERPHOTOSTART verb SPECIALCMDEND
-					{ $$ = NULL; special_cmd(data, &data->sc_twitter_img, $2, true); }
+					{ $$ = NULL; special_cmd(data, &data->sc_twitter_img, text_finish(data, &$2), true); }
       ;
 
-cmd : WORD optcmdarg cmdarg	{ $$ = process_cmd(data, $1, $3, $2); }
-    | WORD cmdarg		{ $$ = process_cmd(data, $1, $2, NULL); }
-    | WORD			{ $$ = process_cmd(data, $1, NULL, NULL); }
-    | '\\'			{ $$ = STATIC_STR("<br/>"); }
-    | '{'			{ $$ = STATIC_STR("{"); }
-    | '}'			{ $$ = STATIC_STR("}"); }
-    | '['			{ $$ = STATIC_STR("["); }
-    | ']'			{ $$ = STATIC_STR("]"); }
-    | '&'			{ $$ = STATIC_STR("&amp;"); }
-    | '_'			{ $$ = STATIC_STR("_"); }
-    | '^'			{ $$ = STATIC_STR("^"); }
-    | '~'			{ $$ = STATIC_STR("~"); }
+cmd : WORD optcmdarg cmdarg	{ $$ = process_cmd(data, slice_str(data, $1), $3, $2); }
+    | WORD cmdarg		{ $$ = process_cmd(data, slice_str(data, $1), $2, NULL); }
+    | WORD			{ $$ = process_cmd(data, slice_str(data, $1), NULL, NULL); }
+    | '\\'			{ $$ = LIT("<br/>"); }
+    | '{'			{ $$ = LIT("{"); }
+    | '}'			{ $$ = LIT("}"); }
+    | '['			{ $$ = LIT("["); }
+    | ']'			{ $$ = LIT("]"); }
+    | '&'			{ $$ = LIT("&amp;"); }
+    | '_'			{ $$ = LIT("_"); }
+    | '^'			{ $$ = LIT("^"); }
+    | '~'			{ $$ = LIT("~"); }
     ;
 
-optcmdarg : '[' paragraph ']'	{ $$ = $2; }
+optcmdarg : '[' paragraph ']'	{ $$ = text_finish(data, &$2); }
           ;
 
-cmdarg : '{' paragraph '}'	{ $$ = $2; }
+cmdarg : '{' paragraph '}'	{ $$ = text_finish(data, &$2); }
        ;
 
-verb : verb VERBTEXT			{ $$ = str_cat(2, $1, $2); }
-     | VERBTEXT				{ $$ = $1; }
+/* consecutive VERBTEXT tokens are adjacent, so this is a single run */
+verb : verb VERBTEXT			{ $$ = $1; text_run(data, &$$, $2); }
+     | VERBTEXT				{ text_init(&$$); text_run(data, &$$, $1); }
 
-math : math mexpr			{ $$ = str_cat(2, $1, $2); }
+math : math mexpr			{ $$ = CAT(2, $1, $2); }
      | mexpr				{ $$ = $1; }
      ;
 
-mexpr : mexpr '+' mexpr			{ $$ = str_cat(3, $1, STATIC_STR("<mo>+</mo>"), $3); }
-      | mexpr '-' mexpr			{ $$ = str_cat(3, $1, STATIC_STR("<mo>-</mo>"), $3); }
-      | mexpr '*' mexpr			{ $$ = str_cat(3, $1, STATIC_STR("<mo>*</mo>"), $3); }
-      | mexpr '/' mexpr			{ $$ = str_cat(3, $1, STATIC_STR("<mo>/</mo>"), $3); }
-      | mexpr '^' mexpr			{ $$ = math_apply(STATIC_STR("msup"), $1, $3); }
-      | mexpr '_' mexpr			{ $$ = math_apply(STATIC_STR("msub"), $1, $3); }
-      | mexpr '=' mexpr			{ $$ = str_cat(3, $1, STATIC_STR("<mo>=</mo>"), $3); }
-      | mexpr '<' mexpr			{ $$ = str_cat(3, $1, STATIC_STR("<mo>&lt;</mo>"), $3); }
-      | mexpr '>' mexpr			{ $$ = str_cat(3, $1, STATIC_STR("<mo>&gt;</mo>"), $3); }
-      | mexpr '~' mexpr			{ $$ = str_cat(2, $1, $3); }
-      | '(' mexpr ')'			{ $$ = str_cat(3,
-						       STATIC_STR("<mrow><mo>(</mo><mrow>"),
+mexpr : mexpr '+' mexpr			{ $$ = CAT(3, $1, LIT("<mo>+</mo>"), $3); }
+      | mexpr '-' mexpr			{ $$ = CAT(3, $1, LIT("<mo>-</mo>"), $3); }
+      | mexpr '*' mexpr			{ $$ = CAT(3, $1, LIT("<mo>*</mo>"), $3); }
+      | mexpr '/' mexpr			{ $$ = CAT(3, $1, LIT("<mo>/</mo>"), $3); }
+      | mexpr '^' mexpr			{ $$ = math_apply(data, "msup", $1, $3); }
+      | mexpr '_' mexpr			{ $$ = math_apply(data, "msub", $1, $3); }
+      | mexpr '=' mexpr			{ $$ = CAT(3, $1, LIT("<mo>=</mo>"), $3); }
+      | mexpr '<' mexpr			{ $$ = CAT(3, $1, LIT("<mo>&lt;</mo>"), $3); }
+      | mexpr '>' mexpr			{ $$ = CAT(3, $1, LIT("<mo>&gt;</mo>"), $3); }
+      | mexpr '~' mexpr			{ $$ = CAT(2, $1, $3); }
+      | '(' mexpr ')'			{ $$ = CAT(3,
+						       LIT("<mrow><mo>(</mo><mrow>"),
 						       $2,
-						       STATIC_STR("</mrow><mo>)</mo></mrow>")); }
+						       LIT("</mrow><mo>)</mo></mrow>")); }
       | '{' mexpr '}'			{ $$ = $2; }
       | '\\' MATHFRAC '{' mexpr '}' '{' mexpr '}'
-					{ $$ = math_apply(STATIC_STR("mfrac"), $4, $7); }
-      | '\\' MATHSQRT '{' mexpr '}'	{ $$ = math_apply(STATIC_STR("msqrt"), $4, NULL); }
-      | '\\' MATHPROPTO			{ $$ = STATIC_STR("<mo>&prop;</mo>"); }
-      | NUMBER				{ $$ = str_cat(3, STATIC_STR("<mn>"), $1, STATIC_STR("</mn>")); }
-      | WORD				{ $$ = str_cat(3, STATIC_STR("<mi>"), $1, STATIC_STR("</mi>")); }
-      | MATHFRAC			{ $$ = STATIC_STR("<mi>frac</mi>"); }
-      | MATHSQRT			{ $$ = STATIC_STR("<mi>sqrt</mi>"); }
-      | MATHPROPTO			{ $$ = STATIC_STR("<mi>propto</mi>"); }
+					{ $$ = math_apply(data, "mfrac", $4, $7); }
+      | '\\' MATHSQRT '{' mexpr '}'	{ $$ = math_apply(data, "msqrt", $4, NULL); }
+      | '\\' MATHPROPTO			{ $$ = LIT("<mo>&prop;</mo>"); }
+      | NUMBER				{ $$ = CAT(3, LIT("<mn>"), slice_rope(data, $1), LIT("</mn>")); }
+      | WORD				{ $$ = CAT(3, LIT("<mi>"), slice_rope(data, $1), LIT("</mi>")); }
+      | MATHFRAC			{ $$ = LIT("<mi>frac</mi>"); }
+      | MATHSQRT			{ $$ = LIT("<mi>sqrt</mi>"); }
+      | MATHPROPTO			{ $$ = LIT("<mi>propto</mi>"); }
       ;
 
 %%
@@ -38,217 +38,210 @@
  *  (1) add a CMD_IDX_foo to cmd_idx enum
  *  (2) add entry to cmds array
  *  (3) create a function __process_foo(...)
+ *
+ * The arguments are ropes (see rope.h), so they can be used more than once
+ * and must not be freed.
  */
 
-static struct str *__process_listing(struct parser_output *data,
-				     struct str *txt, struct str *opt)
+/* flatten an argument we need to look at (the rope keeps the string) */
+static const char *arg_cstr(struct parser_output *data, struct rope_node *arg)
 {
-	struct str *str;
+	return STR(rope_flatten(arg))->ptr;
+}
 
-	str = listing(data->post, str_cstr(txt));
+static struct rope_node *__process_listing(struct parser_output *data,
+					   struct rope_node *txt,
+					   struct rope_node *opt)
+{
+	struct str *str;
 
-	str_putref(txt);
-	str_putref(opt);
+	str = listing(data->post, arg_cstr(data, txt));
 
-	return str_cat(3, STATIC_STR("</p><pre>"), str, STATIC_STR("</pre><p>"));
+	return CAT(3, LIT("</p><pre>"), STR(str), LIT("</pre><p>"));
 }
 
-static struct str *__process_link(struct parser_output *data, struct str *txt,
-				  struct str *opt)
+static struct rope_node *__process_link(struct parser_output *data,
+					struct rope_node *txt,
+					struct rope_node *opt)
 {
-	if (!opt)
-		str_getref(txt);
-
-	return str_cat(5, STATIC_STR("<a href=\""), txt, STATIC_STR("\">"),
-		       opt ? opt : txt, STATIC_STR("</a>"));
+	return CAT(5, LIT("<a href=\""), txt, LIT("\">"),
+		   opt ? opt : txt, LIT("</a>"));
 }
 
-static struct str *__process_photolink(struct parser_output *data,
-				       struct str *txt, struct str *opt)
+static struct rope_node *__process_photolink(struct parser_output *data,
+					     struct rope_node *txt,
+					     struct rope_node *opt)
 {
-	if (!opt)
-		str_getref(txt);
-
-	return str_cat(7, STATIC_STR("<a href=\""),
-		       str_getref(config.photo_base_url),
-		       STATIC_STR("/"),
-		       txt,
-		       STATIC_STR("\">"), opt ? opt : txt, STATIC_STR("</a>"));
+	return CAT(7, LIT("<a href=\""),
+		   STR(str_getref(config.photo_base_url)),
+		   LIT("/"),
+		   txt,
+		   LIT("\">"), opt ? opt : txt, LIT("</a>"));
 }
 
-static struct str *__process_img(struct parser_output *data, struct str *txt,
-				 struct str *opt)
+static struct rope_node *__process_img(struct parser_output *data,
+				       struct rope_node *txt,
+				       struct rope_node *opt)
 {
-	return str_cat(5, STATIC_STR("<img src=\""), txt, STATIC_STR("\" alt=\""),
-		       opt, STATIC_STR("\" />"));
+	return CAT(5, LIT("<img src=\""), txt, LIT("\" alt=\""),
+		   opt, LIT("\" />"));
 }
 
-static struct str *__process_photo(struct parser_output *data, struct str *txt,
-				   struct str *opt)
+static struct rope_node *__process_photo(struct parser_output *data,
+					 struct rope_node *txt,
+					 struct rope_node *opt)
 {
-	return str_cat(7, STATIC_STR("<img src=\""),
-		       str_getref(config.photo_base_url),
-		       STATIC_STR("/"),
-		       txt,
-		       STATIC_STR("\" alt=\""), opt, STATIC_STR("\" />"));
+	return CAT(7, LIT("<img src=\""),
+		   STR(str_getref(config.photo_base_url)),
+		   LIT("/"),
+		   txt,
+		   LIT("\" alt=\""), opt, LIT("\" />"));
 }
 
-static struct str *__process_emph(struct parser_output *data, struct str *txt,
-				  struct str *opt)
+static struct rope_node *__process_emph(struct parser_output *data,
+					struct rope_node *txt,
+					struct rope_node *opt)
 {
-	return str_cat(3, STATIC_STR("<em>"), txt, STATIC_STR("</em>"));
+	return CAT(3, LIT("<em>"), txt, LIT("</em>"));
 }
 
-static struct str *__process_texttt(struct parser_output *data, struct str *txt,
-				    struct str *opt)
+static struct rope_node *__process_texttt(struct parser_output *data,
+					  struct rope_node *txt,
+					  struct rope_node *opt)
 {
-	return str_cat(3, STATIC_STR("<span class=\"tt\">"), txt, STATIC_STR("</span>"));
+	return CAT(3, LIT("<span class=\"tt\">"), txt, LIT("</span>"));
 }
 
-static struct str *__process_textbf(struct parser_output *data,
-				    struct str *txt, struct str *opt)
+static struct rope_node *__process_textbf(struct parser_output *data,
+					  struct rope_node *txt,
+					  struct rope_node *opt)
 {
-	return str_cat(3, STATIC_STR("<strong>"), txt, STATIC_STR("</strong>"));
+	return CAT(3, LIT("<strong>"), txt, LIT("</strong>"));
 }
 
-static struct str *__process_textit(struct parser_output *data, struct str *txt,
-				    struct str *opt)
+static struct rope_node *__process_textit(struct parser_output *data,
+					  struct rope_node *txt,
+					  struct rope_node *opt)
 {
-	return str_cat(3, STATIC_STR("<i>"), txt, STATIC_STR("</i>"));
+	return CAT(3, LIT("<i>"), txt, LIT("</i>"));
 }
 
-static struct str *__process_begin(struct parser_output *data, struct str *txt,
-				   struct str *opt)
+static struct rope_node *__process_begin(struct parser_output *data,
+					 struct rope_node *txt,
+					 struct rope_node *opt)
 {
-	if (!strcmp(str_cstr(txt), "texttt")) {
+	const char *env = arg_cstr(data, txt);
+
+	if (!strcmp(env, "texttt")) {
 		data->texttt_nesting++;
-		str_putref(txt);
-		return STATIC_STR("</p><pre>");
+		return LIT("</p><pre>");
 	}
 
-	if (!strcmp(str_cstr(txt), "enumerate")) {
-		str_putref(txt);
-		return STATIC_STR("</p><ol>");
-	}
+	if (!strcmp(env, "enumerate"))
+		return LIT("</p><ol>");
 
-	if (!strcmp(str_cstr(txt), "itemize")) {
-		str_putref(txt);
-		return STATIC_STR("</p><ul>");
-	}
+	if (!strcmp(env, "itemize"))
+		return LIT("</p><ul>");
 
-	if (!strcmp(str_cstr(txt), "description")) {
-		str_putref(txt);
-		return STATIC_STR("</p><dl>");
-	}
-
-	if (!strcmp(str_cstr(txt), "quote")) {
-		str_putref(txt);
-		return STATIC_STR("</p><blockquote><p>");
-	}
+	if (!strcmp(env, "description"))
+		return LIT("</p><dl>");
 
-	if (!strcmp(str_cstr(txt), "tabular")) {
-		str_putref(txt);
+	if (!strcmp(env, "quote"))
+		return LIT("</p><blockquote><p>");
 
+	if (!strcmp(env, "tabular")) {
 		if (data->table_nesting++)
-			return STATIC_STR("<table>");
-		return STATIC_STR("</p><table>");
+			return LIT("<table>");
+		return LIT("</p><table>");
 	}
 
-	DBG("post_fmt3: invalid environment '%s' (post #%u)", str_cstr(txt),
+	DBG("post_fmt3: invalid environment '%s' (post #%u)", env,
 	    data->post->id);
 
-	return str_cat(3, STATIC_STR("[INVAL ENVIRON '"), txt, STATIC_STR("']"));
+	return CAT(3, LIT("[INVAL ENVIRON '"), txt, LIT("']"));
 }
 
-static struct str *__process_end(struct parser_output *data, struct str *txt,
-				 struct str *opt)
+static struct rope_node *__process_end(struct parser_output *data,
+				       struct rope_node *txt,
+				       struct rope_node *opt)
 {
-	if (!strcmp(str_cstr(txt), "texttt")) {
+	const char *env = arg_cstr(data, txt);
+
+	if (!strcmp(env, "texttt")) {
 		data->texttt_nesting--;
-		str_putref(txt);
-		return STATIC_STR("</pre><p>");
+		return LIT("</pre><p>");
 	}
 
-	if (!strcmp(str_cstr(txt), "enumerate")) {
-		str_putref(txt);
-		return STATIC_STR("</ol><p>");
-	}
+	if (!strcmp(env, "enumerate"))
+		return LIT("</ol><p>");
 
-	if (!strcmp(str_cstr(txt), "itemize")) {
-		str_putref(txt);
-		return STATIC_STR("</ul><p>");
-	}
+	if (!strcmp(env, "itemize"))
+		return LIT("</ul><p>");
 
-	if (!strcmp(str_cstr(txt), "description")) {
-		str_putref(txt);
-		return STATIC_STR("</dl><p>");
-	}
+	if (!strcmp(env, "description"))
+		return LIT("</dl><p>");
 
-	if (!strcmp(str_cstr(txt), "quote")) {
-		str_putref(txt);
-		return STATIC_STR("</p></blockquote><p>");
-	}
-
-	if (!strcmp(str_cstr(txt), "tabular")) {
-		str_putref(txt);
+	if (!strcmp(env, "quote"))
+		return LIT("</p></blockquote><p>");
 
+	if (!strcmp(env, "tabular")) {
 		if (--data->table_nesting)
-			return STATIC_STR("</table>");
-		return STATIC_STR("</table><p>");
+			return LIT("</table>");
+		return LIT("</table><p>");
 	}
 
-	DBG("post_fmt3: invalid environment '%s' (post #%u)", str_cstr(txt),
+	DBG("post_fmt3: invalid environment '%s' (post #%u)", env,
 	    data->post->id);
 
-	return str_cat(3, STATIC_STR("[INVAL ENVIRON '"), txt, STATIC_STR("']"));
+	return CAT(3, LIT("[INVAL ENVIRON '"), txt, LIT("']"));
 }
 
-static struct str *__process_item(struct parser_output *data, struct str *txt,
-				  struct str *opt)
+static struct rope_node *__process_item(struct parser_output *data,
+					struct rope_node *txt,
+					struct rope_node *opt)
 {
 	// FIXME: we should keep track of what commands we've
 	// encountered and then decide if <li> is the right tag to
 	// use
 	if (!opt)
-		return str_cat(3, STATIC_STR("<li>"), txt, STATIC_STR("</li>"));
-	return str_cat(5, STATIC_STR("<dt>"), opt, STATIC_STR("</dt><dd>"), txt,
-		       STATIC_STR("</dd>"));
+		return CAT(3, LIT("<li>"), txt, LIT("</li>"));
+	return CAT(5, LIT("<dt>"), opt, LIT("</dt><dd>"), txt,
+		   LIT("</dd>"));
 }
 
-static struct str *__process_abbrev(struct parser_output *data, struct str *txt,
-				    struct str *opt)
+static struct rope_node *__process_abbrev(struct parser_output *data,
+					  struct rope_node *txt,
+					  struct rope_node *opt)
 {
-	if (!opt)
-		str_getref(txt);
-
-	return str_cat(5, STATIC_STR("<abbr title=\""), opt ? opt : txt,
-		       STATIC_STR("\">"), txt, STATIC_STR("</abbr>"));
+	return CAT(5, LIT("<abbr title=\""), opt ? opt : txt,
+		   LIT("\">"), txt, LIT("</abbr>"));
 }
 
-static struct str *__process_section(struct parser_output *data,
-				     struct str *txt, struct str *opt)
+static struct rope_node *__process_section(struct parser_output *data,
+					   struct rope_node *txt,
+					   struct rope_node *opt)
 {
-	return str_cat(3, STATIC_STR("</p><h3>"), txt, STATIC_STR("</h3><p>"));
+	return CAT(3, LIT("</p><h3>"), txt, LIT("</h3><p>"));
 }
 
-static struct str *__process_subsection(struct parser_output *data,
-					struct str *txt, struct str *opt)
+static struct rope_node *__process_subsection(struct parser_output *data,
+					      struct rope_node *txt,
+					      struct rope_node *opt)
 {
-	return str_cat(3, STATIC_STR("</p><h4>"), txt, STATIC_STR("</h4><p>"));
+	return CAT(3, LIT("</p><h4>"), txt, LIT("</h4><p>"));
 }
 
-static struct str *__process_subsubsection(struct parser_output *data,
-					   struct str *txt, struct str *opt)
+static struct rope_node *__process_subsubsection(struct parser_output *data,
+						 struct rope_node *txt,
+						 struct rope_node *opt)
 {
-	return str_cat(3, STATIC_STR("</p><h5>"), txt, STATIC_STR("</h5><p>"));
+	return CAT(3, LIT("</p><h5>"), txt, LIT("</h5><p>"));
 }
 
-static struct str *__process_wiki(struct parser_output *data, struct str *txt,
-				  struct str *opt)
+static struct rope_node *__process_wiki(struct parser_output *data,
+					struct rope_node *txt,
+					struct rope_node *opt)
 {
-	if (!opt)
-		str_getref(txt);
-
 	/*
 	 * FIXME: We really should URL-escape the link.  (HTML5 really
 	 * doesn't like spaces in the URL, but even XHTML 1 finds them
@@ -263,104 +256,103 @@ static struct str *__process_wiki(struct parser_output *data, struct str *txt,
 	 * amounts to s/ /+/g.
 	 */
 
-	return str_cat(9, STATIC_STR("<a href=\""),
-		       str_getref(config.wiki_base_url),
-		       STATIC_STR("/"),
-		       txt,
-		       STATIC_STR("\"><img src=\""),
-		       str_getref(config.base_url),
-		       STATIC_STR("/wiki.png\" alt=\"Wikipedia article:\" />&nbsp;"),
-		       opt ? opt : txt, STATIC_STR("</a>"));
+	return CAT(9, LIT("<a href=\""),
+		   STR(str_getref(config.wiki_base_url)),
+		   LIT("/"),
+		   txt,
+		   LIT("\"><img src=\""),
+		   STR(str_getref(config.base_url)),
+		   LIT("/wiki.png\" alt=\"Wikipedia article:\" />&nbsp;"),
+		   opt ? opt : txt, LIT("</a>"));
 }
 
-static struct str *__process_bug(struct parser_output *data, struct str *txt,
-				 struct str *opt)
+static struct rope_node *__process_bug(struct parser_output *data,
+				       struct rope_node *txt,
+				       struct rope_node *opt)
 {
-	str_getref(txt);
-
-	return str_cat(9, STATIC_STR("<a href=\""),
-		       str_getref(config.bug_base_url),
-		       STATIC_STR("/"),
-		       txt,
-		       STATIC_STR("\"><img src=\""),
-		       str_getref(config.base_url),
-		       STATIC_STR("/bug.png\" alt=\"bug #\" />&nbsp;"),
-		       txt, STATIC_STR("</a>"));
+	return CAT(9, LIT("<a href=\""),
+		   STR(str_getref(config.bug_base_url)),
+		   LIT("/"),
+		   txt,
+		   LIT("\"><img src=\""),
+		   STR(str_getref(config.base_url)),
+		   LIT("/bug.png\" alt=\"bug #\" />&nbsp;"),
+		   txt, LIT("</a>"));
 }
 
-static struct str *__process_post(struct parser_output *data, struct str *txt,
-				  struct str *opt)
+static struct rope_node *__process_post(struct parser_output *data,
+					struct rope_node *txt,
+					struct rope_node *opt)
 {
 	char buf[1024];
 
 	snprintf(buf, sizeof(buf), "<a href=\"%s/?p=%s\">%s</a>",
-		 str_cstr(config.base_url), str_cstr(txt),
-		 opt ? str_cstr(opt) : str_cstr(txt));
-
-	str_putref(txt);
-	str_putref(opt);
+		 str_cstr(config.base_url), arg_cstr(data, txt),
+		 arg_cstr(data, opt ? opt : txt));
 
-	return STR_DUP(buf);
+	return STR(STR_DUP(buf));
 }
 
-static struct str *__process_taglink(struct parser_output *data,
-				     struct str *txt, struct str *opt)
+static struct rope_node *__process_taglink(struct parser_output *data,
+					   struct rope_node *txt,
+					   struct rope_node *opt)
 {
 	char buf[1024];
 
 	snprintf(buf, sizeof(buf), "<a href=\"%s/?tag=%s\">%s</a>",
-		 str_cstr(config.base_url), str_cstr(txt),
-		 opt ? str_cstr(opt) : str_cstr(txt));
+		 str_cstr(config.base_url), arg_cstr(data, txt),
+		 arg_cstr(data, opt ? opt : txt));
 
-	str_putref(txt);
-	str_putref(opt);
-
-	return STR_DUP(buf);
+	return STR(STR_DUP(buf));
 }
 
-static struct str *__process_degree(struct parser_output *data, struct str *txt,
-				    struct str *opt)
+static struct rope_node *__process_degree(struct parser_output *data,
+					  struct rope_node *txt,
+					  struct rope_node *opt)
 {
-	return str_cat(2, STATIC_STR("\xc2\xb0"), txt);
+	return CAT(2, LIT("\xc2\xb0"), txt);
 }
 
-static struct str *__process_trow(struct parser_output *data, struct str *txt,
-				  struct str *opt)
+static struct rope_node *__process_trow(struct parser_output *data,
+					struct rope_node *txt,
+					struct rope_node *opt)
 {
-	return str_cat(3, STATIC_STR("<tr><td>"), txt, STATIC_STR("</td></tr>"));
+	return CAT(3, LIT("<tr><td>"), txt, LIT("</td></tr>"));
 }
 
-static struct str *__process_leftarrow(struct parser_output *data,
-				       struct str *txt, struct str *opt)
+static struct rope_node *__process_leftarrow(struct parser_output *data,
+					     struct rope_node *txt,
+					     struct rope_node *opt)
 {
-	return STATIC_STR("&larr;");
+	return LIT("&larr;");
 }
 
-static struct str *__process_rightarrow(struct parser_output *data,
-					struct str *txt, struct str *opt)
+static struct rope_node *__process_rightarrow(struct parser_output *data,
+					      struct rope_node *txt,
+					      struct rope_node *opt)
 {
-	return STATIC_STR("&rarr;");
+	return LIT("&rarr;");
 }
 
-static struct str *__process_leftrightarrow(struct parser_output *data,
-					    struct str *txt, struct str *opt)
+static struct rope_node *__process_leftrightarrow(struct parser_output *data,
+						  struct rope_node *txt,
+						  struct rope_node *opt)
 {
-	return STATIC_STR("&harr;");
+	return LIT("&harr;");
 }
 
-static struct str *__process_tm(struct parser_output *data, struct str *txt,
-				struct str *opt)
+static struct rope_node *__process_tm(struct parser_output *data,
+				      struct rope_node *txt,
+				      struct rope_node *opt)
 {
-	return STATIC_STR("&trade;");
+	return LIT("&trade;");
 }
 
-static struct str *__process_nop(struct parser_output *data, struct str *txt,
-				 struct str *opt)
+static struct rope_node *__process_nop(struct parser_output *data,
+				       struct rope_node *txt,
+				       struct rope_node *opt)
 {
-	str_putref(txt);
-	str_putref(opt);
-
-	return str_empty_string();
+	return LIT("");
 }
 
 typedef enum {
@@ -371,8 +363,8 @@ typedef enum {
 
 struct cmd {
 	const char *name;
-	struct str *(*fxn)(struct parser_output *, struct str *txt,
-			   struct str *opt);
+	struct rope_node *(*fxn)(struct parser_output *, struct rope_node *txt,
+				 struct rope_node *opt);
 	tri square;
 	tri curly;
 };
@@ -458,7 +450,7 @@ static const struct cmd cmds[] = {
 	CMD_REQ(trow),
 };
 
-static void __check_arg(tri r, struct str *ptr)
+static void __check_arg(tri r, struct rope_node *ptr)
 {
 	if (r == REQUIRED)
 		ASSERT(ptr);
@@ -467,8 +459,9 @@ static void __check_arg(tri r, struct str *ptr)
 		ASSERT(!ptr);
 }
 
-struct str *process_cmd(struct parser_output *data, struct str *cmd,
-			struct str *txt, struct str *opt)
+/* consumes the command name reference */
+struct rope_node *process_cmd(struct parser_output *data, struct str *cmd,
+			      struct rope_node *txt, struct rope_node *opt)
 {
 	struct cmd key;
 	const struct cmd *c;
@@ -480,11 +473,7 @@ struct str *process_cmd(struct parser_output *data, struct str *cmd,
 		DBG("post_fmt3: invalid command '%s' (post #%u)", key.name,
 		    data->post->id);
 
-		str_putref(txt);
-		str_putref(opt);
-
-		return str_cat(3, STATIC_STR("[INVAL CMD '"), cmd,
-			       STATIC_STR("']"));
+		return CAT(3, LIT("[INVAL CMD '"), STR(cmd), LIT("']"));
 	}
 
 	__check_arg(c->square, opt);
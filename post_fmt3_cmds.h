@@ -26,7 +26,16 @@
 #include "post.h"
 #include "parse.h"
 
-extern struct str *process_cmd(struct parser_output *data, struct str *cmd,
-			       struct str *txt, struct str *opt);
+/*
+ * Shorthands for building output in the grammar and the commands.  They
+ * expect the struct parser_output to be called data.
+ */
+#define LIT(s)		rope_lit(&data->rope, (s))
+#define STR(s)		rope_str(&data->rope, (s))
+#define CAT(n, ...)	rope_cat(&data->rope, (n), __VA_ARGS__)
+
+extern struct rope_node *process_cmd(struct parser_output *data,
+				     struct str *cmd, struct rope_node *txt,
+				     struct rope_node *opt);
 
 #endif
@@ -20,15 +20,19 @@
  * SOFTWARE.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
 
 #include <jeffpc/val.h>
 #include <jeffpc/error.h>
 #include <jeffpc/mem.h>
+#include <jeffpc/atomic.h>
+#include <jeffpc/time.h>
 
 #include "post.h"
 #include "utils.h"
+#include "ranktree.h"
 
 /*
  * Having a post structure is nice but we need to be able to find it to
@@ -41,8 +45,9 @@
  *
  * In addition to the global index, there are three other indices:
  *
- *   - by time (used for index & archive listing)
+ *   - by time (used for index listing)
  *   - by tag (used for tag listing)
+ *   - by month (used for archive listing)
  *
  * The by-tag tree contains struct post_subindex nodes for each (unique)
  * tag.  Those nodes contain binary search trees of their own with struct
@@ -52,6 +57,17 @@
  * Because this isn't complex enough, we also keep a linked list of all the
  * tag entries rooted in the global index tree node.
  *
+ * The by-month tree is much like the by-tag tree, except that its nodes
+ * (struct post_month) are keyed by the year & month (local time) of
+ * publication in the same YYYYMM form the archive pages use.
+ *
+ * The by time index and the subindices are rank trees which keep track of
+ * the number of listed posts in each subtree.  This lets us skip over
+ * the first n listed posts (i.e., seek to a page) in O(log n) time.
+ * Since the trees need to know which posts are listed, the global index
+ * entry caches the post's listed flag.  index_update_post() must be
+ * called whenever it changes.
+ *
  *      +--------------------------------+
  *      | index_global tree              |
  *      |+-------------------------+     |   +------+
@@ -96,6 +112,7 @@
 enum entry_type {
 	ET_TAG = 1,	/* global's by_tag list */
 	ET_TIME,	/* index_by_time */
+	ET_MONTH,	/* index_by_month */
 };
 
 struct post_global_index_entry {
@@ -109,13 +126,18 @@ struct post_global_index_entry {
 
 	/* other useful cached data from struct post */
 	unsigned int time;
+	bool listed;
 
 	/* list of tags associated with this post */
 	struct list by_tag;
+
+	/* this post's entries in the by time & by month indices */
+	struct post_index_entry *by_time;
+	struct post_index_entry *by_month;
 };
 
 struct post_index_entry {
-	struct rb_node node;
+	struct rank_node node;
 
 	struct post_global_index_entry *global;
 
@@ -143,19 +165,84 @@ struct post_subindex {
 	struct str *name;
 
 	/* value */
-	struct rb_tree subindex;
+	struct rank_tree subindex;
+};
+
+struct post_month {
+	struct rb_node node;
+
+	/* key */
+	unsigned int archid;
+
+	/* value */
+	struct rank_tree posts;
 };
 
 static struct rb_tree index_global;
-static struct rb_tree index_by_time;
+static struct rank_tree index_by_time;
 static struct rb_tree index_by_tag;
+static struct rb_tree index_by_month;
 
-static struct lock index_lock;
+/*
+ * The indices are read by every request but modified only when posts get
+ * loaded or refreshed, so we use a reader-writer lock.  To make it
+ * possible to tell how much time requests spend waiting on it, we keep
+ * track of the number of acquisitions and the total time spent
+ * acquiring it.
+ */
+static struct rwlock index_lock;
 static LOCK_CLASS(index_lock_lc);
+static atomic64_t index_lock_acquires;
+static atomic64_t index_lock_wait_time;
+
+/* bumped every time the contents of the index change */
+static atomic64_t index_generation;
+static atomic64_t index_last_change;	/* unix time */
 
 static struct mem_cache *index_entry_cache;
 static struct mem_cache *global_index_entry_cache;
 static struct mem_cache *subindex_cache;
+static struct mem_cache *month_cache;
+
+static void index_lock_acquire(bool wr)
+{
+	uint64_t start;
+
+	start = gettime();
+
+	RWLOCK(&index_lock, wr);
+
+	atomic_add(&index_lock_wait_time, gettime() - start);
+	atomic_inc(&index_lock_acquires);
+}
+
+static void index_lock_release(void)
+{
+	RWUNLOCK(&index_lock);
+}
+
+uint64_t index_get_generation(void)
+{
+	return atomic_read(&index_generation);
+}
+
+uint64_t index_get_last_change(void)
+{
+	return atomic_read(&index_last_change);
+}
+
+/* must be called with index_lock held for writing */
+static void index_changed(void)
+{
+	atomic_set(&index_last_change, time(NULL));
+	atomic_inc(&index_generation);
+}
+
+void index_get_lock_stats(uint64_t *acquires, uint64_t *wait_time)
+{
+	*acquires = atomic_read(&index_lock_acquires);
+	*wait_time = atomic_read(&index_lock_wait_time);
+}
 
 /*
  * Assorted comparators
@@ -211,10 +298,23 @@ static int post_tag_cmp(const void *va, const void *vb)
 	return 0;
 }
 
-static void init_index_tree(struct rb_tree *tree)
+/* compare two month entries */
+static int post_month_cmp(const void *va, const void *vb)
 {
-	rb_create(tree, post_index_cmp, sizeof(struct post_index_entry),
-		  offsetof(struct post_index_entry, node));
+	const struct post_month *a = va;
+	const struct post_month *b = vb;
+
+	if (a->archid < b->archid)
+		return -1;
+	if (a->archid > b->archid)
+		return 1;
+	return 0;
+}
+
+static void init_index_tree(struct rank_tree *tree)
+{
+	rank_create(tree, post_index_cmp, sizeof(struct post_index_entry),
+		    offsetof(struct post_index_entry, node));
 }
 
 void init_post_index(void)
@@ -229,7 +329,11 @@ void init_post_index(void)
 	rb_create(&index_by_tag, post_tag_cmp, sizeof(struct post_subindex),
 		  offsetof(struct post_subindex, index));
 
-	MXINIT(&index_lock, &index_lock_lc);
+	/* set up the by-month index */
+	rb_create(&index_by_month, post_month_cmp, sizeof(struct post_month),
+		  offsetof(struct post_month, node));
+
+	RWINIT(&index_lock, &index_lock_lc);
 
 	index_entry_cache = mem_cache_create("index-entry-cache",
 					     sizeof(struct post_index_entry),
@@ -244,10 +348,14 @@ void init_post_index(void)
 	subindex_cache = mem_cache_create("subindex-cache",
 					  sizeof(struct post_subindex), 0);
 	ASSERT(!IS_ERR(subindex_cache));
+
+	month_cache = mem_cache_create("month-cache",
+				       sizeof(struct post_month), 0);
+	ASSERT(!IS_ERR(month_cache));
 }
 
-static struct rb_tree *__get_subindex(struct rb_tree *index,
-				       struct str *tagname)
+static struct rank_tree *__get_subindex(struct rb_tree *index,
+					 struct str *tagname)
 {
 	struct post_subindex *ret;
 	struct post_subindex key = {
@@ -270,50 +378,59 @@ struct post *index_lookup_post(unsigned int postid)
 	};
 	struct post *post;
 
-	MXLOCK(&index_lock);
+	index_lock_acquire(false);
 	ret = rb_find(&index_global, &key, NULL);
 	if (ret)
 		post = post_getref(ret->post);
 	else
 		post = NULL;
-	MXUNLOCK(&index_lock);
+	index_lock_release();
 
 	return post;
 }
 
-/* get a list of posts based on tagname & return value from predicate */
-int index_get_posts(struct post **ret, struct str *tagname,
-		    bool (*pred)(struct post *, void *), void *private,
-		    int skip, int nposts)
+static unsigned int __time_to_archid(time_t ts)
 {
-	struct post_index_entry *cur;
-	struct rb_tree *tree;
-	int i;
+	struct tm tm;
 
-	MXLOCK(&index_lock);
+	localtime_r(&ts, &tm);
 
-	if (!tagname)
-		tree = &index_by_time;
-	else
-		tree = __get_subindex(&index_by_tag, tagname);
+	return (tm.tm_year + 1900) * 100 + tm.tm_mon + 1;
+}
+
+static struct rank_tree *__get_month(struct rb_tree *index,
+				     unsigned int archid)
+{
+	struct post_month *ret;
+	struct post_month key = {
+		.archid = archid,
+	};
+
+	ret = rb_find(index, &key, NULL);
+	if (!ret)
+		return NULL;
+
+	return &ret->posts;
+}
+
+/* must be called with index_lock held */
+static int __get_posts(struct post **ret, struct rank_tree *tree,
+		       bool (*pred)(struct post *, void *), void *private,
+		       int skip, int nposts)
+{
+	struct post_index_entry *cur;
+	int i;
 
 	/* if there is no tree, there are no posts */
-	if (!tree) {
-		MXUNLOCK(&index_lock);
+	if (!tree)
 		return 0;
-	}
 
 	/* skip over the first (listed) entries as requested */
-	for (cur = rb_last(tree); cur && skip; cur = rb_prev(tree, cur)) {
-		if (!cur->global->post->listed)
-			continue; /* don't count non-listed posts */
-
-		skip--;
-	}
+	cur = rank_nth_last(tree, skip);
 
 	/* get a reference for every post we're returning */
-	for (i = 0; cur && nposts; cur = rb_prev(tree, cur)) {
-		if (!cur->global->post->listed)
+	for (i = 0; cur && nposts; cur = rank_prev(tree, cur)) {
+		if (!cur->global->listed)
 			continue; /* skip non-listed posts */
 
 		if (pred && !pred(cur->global->post, private))
@@ -325,11 +442,91 @@ int index_get_posts(struct post **ret, struct str *tagname,
 		i++;
 	}
 
-	MXUNLOCK(&index_lock);
+	return i;
+}
+
+/* get a list of posts based on tagname & return value from predicate */
+int index_get_posts(struct post **ret, struct str *tagname,
+		    bool (*pred)(struct post *, void *), void *private,
+		    int skip, int nposts)
+{
+	struct rank_tree *tree;
+	int i;
+
+	index_lock_acquire(false);
+
+	if (!tagname)
+		tree = &index_by_time;
+	else
+		tree = __get_subindex(&index_by_tag, tagname);
+
+	i = __get_posts(ret, tree, pred, private, skip, nposts);
+
+	index_lock_release();
 
 	return i;
 }
 
+/* get a list of posts published in the given month (YYYYMM) */
+int index_get_month_posts(struct post **ret, unsigned int archid, int skip,
+			  int nposts)
+{
+	int i;
+
+	index_lock_acquire(false);
+
+	i = __get_posts(ret, __get_month(&index_by_month, archid), NULL, NULL,
+			skip, nposts);
+
+	index_lock_release();
+
+	return i;
+}
+
+static struct post_subindex *__find_or_add_subindex(struct rb_tree *index,
+						     struct str *tagname)
+{
+	struct post_subindex *sub;
+	struct rb_cookie where;
+	struct post_subindex key = {
+		.name = tagname,
+	};
+
+	/* find the right subindex, or... */
+	sub = rb_find(index, &key, &where);
+	if (sub)
+		return sub;
+
+	/* ...allocate one if it doesn't exist */
+	sub = mem_cache_alloc(subindex_cache);
+	if (!sub)
+		return NULL;
+
+	sub->name = str_getref(tagname);
+	init_index_tree(&sub->subindex);
+
+	rb_insert_here(index, sub, &where);
+
+	return sub;
+}
+
+static struct post_index_entry *__alloc_tag_entry(struct post_global_index_entry *global,
+						  struct str *tagname,
+						  enum entry_type type)
+{
+	struct post_index_entry *tag_entry;
+
+	tag_entry = mem_cache_alloc(index_entry_cache);
+	if (!tag_entry)
+		return NULL;
+
+	tag_entry->global = global;
+	tag_entry->name   = str_getref(tagname);
+	tag_entry->type   = type;
+
+	return tag_entry;
+}
+
 static int __insert_post_tags(struct rb_tree *index,
 			      struct post_global_index_entry *global,
 			      struct rb_tree *taglist, struct list *xreflist,
@@ -338,116 +535,394 @@ static int __insert_post_tags(struct rb_tree *index,
 	struct post_index_entry *tag_entry;
 	struct post_subindex *sub;
 	struct post_tag *tag;
-	struct rb_cookie where;
 
 	rb_for_each(taglist, tag) {
-		struct post_subindex key = {
-			.name = tag->tag,
-		};
-
-		/* find the right subindex, or... */
-		sub = rb_find(index, &key, &where);
-		if (!sub) {
-			/* ...allocate one if it doesn't exist */
-			sub = mem_cache_alloc(subindex_cache);
-			if (!sub)
-				return -ENOMEM;
-
-			sub->name = str_getref(tag->tag);
-			init_index_tree(&sub->subindex);
-
-			rb_insert_here(index, sub, &where);
-		}
+		sub = __find_or_add_subindex(index, tag->tag);
+		if (!sub)
+			return -ENOMEM;
 
 		/* allocate & add a entry to the subindex */
-		tag_entry = mem_cache_alloc(index_entry_cache);
+		tag_entry = __alloc_tag_entry(global, tag->tag, type);
 		if (!tag_entry)
 			return -ENOMEM;
 
-		tag_entry->global = global;
-		tag_entry->name   = str_getref(tag->tag);
-		tag_entry->type   = type;
-
-		ASSERT3P(rb_insert(&sub->subindex, tag_entry), ==, NULL);
+		ASSERT3P(rank_insert(&sub->subindex, tag_entry,
+				     global->listed), ==, NULL);
 		list_insert_tail(xreflist, tag_entry);
 	}
 
 	return 0;
 }
 
-int index_insert_post(struct post *post)
+static struct post_month *__find_or_add_month(struct rb_tree *index,
+					      unsigned int archid)
+{
+	struct post_month *month;
+	struct rb_cookie where;
+	struct post_month key = {
+		.archid = archid,
+	};
+
+	/* find the right month, or... */
+	month = rb_find(index, &key, &where);
+	if (month)
+		return month;
+
+	/* ...allocate one if it doesn't exist */
+	month = mem_cache_alloc(month_cache);
+	if (!month)
+		return NULL;
+
+	month->archid = archid;
+	init_index_tree(&month->posts);
+
+	rb_insert_here(index, month, &where);
+
+	return month;
+}
+
+static int __insert_post_month(struct rb_tree *index,
+			       struct post_global_index_entry *global,
+			       struct post_index_entry *entry)
+{
+	struct post_month *month;
+
+	month = __find_or_add_month(index, __time_to_archid(global->time));
+	if (!month)
+		return -ENOMEM;
+
+	ASSERT3P(rank_insert(&month->posts, entry, global->listed), ==, NULL);
+
+	return 0;
+}
+
+/* allocate the global index entry along with its by-time & by-month entries */
+static struct post_global_index_entry *__alloc_global(struct post *post)
 {
 	struct post_global_index_entry *global;
+	struct post_index_entry *by_month;
 	struct post_index_entry *by_time;
-	int ret;
 
 	/* allocate an entry for the global index */
 	global = mem_cache_alloc(global_index_entry_cache);
-	if (!global) {
-		ret = -ENOMEM;
-		goto err;
-	}
+	if (!global)
+		return NULL;
 
 	global->id   = post->id;
 	global->post = post_getref(post);
 	global->time = post->time;
+	global->listed = post->listed;
 	list_create(&global->by_tag, sizeof(struct post_index_entry),
 		    offsetof(struct post_index_entry, xref));
 
 	/* allocate an entry for the by-time index */
 	by_time = mem_cache_alloc(index_entry_cache);
-	if (!by_time) {
-		ret = -ENOMEM;
+	if (!by_time)
 		goto err_free;
-	}
 
 	by_time->global = global;
 	by_time->name   = NULL;
 	by_time->type   = ET_TIME;
 
+	global->by_time = by_time;
+
+	/* allocate an entry for the by-month index */
+	by_month = mem_cache_alloc(index_entry_cache);
+	if (!by_month)
+		goto err_free_by_time;
+
+	by_month->global = global;
+	by_month->name   = NULL;
+	by_month->type   = ET_MONTH;
+
+	global->by_month = by_month;
+
+	return global;
+
+err_free_by_time:
+	mem_cache_free(index_entry_cache, by_time);
+
+err_free:
+	post_putref(global->post);
+	mem_cache_free(global_index_entry_cache, global);
+
+	return NULL;
+}
+
+static void __free_global(struct post_global_index_entry *global)
+{
+	mem_cache_free(index_entry_cache, global->by_month);
+	mem_cache_free(index_entry_cache, global->by_time);
+	post_putref(global->post);
+	mem_cache_free(global_index_entry_cache, global);
+}
+
+int index_insert_post(struct post *post)
+{
+	struct post_global_index_entry *global;
+	int ret;
+
+	global = __alloc_global(post);
+	if (!global)
+		return -ENOMEM;
+
 	/*
 	 * Now the fun begins.
 	 */
 
-	MXLOCK(&index_lock);
+	index_lock_acquire(true);
 
 	/* add the post to the global index */
 	if (rb_insert(&index_global, global)) {
-		MXUNLOCK(&index_lock);
+		index_lock_release();
 		ret = -EEXIST;
-		goto err_free_by_time;
+		goto err_free;
 	}
 
 	/* add the post to the by-time index */
-	ASSERT3P(rb_insert(&index_by_time, by_time), ==, NULL);
+	ASSERT3P(rank_insert(&index_by_time, global->by_time, global->listed),
+		 ==, NULL);
+
+	/* add the post to the by-month index */
+	ret = __insert_post_month(&index_by_month, global, global->by_month);
+	if (ret) {
+		rank_remove(&index_by_time, global->by_time);
+		rb_remove(&index_global, global);
+		index_lock_release();
+		goto err_free;
+	}
 
 	ret = __insert_post_tags(&index_by_tag, global, &post->tags,
 				 &global->by_tag, ET_TAG);
 	if (ret)
 		goto err_free_tags;
 
-	MXUNLOCK(&index_lock);
+	index_changed();
+
+	index_lock_release();
 
 	return 0;
 
 err_free_tags:
 	// XXX: __remove_post_tags(&index_by_tag, &post->tags);
 
-	rb_remove(&index_by_time, by_time);
+	rank_remove(__get_month(&index_by_month, __time_to_archid(global->time)),
+		    global->by_month);
+	rank_remove(&index_by_time, global->by_time);
 
-	MXUNLOCK(&index_lock);
-
-err_free_by_time:
-	mem_cache_free(index_entry_cache, by_time);
+	index_lock_release();
 
 err_free:
-	post_putref(global->post);
-	mem_cache_free(global_index_entry_cache, global);
+	__free_global(global);
 
-err:
 	return ret;
 }
 
+static bool entry_listed(void *item)
+{
+	struct post_index_entry *entry = item;
+
+	return entry->global->listed;
+}
+
+static int post_index_ptr_cmp(const void *va, const void *vb)
+{
+	return post_index_cmp(*(void * const *) va, *(void * const *) vb);
+}
+
+/* a post's entry in a tag's subindex, waiting to be added to the tree */
+struct tag_ref {
+	struct post_subindex *sub;
+	struct post_index_entry *entry;
+	size_t rank;		/* position of the post in the by-time order */
+};
+
+/* group the refs by subindex, keeping them in by-time order */
+static int tag_ref_cmp(const void *va, const void *vb)
+{
+	const struct tag_ref *a = va;
+	const struct tag_ref *b = vb;
+
+	if ((uintptr_t) a->sub < (uintptr_t) b->sub)
+		return -1;
+	if ((uintptr_t) a->sub > (uintptr_t) b->sub)
+		return 1;
+
+	if (a->rank < b->rank)
+		return -1;
+	if (a->rank > b->rank)
+		return 1;
+	return 0;
+}
+
+/*
+ * Add a whole set of freshly loaded posts to the (empty) indices in one
+ * go.  Instead of inserting the posts one at a time, we sort them by
+ * <timestamp, post id> once and build each of the rank trees straight
+ * from the sorted array.  NULL posts (i.e., ones that failed to load) are
+ * skipped.
+ */
+void index_insert_posts(struct post **posts, size_t nposts)
+{
+	struct post_global_index_entry *global;
+	struct post_index_entry **entries;
+	struct tag_ref *refs;
+	size_t nentries;
+	size_t nrefs;
+	void **items;
+	size_t i, j;
+
+	entries = mem_reallocarray(NULL, nposts,
+				   sizeof(struct post_index_entry *));
+	ASSERT(!nposts || entries);
+
+	index_lock_acquire(true);
+
+	ASSERT0(rb_numnodes(&index_global));
+
+	/* add the posts to the global index */
+	nentries = 0;
+	nrefs = 0;
+	for (i = 0; i < nposts; i++) {
+		if (!posts[i])
+			continue;
+
+		global = __alloc_global(posts[i]);
+		ASSERT(global);
+
+		ASSERT3P(rb_insert(&index_global, global), ==, NULL);
+
+		entries[nentries++] = global->by_time;
+		nrefs += rb_numnodes(&posts[i]->tags);
+	}
+
+	qsort(entries, nentries, sizeof(struct post_index_entry *),
+	      post_index_ptr_cmp);
+
+	/* build the by-time index */
+	rank_build(&index_by_time, (void **) entries, nentries, entry_listed);
+
+	/* gather the tag entries in by-time order */
+	refs = mem_reallocarray(NULL, nrefs, sizeof(struct tag_ref));
+	ASSERT(!nrefs || refs);
+
+	nrefs = 0;
+	for (i = 0; i < nentries; i++) {
+		struct post_tag *tag;
+
+		global = entries[i]->global;
+
+		rb_for_each(&global->post->tags, tag) {
+			struct tag_ref *ref = &refs[nrefs++];
+
+			ref->sub = __find_or_add_subindex(&index_by_tag,
+							  tag->tag);
+			ASSERT(ref->sub);
+
+			ref->entry = __alloc_tag_entry(global, tag->tag,
+						       ET_TAG);
+			ASSERT(ref->entry);
+
+			ref->rank = i;
+
+			list_insert_tail(&global->by_tag, ref->entry);
+		}
+	}
+
+	/*
+	 * Build the by-month index.  Since the entries are sorted by time,
+	 * each month's posts are next to each other.  We are done with the
+	 * by-time entries, so we reuse the array for the by-month ones.
+	 */
+	for (i = 0; i < nentries; i = j) {
+		unsigned int archid;
+		struct post_month *month;
+
+		archid = __time_to_archid(entries[i]->global->time);
+
+		for (j = i; j < nentries; j++) {
+			global = entries[j]->global;
+
+			if (__time_to_archid(global->time) != archid)
+				break;
+
+			entries[j] = global->by_month;
+		}
+
+		month = __find_or_add_month(&index_by_month, archid);
+		ASSERT(month);
+
+		rank_build(&month->posts, (void **) &entries[i], j - i,
+			   entry_listed);
+	}
+
+	/* build the by-tag indices */
+	qsort(refs, nrefs, sizeof(struct tag_ref), tag_ref_cmp);
+
+	items = (void **) entries;
+	if (nrefs > nentries) {
+		items = mem_reallocarray(entries, nrefs, sizeof(void *));
+		ASSERT(items);
+	}
+
+	for (i = 0; i < nrefs; i++)
+		items[i] = refs[i].entry;
+
+	for (i = 0; i < nrefs; i = j) {
+		for (j = i; (j < nrefs) && (refs[j].sub == refs[i].sub); j++)
+			;
+
+		rank_build(&refs[i].sub->subindex, &items[i], j - i,
+			   entry_listed);
+	}
+
+	index_changed();
+
+	index_lock_release();
+
+	free(items);
+	free(refs);
+}
+
+/*
+ * Update the index after the post's listed flag may have changed.
+ */
+void index_update_post(struct post *post)
+{
+	struct post_global_index_entry *global;
+	struct post_global_index_entry key = {
+		.id = post->id,
+	};
+	struct post_index_entry *cur;
+	struct rank_tree *tree;
+
+	index_lock_acquire(true);
+
+	global = rb_find(&index_global, &key, NULL);
+	if (!global || (global->post != post) ||
+	    (global->listed == post->listed))
+		goto out;
+
+	global->listed = post->listed;
+
+	rank_set_counted(&index_by_time, global->by_time, global->listed);
+	rank_set_counted(__get_month(&index_by_month,
+				     __time_to_archid(global->time)),
+			 global->by_month, global->listed);
+
+	index_changed();
+
+	list_for_each(cur, &global->by_tag) {
+		tree = __get_subindex(&index_by_tag, cur->name);
+		ASSERT(tree);
+
+		rank_set_counted(tree, cur, global->listed);
+	}
+
+out:
+	index_lock_release();
+}
+
 void index_for_each_tag(int (*init)(void *, unsigned long),
 			void (*step)(void *, struct str *, unsigned long,
 				     unsigned long, unsigned long),
@@ -460,7 +935,7 @@ void index_for_each_tag(int (*init)(void *, unsigned long),
 	if (!init && !step)
 		return;
 
-	MXLOCK(&index_lock);
+	index_lock_acquire(false);
 
 	if (init) {
 		ret = init(private, rb_numnodes(&index_by_tag));
@@ -477,19 +952,19 @@ void index_for_each_tag(int (*init)(void *, unsigned long),
 	cmin = ~0;
 	cmax = 0;
 	rb_for_each(&index_by_tag, tag) {
-		cmin = MIN(cmin, rb_numnodes(&tag->subindex));
-		cmax = MAX(cmax, rb_numnodes(&tag->subindex));
+		cmin = MIN(cmin, rank_numnodes(&tag->subindex));
+		cmax = MAX(cmax, rank_numnodes(&tag->subindex));
 	}
 
 	/*
 	 * finally, invoke the step callback for each tag
 	 */
 	rb_for_each(&index_by_tag, tag)
-		step(private, tag->name, rb_numnodes(&tag->subindex),
+		step(private, tag->name, rank_numnodes(&tag->subindex),
 		     cmin, cmax);
 
 err:
-	MXUNLOCK(&index_lock);
+	index_lock_release();
 }
 
 static void __free_global_index(struct rb_tree *tree)
@@ -507,13 +982,13 @@ static void __free_global_index(struct rb_tree *tree)
 	rb_destroy(tree);
 }
 
-static void __free_index(struct rb_tree *tree)
+static void __free_index(struct rank_tree *tree)
 {
 	struct post_index_entry *cur;
-	struct rb_cookie cookie;
+	struct rank_cookie cookie;
 
 	memset(&cookie, 0, sizeof(cookie));
-	while ((cur = rb_destroy_nodes(tree, &cookie))) {
+	while ((cur = rank_destroy_nodes(tree, &cookie))) {
 		struct list *xreflist = NULL;
 
 		switch (cur->type) {
@@ -521,6 +996,7 @@ static void __free_index(struct rb_tree *tree)
 				xreflist = &cur->global->by_tag;
 				break;
 			case ET_TIME:
+			case ET_MONTH:
 				xreflist = NULL;
 				break;
 		}
@@ -532,7 +1008,7 @@ static void __free_index(struct rb_tree *tree)
 		mem_cache_free(index_entry_cache, cur);
 	}
 
-	rb_destroy(tree);
+	rank_destroy(tree);
 }
 
 static void __free_tag_index(struct rb_tree *tree)
@@ -550,15 +1026,33 @@ static void __free_tag_index(struct rb_tree *tree)
 	rb_destroy(tree);
 }
 
+static void __free_month_index(struct rb_tree *tree)
+{
+	struct post_month *cur;
+	struct rb_cookie cookie;
+
+	memset(&cookie, 0, sizeof(cookie));
+	while ((cur = rb_destroy_nodes(tree, &cookie))) {
+		__free_index(&cur->posts);
+		mem_cache_free(month_cache, cur);
+	}
+
+	rb_destroy(tree);
+}
+
 void free_all_posts(void)
 {
-	MXLOCK(&index_lock);
+	index_lock_acquire(true);
 
 	__free_tag_index(&index_by_tag);
 
+	__free_month_index(&index_by_month);
+
 	__free_index(&index_by_time);
 
 	__free_global_index(&index_global);
 
-	MXUNLOCK(&index_lock);
+	index_changed();
+
+	index_lock_release();
 }
@@ -107,27 +107,17 @@ err:
 	return ret;
 }
 
-static struct nvlist *__store_vars(struct req *req, struct post *post,
-				   const char *titlevar)
+/*
+ * Build the nvlist templates see for @post.  It only depends on the post
+ * itself, so it is built once per post version and shared by everyone.
+ *
+ * Must be called with the post locked.
+ */
+struct nvlist *post_build_vars(struct post *post)
 {
 	struct nvlist *out;
 	int ret;
 
-	if (titlevar) {
-		vars_set_str(&req->vars, titlevar, str_getref(post->title));
-		vars_set_str(&req->vars, "twittertitle",
-			     str_getref(post->title));
-
-		/*
-		 * Only set the twitter image if we're dealing with an
-		 * individual post - this happens when the titlevar is not
-		 * NULL.
-		 */
-		if (post->twitter_img)
-			vars_set_str(&req->vars, "twitterimg",
-				     str_getref(post->twitter_img));
-	}
-
 	out = nvl_alloc();
 	if (!out) {
 		ret = -ENOMEM;
@@ -159,9 +149,40 @@ err:
 	return ERR_PTR(ret);
 }
 
+static struct nvlist *__store_vars(struct req *req,
+				   struct post_version *version,
+				   const char *titlevar)
+{
+	if (titlevar) {
+		vars_set_str(&req->vars, titlevar,
+			     str_getref(version->title));
+		vars_set_str(&req->vars, "twittertitle",
+			     str_getref(version->title));
+
+		/*
+		 * Only set the twitter image if we're dealing with an
+		 * individual post - this happens when the titlevar is not
+		 * NULL.
+		 */
+		if (version->twitter_img)
+			vars_set_str(&req->vars, "twitterimg",
+				     str_getref(version->twitter_img));
+	}
+
+	/* let foreach look up the post's & comments' vars by symbol */
+	vars_add_frame_index(&req->vars, version->frames);
+
+	/* the output depends on all the files the post was built from */
+	req_add_deps(req, version->files);
+	req->last_modified = MAX(req->last_modified, version->last_modified);
+
+	return nvl_getref(version->vars);
+}
+
 struct nvlist *get_post(struct req *req, int postid, const char *titlevar,
 			bool preview)
 {
+	struct post_version *version;
 	struct nvlist *out;
 	struct post *post;
 
@@ -169,12 +190,11 @@ struct nvlist *get_post(struct req *req, int postid, const char *titlevar,
 	if (!post)
 		return NULL;
 
-	post_lock(post);
-	ASSERT0(post_refresh(post));
+	version = post_get_version(post);
 
-	out = __store_vars(req, post, titlevar);
+	out = __store_vars(req, version, titlevar);
 
-	post_unlock(post);
+	post_version_putref(version);
 	post_putref(post);
 
 	return out;
@@ -200,25 +220,18 @@ void load_posts(struct req *req, struct post **posts, int nposts,
 	nnvposts = 0;
 
 	for (i = 0; i < nposts; i++) {
-		struct post *post = posts[i];
+		struct post_version *version;
 
-		post_lock(post);
-		ASSERT0(post_refresh(post));
-
-		nvposts[nnvposts] = nvl_cast_to_val(__store_vars(req, post, NULL));
-		if (IS_ERR(nvposts[nnvposts])) {
-			post_unlock(post);
-			post_putref(post);
-			continue;
-		}
+		version = post_get_version(posts[i]);
 
-		if (post->time > maxtime)
-			maxtime = post->time;
+		nvposts[nnvposts++] = nvl_cast_to_val(__store_vars(req, version,
+								   NULL));
 
-		post_unlock(post);
-		post_putref(post);
+		if (version->time > maxtime)
+			maxtime = version->time;
 
-		nnvposts++;
+		post_version_putref(version);
+		post_putref(posts[i]);
 	}
 
 	vars_set_array(&req->vars, "posts", nvposts, nnvposts);
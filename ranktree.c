@@ -0,0 +1,413 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/types.h>
+
+#include "ranktree.h"
+
+#define NODE(tree, item)	((struct rank_node *)			\
+				 ((uintptr_t) (item) + (tree)->node_off))
+#define ITEM(tree, node)	((void *) ((uintptr_t) (node) - (tree)->node_off))
+
+static inline int height(struct rank_node *node)
+{
+	return node ? node->height : 0;
+}
+
+static inline size_t count(struct rank_node *node)
+{
+	return node ? node->count : 0;
+}
+
+static void update(struct rank_node *node)
+{
+	node->height = 1 + MAX(height(node->left), height(node->right));
+	node->count = count(node->left) + count(node->right) + node->counted;
+}
+
+static void replace_child(struct rank_tree *tree, struct rank_node *parent,
+			  struct rank_node *old, struct rank_node *new)
+{
+	if (!parent)
+		tree->root = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+
+	if (new)
+		new->parent = parent;
+}
+
+static struct rank_node *rotate_left(struct rank_tree *tree,
+				     struct rank_node *node)
+{
+	struct rank_node *r = node->right;
+
+	replace_child(tree, node->parent, node, r);
+
+	node->right = r->left;
+	if (node->right)
+		node->right->parent = node;
+
+	r->left = node;
+	node->parent = r;
+
+	update(node);
+	update(r);
+
+	return r;
+}
+
+static struct rank_node *rotate_right(struct rank_tree *tree,
+				      struct rank_node *node)
+{
+	struct rank_node *l = node->left;
+
+	replace_child(tree, node->parent, node, l);
+
+	node->left = l->right;
+	if (node->left)
+		node->left->parent = node;
+
+	l->right = node;
+	node->parent = l;
+
+	update(node);
+	update(l);
+
+	return l;
+}
+
+/*
+ * Walk from @node all the way up to the root fixing up heights & counts
+ * and rotating as needed.
+ */
+static void rebalance(struct rank_tree *tree, struct rank_node *node)
+{
+	while (node) {
+		int balance;
+
+		update(node);
+
+		balance = height(node->left) - height(node->right);
+
+		if (balance > 1) {
+			if (height(node->left->left) < height(node->left->right))
+				rotate_left(tree, node->left);
+			node = rotate_right(tree, node);
+		} else if (balance < -1) {
+			if (height(node->right->right) < height(node->right->left))
+				rotate_right(tree, node->right);
+			node = rotate_left(tree, node);
+		}
+
+		node = node->parent;
+	}
+}
+
+void rank_create(struct rank_tree *tree,
+		 int (*cmp)(const void *, const void *),
+		 size_t size, size_t off)
+{
+	ASSERT3U(off + sizeof(struct rank_node), <=, size);
+
+	tree->cmp = cmp;
+	tree->root = NULL;
+	tree->node_off = off;
+	tree->numnodes = 0;
+}
+
+void rank_destroy(struct rank_tree *tree)
+{
+	ASSERT3P(tree->root, ==, NULL);
+	ASSERT3U(tree->numnodes, ==, 0);
+}
+
+void *rank_find(struct rank_tree *tree, const void *key)
+{
+	struct rank_node *cur = tree->root;
+
+	while (cur) {
+		int cmp;
+
+		cmp = tree->cmp(key, ITEM(tree, cur));
+		if (!cmp)
+			return ITEM(tree, cur);
+
+		cur = (cmp < 0) ? cur->left : cur->right;
+	}
+
+	return NULL;
+}
+
+/* returns the existing item if there is one with the same key */
+void *rank_insert(struct rank_tree *tree, void *item, bool counted)
+{
+	struct rank_node *node = NODE(tree, item);
+	struct rank_node **link = &tree->root;
+	struct rank_node *parent = NULL;
+
+	while (*link) {
+		int cmp;
+
+		parent = *link;
+
+		cmp = tree->cmp(item, ITEM(tree, parent));
+		if (!cmp)
+			return ITEM(tree, parent);
+
+		link = (cmp < 0) ? &parent->left : &parent->right;
+	}
+
+	node->parent = parent;
+	node->left = NULL;
+	node->right = NULL;
+	node->height = 1;
+	node->counted = counted;
+	node->count = counted;
+
+	*link = node;
+	tree->numnodes++;
+
+	rebalance(tree, parent);
+
+	return NULL;
+}
+
+static struct rank_node *build(struct rank_tree *tree, void **items,
+			       size_t nitems, bool (*counted)(void *),
+			       struct rank_node *parent)
+{
+	struct rank_node *node;
+	size_t mid;
+
+	if (!nitems)
+		return NULL;
+
+	mid = nitems / 2;
+
+	node = NODE(tree, items[mid]);
+	node->parent = parent;
+	node->counted = counted(items[mid]);
+	node->left = build(tree, items, mid, counted, node);
+	node->right = build(tree, &items[mid + 1], nitems - mid - 1, counted,
+			    node);
+
+	update(node);
+
+	return node;
+}
+
+/*
+ * Populate an empty tree with @nitems items that are already sorted and
+ * unique.  Splitting the array at the middle at every level yields a tree
+ * whose subtrees never differ in height by more than one, so the result
+ * needs no rebalancing and the whole build is O(n).
+ */
+void rank_build(struct rank_tree *tree, void **items, size_t nitems,
+		bool (*counted)(void *))
+{
+	size_t i;
+
+	ASSERT3P(tree->root, ==, NULL);
+
+	for (i = 1; i < nitems; i++)
+		ASSERT3S(tree->cmp(items[i - 1], items[i]), <, 0);
+
+	tree->root = build(tree, items, nitems, counted, NULL);
+	tree->numnodes = nitems;
+}
+
+void rank_remove(struct rank_tree *tree, void *item)
+{
+	struct rank_node *node = NODE(tree, item);
+	struct rank_node *fixup;
+
+	if (node->left && node->right) {
+		struct rank_node *succ;
+
+		/* replace the node with its in-order successor */
+		for (succ = node->right; succ->left; succ = succ->left)
+			;
+
+		if (succ->parent == node) {
+			fixup = succ;
+		} else {
+			fixup = succ->parent;
+
+			replace_child(tree, succ->parent, succ, succ->right);
+
+			succ->right = node->right;
+			succ->right->parent = succ;
+		}
+
+		succ->left = node->left;
+		succ->left->parent = succ;
+
+		replace_child(tree, node->parent, node, succ);
+	} else {
+		fixup = node->parent;
+
+		replace_child(tree, node->parent, node,
+			      node->left ? node->left : node->right);
+	}
+
+	tree->numnodes--;
+
+	rebalance(tree, fixup);
+}
+
+void rank_set_counted(struct rank_tree *tree, void *item, bool counted)
+{
+	struct rank_node *node = NODE(tree, item);
+
+	if (node->counted == counted)
+		return;
+
+	node->counted = counted;
+
+	for (; node; node = node->parent)
+		node->count = count(node->left) + count(node->right) +
+			node->counted;
+}
+
+void *rank_first(struct rank_tree *tree)
+{
+	struct rank_node *node = tree->root;
+
+	if (!node)
+		return NULL;
+
+	while (node->left)
+		node = node->left;
+
+	return ITEM(tree, node);
+}
+
+void *rank_last(struct rank_tree *tree)
+{
+	struct rank_node *node = tree->root;
+
+	if (!node)
+		return NULL;
+
+	while (node->right)
+		node = node->right;
+
+	return ITEM(tree, node);
+}
+
+void *rank_next(struct rank_tree *tree, void *item)
+{
+	struct rank_node *node = NODE(tree, item);
+
+	if (node->right) {
+		for (node = node->right; node->left; node = node->left)
+			;
+		return ITEM(tree, node);
+	}
+
+	while (node->parent && (node->parent->right == node))
+		node = node->parent;
+
+	return node->parent ? ITEM(tree, node->parent) : NULL;
+}
+
+void *rank_prev(struct rank_tree *tree, void *item)
+{
+	struct rank_node *node = NODE(tree, item);
+
+	if (node->left) {
+		for (node = node->left; node->right; node = node->right)
+			;
+		return ITEM(tree, node);
+	}
+
+	while (node->parent && (node->parent->left == node))
+		node = node->parent;
+
+	return node->parent ? ITEM(tree, node->parent) : NULL;
+}
+
+/*
+ * Find the counted item that has exactly @n counted items after it.  In
+ * other words, skip @n counted items starting from the end of the tree.
+ */
+void *rank_nth_last(struct rank_tree *tree, size_t n)
+{
+	struct rank_node *cur = tree->root;
+
+	while (cur) {
+		size_t right = count(cur->right);
+
+		if (n < right) {
+			cur = cur->right;
+			continue;
+		}
+
+		n -= right;
+
+		if (cur->counted) {
+			if (!n)
+				return ITEM(tree, cur);
+			n--;
+		}
+
+		cur = cur->left;
+	}
+
+	return NULL;
+}
+
+/*
+ * Tear down the tree one leaf at a time without any rebalancing.  The
+ * cookie must be zeroed before the first call.
+ */
+void *rank_destroy_nodes(struct rank_tree *tree, struct rank_cookie *cookie)
+{
+	struct rank_node *node;
+
+	node = cookie->node ? cookie->node : tree->root;
+	if (!node)
+		return NULL;
+
+	/* find a leaf */
+	for (;;) {
+		if (node->left)
+			node = node->left;
+		else if (node->right)
+			node = node->right;
+		else
+			break;
+	}
+
+	replace_child(tree, node->parent, node, NULL);
+
+	cookie->node = node->parent;
+	tree->numnodes--;
+
+	return ITEM(tree, node);
+}
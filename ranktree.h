@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __RANKTREE_H
+#define __RANKTREE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * An AVL tree where each node keeps track of how many "counted" nodes
+ * there are in its subtree.  This makes it possible to find the n-th
+ * counted node in O(log n) time.
+ *
+ * Like the libjeffpc rb tree, the nodes are embedded in the items and the
+ * functions take & return pointers to the items.
+ */
+
+struct rank_node {
+	struct rank_node *parent;
+	struct rank_node *left;
+	struct rank_node *right;
+	int height;
+	bool counted;
+	size_t count;		/* counted nodes in this subtree */
+};
+
+struct rank_tree {
+	int (*cmp)(const void *, const void *);
+	struct rank_node *root;
+	size_t node_off;
+	size_t numnodes;
+};
+
+struct rank_cookie {
+	struct rank_node *node;
+};
+
+extern void rank_create(struct rank_tree *tree,
+			int (*cmp)(const void *, const void *),
+			size_t size, size_t off);
+extern void rank_destroy(struct rank_tree *tree);
+extern void *rank_find(struct rank_tree *tree, const void *key);
+extern void *rank_insert(struct rank_tree *tree, void *item, bool counted);
+extern void rank_build(struct rank_tree *tree, void **items, size_t nitems,
+		       bool (*counted)(void *));
+extern void rank_remove(struct rank_tree *tree, void *item);
+extern void rank_set_counted(struct rank_tree *tree, void *item,
+			     bool counted);
+extern void *rank_first(struct rank_tree *tree);
+extern void *rank_last(struct rank_tree *tree);
+extern void *rank_next(struct rank_tree *tree, void *item);
+extern void *rank_prev(struct rank_tree *tree, void *item);
+extern void *rank_nth_last(struct rank_tree *tree, size_t n);
+extern void *rank_destroy_nodes(struct rank_tree *tree,
+				struct rank_cookie *cookie);
+
+static inline size_t rank_numnodes(struct rank_tree *tree)
+{
+	return tree->numnodes;
+}
+
+static inline size_t rank_numcounted(struct rank_tree *tree)
+{
+	return tree->root ? tree->root->count : 0;
+}
+
+#define rank_for_each(tree, pos)					\
+	for (pos = rank_first(tree); pos; pos = rank_next((tree), pos))
+
+#endif
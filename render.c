@@ -32,20 +32,136 @@
 
 #include <jeffpc/error.h>
 #include <jeffpc/file-cache.h>
+#include <jeffpc/mem.h>
+#include <jeffpc/rbtree.h>
+#include <jeffpc/synch.h>
 
 #include "render.h"
 #include "parse.h"
 #include "config.h"
+#include "utils.h"
+#include "debug.h"
 
-char *render_page(struct req *req, const char *str)
+/*
+ * Compiled template cache
+ *
+ * Lexing and parsing a template is far more expensive than executing it,
+ * so we compile each template once and keep the result around.  Templates
+ * loaded from files are keyed by their path and remember the file cache
+ * revision they were compiled from.  Templates passed in directly (e.g.,
+ * "{index}") never change, and so they are keyed by their source text.
+ */
+struct tmpl_cache_entry {
+	struct rb_node node;
+
+	/* key */
+	char *name;
+
+	/* value */
+	uint64_t rev;
+	uint64_t compiled;	/* unix time */
+	struct tmpl *tmpl;
+};
+
+/*
+ * Every render looks up at least one template (and usually many more), so
+ * lookups share the lock and only compilation results take it exclusively.
+ */
+static struct rb_tree tmpl_cache;
+static struct rwlock tmpl_cache_lock;
+static LOCK_CLASS(tmpl_cache_lc);
+
+static unsigned int now_sym;		/* {now} */
+
+static int tmpl_cache_cmp(const void *va, const void *vb)
+{
+	const struct tmpl_cache_entry *a = va;
+	const struct tmpl_cache_entry *b = vb;
+	int ret;
+
+	ret = strcmp(a->name, b->name);
+
+	if (ret < 0)
+		return -1;
+	if (ret > 0)
+		return 1;
+	return 0;
+}
+
+void init_render_subsys(void)
+{
+	rb_create(&tmpl_cache, tmpl_cache_cmp, sizeof(struct tmpl_cache_entry),
+		  offsetof(struct tmpl_cache_entry, node));
+
+	RWINIT(&tmpl_cache_lock, &tmpl_cache_lc);
+
+	now_sym = vars_intern("now");
+}
+
+void tmpl_init_block(struct list *block)
+{
+	list_create(block, sizeof(struct tmpl_insn),
+		    offsetof(struct tmpl_insn, node));
+}
+
+static void __free_block(struct list *block)
+{
+	struct tmpl_insn *insn;
+
+	while ((insn = list_remove_head(block))) {
+		switch (insn->type) {
+			case TI_TEXT:
+				free(insn->text);
+				break;
+			case TI_VAR:
+				free(insn->var);
+				break;
+			case TI_PIPELINE:
+				free(insn->var);
+				pipeline_destroy(insn->pipeline);
+				break;
+			case TI_FOREACH:
+				free(insn->var);
+				free(insn->tmpl);
+				break;
+			case TI_COND:
+				free(insn->arg[0].str);
+				free(insn->arg[1].str);
+				__free_block(&insn->branch[TMPL_BRANCH_TRUE]);
+				__free_block(&insn->branch[TMPL_BRANCH_FALSE]);
+				break;
+		}
+
+		free(insn);
+	}
+
+	list_destroy(block);
+}
+
+void tmpl_destroy(struct tmpl *tmpl)
+{
+	__free_block(&tmpl->insns);
+	free(tmpl);
+}
+
+struct tmpl *tmpl_compile(const char *str, size_t len)
 {
 	struct parser_output x;
+	struct tmpl *tmpl;
+
+	tmpl = malloc(sizeof(struct tmpl));
+	ASSERT(tmpl);
 
-	x.req   = req;
-	x.post  = NULL;
-	x.input = str;
-	x.len   = strlen(str);
-	x.pos   = 0;
+	refcnt_init(&tmpl->refcnt, 1);
+	tmpl_init_block(&tmpl->insns);
+
+	x.req    = NULL;
+	x.post   = NULL;
+	x.tmpl   = tmpl;
+	x.input  = str;
+	x.len    = len;
+	x.pos    = 0;
+	x.lineno = 0;
 
 	x.cond_stack_use = -1;
 
@@ -56,25 +172,432 @@ char *render_page(struct req *req, const char *str)
 
 	tmpl_lex_destroy(x.scanner);
 
-	return x.output;
+	return tmpl;
 }
 
-char *render_template(struct req *req, const char *tmpl)
+/*
+ * Look up @name in the cache.  If it isn't there (or is out of date),
+ * compile it using @src (if non-NULL) or the contents of the file @name.
+ * The file revision the template was compiled from is returned via @rev,
+ * and the time it was compiled via @compiled.  Since the file is read
+ * before compiling, the latter is never older than the file's mtime.
+ */
+static struct tmpl *tmpl_cache_get(const char *name, const char *src,
+				   uint64_t *rev_r, uint64_t *compiled_r)
 {
-	char path[FILENAME_MAX];
+	struct tmpl_cache_entry key = {
+		.name = (char *) name,
+	};
+	struct tmpl_cache_entry *cur;
+	struct rb_cookie where;
+	struct tmpl *tmpl;
+	uint64_t compiled;
 	struct str *raw;
-	char *out;
+	uint64_t rev;
+
+	RWLOCK(&tmpl_cache_lock, false);
+	cur = rb_find(&tmpl_cache, &key, NULL);
+	if (cur) {
+		tmpl = tmpl_getref(cur->tmpl);
+		rev = cur->rev;
+		compiled = cur->compiled;
+	} else {
+		tmpl = NULL;
+	}
+	RWUNLOCK(&tmpl_cache_lock);
+
+	/* check the file's freshness without holding the lock */
+	if (tmpl) {
+		if (src || !file_cache_has_newer(name, rev)) {
+			*rev_r = rev;
+			*compiled_r = compiled;
+			return tmpl;
+		}
+
+		tmpl_putref(tmpl);
+	}
+
+	/* not cached or stale - compile it outside of the lock */
+	if (src) {
+		rev = 0;
+		tmpl = tmpl_compile(src, strlen(src));
+	} else {
+		raw = file_cache_get(name, &rev);
+		if (IS_ERR(raw))
+			return NULL;
+
+		tmpl = tmpl_compile(str_cstr(raw), str_len(raw));
+
+		str_putref(raw);
+	}
+
+	compiled = time(NULL);
+
+	RWLOCK(&tmpl_cache_lock, true);
+	cur = rb_find(&tmpl_cache, &key, &where);
+	if (!cur) {
+		cur = malloc(sizeof(struct tmpl_cache_entry));
+		if (cur) {
+			cur->name = xstrdup(name);
+			cur->rev  = rev;
+			cur->compiled = compiled;
+			cur->tmpl = tmpl_getref(tmpl);
+
+			rb_insert_here(&tmpl_cache, cur, &where);
+		}
+	} else if (cur->rev < rev) {
+		/* someone else may have raced us with an older version */
+		tmpl_putref(cur->tmpl);
+		cur->rev  = rev;
+		cur->compiled = compiled;
+		cur->tmpl = tmpl_getref(tmpl);
+	}
+	RWUNLOCK(&tmpl_cache_lock);
+
+	*rev_r = rev;
+	*compiled_r = compiled;
+
+	return tmpl;
+}
+
+/*
+ * Recompile @name if it is cached and the file changed.  Templates that
+ * aren't cached are left alone - they will be compiled on first use.
+ */
+void tmpl_cache_refresh(const char *name)
+{
+	struct tmpl_cache_entry key = {
+		.name = (char *) name,
+	};
+	struct tmpl *tmpl;
+	uint64_t compiled;
+	bool cached;
+	uint64_t rev;
+
+	RWLOCK(&tmpl_cache_lock, false);
+	cached = rb_find(&tmpl_cache, &key, NULL) != NULL;
+	RWUNLOCK(&tmpl_cache_lock);
+
+	if (!cached)
+		return;
+
+	tmpl = tmpl_cache_get(name, NULL, &rev, &compiled);
+	if (tmpl)
+		tmpl_putref(tmpl);
+}
+
+/*
+ * Template execution
+ *
+ * All output of a render is appended to a single growable buffer.
+ */
+
+struct render_out {
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+#define RENDER_OUT_INIT_SIZE	(16 * 1024)
+
+static void out_append(struct render_out *out, const char *str, size_t len)
+{
+	if ((out->len + len + 1) > out->alloc) {
+		out->alloc = MAX(out->alloc * 2, out->len + len + 1);
+		out->alloc = MAX(out->alloc, RENDER_OUT_INIT_SIZE);
+
+		out->buf = realloc(out->buf, out->alloc);
+		ASSERT(out->buf);
+	}
+
+	memcpy(out->buf + out->len, str, len);
+	out->len += len;
+	out->buf[out->len] = '\0';
+}
+
+static void out_append_int(struct render_out *out, uint64_t v)
+{
+	char buf[32];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%"PRIu64, v);
+
+	out_append(out, buf, len);
+}
+
+static void __render(struct req *req, struct render_out *out,
+		     struct list *block);
+static void __render_template(struct req *req, struct render_out *out,
+			      const char *name);
+
+static void __foreach(struct req *req, struct render_out *out,
+		      struct tmpl_insn *insn, struct val *var)
+{
+	struct val **items;
+	size_t nitems;
+	size_t i;
+
+	ASSERT3U(var->type, ==, VT_ARRAY);
+
+	items = var->array.vals;
+	nitems = var->array.nelem;
+
+	vars_index_array(&req->vars, var);
+
+	for (i = 0; i < nitems; i++) {
+		switch (items[i]->type) {
+			case VT_NVL:
+				/* the array keeps the item alive */
+				vars_scope_push_nvl(&req->vars,
+						    val_cast_to_nvl(items[i]));
+				break;
+			case VT_STR:
+				vars_scope_push(&req->vars);
+				vars_set_sym(&req->vars, insn->sym,
+					     val_getref(items[i]));
+				break;
+			default:
+				//vars_dump(&req->vars);
+				panic("%s called with '%s' which has type %d",
+				      __func__, insn->var, items[i]->type);
+		}
+
+		__render_template(req, out, insn->tmpl);
+
+		vars_scope_pop(&req->vars);
+	}
+}
+
+static void foreach(struct req *req, struct render_out *out,
+		    struct tmpl_insn *insn)
+{
+	struct val *var;
+
+	var = vars_lookup_sym(&req->vars, insn->sym);
+	if (!var)
+		return;
+
+	__foreach(req, out, insn, var);
+}
+
+static void print_val(struct render_out *out, struct val *val)
+{
+	struct str *str;
+
+	switch (val->type) {
+		case VT_STR:
+			str = val_cast_to_str(val);
+			out_append(out, str_cstr(str), str_len(str));
+			break;
+		case VT_INT:
+			out_append_int(out, val->i);
+			break;
+		case VT_BLOB:
+		case VT_NULL:
+		case VT_SYM:
+		case VT_CONS:
+		case VT_BOOL:
+		case VT_CHAR:
+		case VT_ARRAY:
+		case VT_NVL:
+			panic("%s called with value of type %d", __func__,
+			      val->type);
+	}
+}
+
+static void pipeline(struct req *req, struct render_out *out,
+		     struct tmpl_insn *insn)
+{
+	struct pipestage *cur;
+	struct val *val;
+
+	val = vars_lookup_sym(&req->vars, insn->sym);
+	if (!val)
+		return;
+
+	switch (val->type) {
+		case VT_STR:
+		case VT_INT:
+			break;
+		default:
+			vars_dump(&req->vars);
+			panic("%s called with '%s' which has type %d", __func__,
+			      insn->var, val->type);
+			break;
+	}
+
+	/* the stages consume their input */
+	val = val_getref(val);
+
+	list_for_each(cur, &insn->pipeline->pipe)
+		val = cur->stage->f(val, &req->arena);
+
+	print_val(out, val);
+
+	val_putref(val);
+}
+
+/*
+ * The current time differs on every request.  If the page is going into
+ * the page cache, leave it out and remember where it goes instead.
+ */
+static bool __now_placeholder(struct req *req, struct render_out *out,
+			      struct tmpl_insn *insn)
+{
+	if (insn->sym != now_sym)
+		return false;
+
+	req->uses_now = true;
+
+	if (!req->cache_key)
+		return false;
+
+	req->now_offs = mem_reallocarray(req->now_offs, req->nnow + 1,
+					 sizeof(size_t));
+	ASSERT(req->now_offs);
+
+	req->now_offs[req->nnow++] = out->len;
+
+	return true;
+}
+
+static void variable(struct req *req, struct render_out *out,
+		     struct tmpl_insn *insn)
+{
+	struct val *var;
+
+	if (__now_placeholder(req, out, insn))
+		return;
+
+	var = vars_lookup_sym(&req->vars, insn->sym);
+
+	if (!var)
+		__render_template(req, out, insn->var);
+	else
+		print_val(out, var);
+}
+
+static uint64_t __cond_get_arg(struct req *req, struct tmpl_arg *arg)
+{
+	struct val *var;
+
+	if (arg->literal)
+		return arg->value;
+
+	var = vars_lookup_sym(&req->vars, arg->sym);
+	if (!var)
+		return 0;
+
+	switch (var->type) {
+		case VT_INT:
+			return var->i;
+		default:
+			panic("unexpected variable type: %d", var->type);
+	}
+}
+
+static bool cond(struct req *req, struct tmpl_insn *insn)
+{
+	uint64_t ia1, ia2;		/* int value of argX */
+
+	if (insn->cond == TC_SET)
+		return vars_lookup_sym(&req->vars, insn->arg[0].sym) != NULL;
+
+	ia1 = __cond_get_arg(req, &insn->arg[0]);
+	ia2 = __cond_get_arg(req, &insn->arg[1]);
+
+	switch (insn->cond) {
+		case TC_GT:
+			return ia1 > ia2;
+		case TC_LT:
+			return ia1 < ia2;
+		case TC_EQ:
+			return ia1 == ia2;
+		case TC_SET:
+			break;
+	}
+
+	panic("unknown template condition %d", insn->cond);
+}
+
+static void __render(struct req *req, struct render_out *out,
+		     struct list *block)
+{
+	struct tmpl_insn *insn;
+
+	list_for_each(insn, block) {
+		switch (insn->type) {
+			case TI_TEXT:
+				out_append(out, insn->text, insn->len);
+				break;
+			case TI_VAR:
+				variable(req, out, insn);
+				break;
+			case TI_PIPELINE:
+				pipeline(req, out, insn);
+				break;
+			case TI_FOREACH:
+				foreach(req, out, insn);
+				break;
+			case TI_COND:
+				__render(req, out,
+					 &insn->branch[cond(req, insn) ?
+						       TMPL_BRANCH_TRUE :
+						       TMPL_BRANCH_FALSE]);
+				break;
+		}
+	}
+}
+
+static void __render_template(struct req *req, struct render_out *out,
+			      const char *name)
+{
+	char path[FILENAME_MAX];
+	struct tmpl *tmpl;
+	uint64_t compiled;
+	uint64_t rev;
 
 	snprintf(path, sizeof(path), "%s/%s/%s.tmpl",
-		 str_cstr(config.template_dir), str_cstr(req->fmt), tmpl);
+		 str_cstr(config.template_dir), str_cstr(req->fmt), name);
+
+	tmpl = tmpl_cache_get(path, NULL, &rev, &compiled);
+	if (!tmpl)
+		return;
+
+	req_add_dep(req, path, rev);
+	req->tmpl_modified = MAX(req->tmpl_modified, compiled);
+
+	__render(req, out, &tmpl->insns);
+
+	tmpl_putref(tmpl);
+}
+
+/*
+ * Render the template source @str and use the output as the response body.
+ */
+void render_page(struct req *req, const char *str)
+{
+	struct render_out out = {
+		.buf = NULL,
+		.len = 0,
+		.alloc = 0,
+	};
+	struct tmpl *tmpl;
+	uint64_t compiled;
+	uint64_t rev;
+
+	tmpl = tmpl_cache_get(str, str, &rev, &compiled);
+
+	/* make sure we always have a buffer, even if it is empty */
+	out_append(&out, "", 0);
 
-	raw = file_cache_get(path, NULL);
-	if (IS_ERR(raw))
-		return NULL;
+	/* {now} offsets are relative to this body */
+	req->nnow = 0;
 
-	out = render_page(req, str_cstr(raw));
+	__render(req, &out, &tmpl->insns);
 
-	str_putref(raw);
+	tmpl_putref(tmpl);
 
-	return out;
+	req->scgi->response.body = out.buf;
+	req->scgi->response.bodylen = out.len;
 }
@@ -25,7 +25,8 @@
 
 #include "req.h"
 
-extern char *render_template(struct req *req, const char *tmpl);
-extern char *render_page(struct req *req, const char *str);
+extern void init_render_subsys(void);
+extern void tmpl_cache_refresh(const char *name);
+extern void render_page(struct req *req, const char *str);
 
 #endif
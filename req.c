@@ -20,6 +20,10 @@
  * SOFTWARE.
  */
 
+#include <time.h>
+#include <inttypes.h>
+#include <strings.h>
+
 #include <jeffpc/atomic.h>
 #include <jeffpc/int.h>
 #include <jeffpc/mem.h>
@@ -32,17 +36,42 @@
 #include "sidebar.h"
 #include "render.h"
 #include "static.h"
+#include "pagecache.h"
+#include "reqlog.h"
+#include "post.h"
 #include "debug.h"
 #include "version.h"
 
-static void __vars_set_social(struct vars *vars)
+/*
+ * Variables that are the same for every request.  They are set up once
+ * after the config is loaded and shared (read-only) by all requests.
+ */
+static struct vars_base *global_vars;
+
+void init_req_subsys(void)
 {
+	struct nvlist *vars;
+
+	vars = nvl_alloc();
+	ASSERT(vars);
+
+	ASSERT0(nvl_set_str(vars, "generatorversion",
+			    STATIC_STR(version_string)));
+	ASSERT0(nvl_set_str(vars, "baseurl", str_getref(config.base_url)));
+	ASSERT0(nvl_set_int(vars, "captcha_a", config.comment_captcha_a));
+	ASSERT0(nvl_set_int(vars, "captcha_b", config.comment_captcha_b));
+	ASSERT0(nvl_set_array(vars, "posts", NULL, 0));
+
 	if (config.twitter_username)
-		vars_set_str(vars, "twitteruser",
-			     str_getref(config.twitter_username));
+		ASSERT0(nvl_set_str(vars, "twitteruser",
+				    str_getref(config.twitter_username)));
 	if (config.twitter_description)
-		vars_set_str(vars, "twitterdesc",
-			     str_getref(config.twitter_description));
+		ASSERT0(nvl_set_str(vars, "twitterdesc",
+				    str_getref(config.twitter_description)));
+
+	global_vars = vars_base_alloc(vars);
+
+	nvl_putref(vars);
 }
 
 void req_init(struct req *req, struct scgi *scgi)
@@ -54,14 +83,9 @@ void req_init(struct req *req, struct scgi *scgi)
 	req->scgi = scgi;
 
 	/* state */
-	vars_init(&req->vars);
-	vars_set_str(&req->vars, "generatorversion", STATIC_STR(version_string));
-	vars_set_str(&req->vars, "baseurl", str_getref(config.base_url));
+	arena_init(&req->arena);
+	vars_init(&req->vars, global_vars);
 	vars_set_int(&req->vars, "now", gettime());
-	vars_set_int(&req->vars, "captcha_a", config.comment_captcha_a);
-	vars_set_int(&req->vars, "captcha_b", config.comment_captcha_b);
-	vars_set_array(&req->vars, "posts", NULL, 0);
-	__vars_set_social(&req->vars);
 
 	req->fmt = NULL;
 
@@ -74,7 +98,10 @@ static void calculate_content_length(struct req *req)
 {
 	char tmp[64];
 
-	/* if body length is 0, we automatically figure out the length */
+	/*
+	 * Rendered pages already know their length.  Anything else that
+	 * left the body length at 0 gets it computed here.
+	 */
 	if (!req->scgi->response.bodylen)
 		req->scgi->response.bodylen = strlen(req->scgi->response.body);
 
@@ -115,18 +142,16 @@ static void nvl_set_time(struct nvlist *nvl, const char *name, uint64_t ts)
 static void log_request(struct req *req)
 {
 	struct scgi *scgi = req->scgi;
-	char fname[FILENAME_MAX];
 	struct nvlist *logentry;
 	struct nvlist *tmp;
-	struct buffer *buf;
+	uint64_t lock_acquires;
+	uint64_t lock_wait_time;
 	uint64_t now;
-	int ret;
 
-	now = gettime();
+	if (!reqlog_sampled(scgi->id))
+		return;
 
-	snprintf(fname, sizeof(fname), "%s/requests/%"PRIu64".%09"PRIu64"-%011u",
-		 str_cstr(config.data_dir), now / 1000000000u,
-		 now % 1000000000u, scgi->id);
+	now = gettime();
 
 	/*
 	 * allocate a log entry & store some misc info
@@ -191,6 +216,12 @@ static void log_request(struct req *req)
 	nvl_set_time(tmp, "scgi-compute", scgi->scgi_stats.compute_time);
 	nvl_set_time(tmp, "scgi-write-header", scgi->scgi_stats.write_header_time);
 	nvl_set_time(tmp, "scgi-write-body", scgi->scgi_stats.write_body_time);
+	index_get_lock_stats(&lock_acquires, &lock_wait_time);
+	nvl_set_int(tmp, "index-lock-acquires", lock_acquires);
+	nvl_set_int(tmp, "index-lock-wait-time", lock_wait_time);
+	nvl_set_int(tmp, "request-log-dropped", reqlog_dropped());
+	nvl_set_int(tmp, "arena-used", req->arena.used);
+	nvl_set_int(tmp, "arena-size", req->arena.size);
 	nvl_set_nvl(logentry, "stats", tmp);
 
 	/*
@@ -202,24 +233,11 @@ static void log_request(struct req *req)
 	nvl_set_int(tmp, "index-stories", req->opts.index_stories);
 	nvl_set_nvl(logentry, "options", tmp);
 
-	/* serialize */
-	buf = nvl_pack(logentry, VF_CBOR);
-	if (IS_ERR(buf))
-		goto err_free;
-
-	ret = write_file(fname, buffer_data(buf), buffer_size(buf));
-	if (ret)
-		goto err_free_buf;
-
-	buffer_free(buf);
-
-	nvl_putref(logentry);
+	/* hand it off to the writer thread */
+	reqlog_submit(logentry);
 
 	return;
 
-err_free_buf:
-	buffer_free(buf);
-
 err_free:
 	nvl_putref(logentry);
 
@@ -232,10 +250,21 @@ void req_destroy(struct req *req)
 	log_request(req);
 
 	str_putref(req->fmt);
-	free(req->scgi->response.body);
+
+	if (req->body_release)
+		req->body_release(req->body_release_arg);
+	else
+		free(req->scgi->response.body);
+
+	free(req->cache_key);
+	free(req->now_offs);
+	nvl_putref(req->deps);
 
 	vars_destroy(&req->vars);
 
+	/* nothing may reference the arena past this point */
+	arena_destroy(&req->arena);
+
 	set_session(0);
 }
 
@@ -247,6 +276,36 @@ void req_head(struct req *req, const char *name, const char *val)
 	ASSERT0(ret);
 }
 
+/*
+ * Record that the output depends on revision @rev of file @path.  This is
+ * a no-op unless the page cache is interested in this request.
+ */
+void req_add_dep(struct req *req, const char *path, uint64_t rev)
+{
+	if (!req->deps)
+		return;
+
+	(void) nvl_set_int(req->deps, path, rev);
+}
+
+void req_add_deps(struct req *req, struct nvlist *deps)
+{
+	const struct nvpair *pair;
+
+	if (!req->deps)
+		return;
+
+	nvl_for_each(pair, deps) {
+		struct str *name = nvpair_name_str(pair);
+		uint64_t rev;
+
+		if (!nvpair_value_int(pair, &rev))
+			req_add_dep(req, str_cstr(name), rev);
+
+		str_putref(name);
+	}
+}
+
 static const struct nvl_convert_info info[] = {
 	{ .name = "p",       .tgt_type = VT_INT, },
 	{ .name = "paged",   .tgt_type = VT_INT, },
@@ -383,8 +442,246 @@ static int get_page_number(struct req *req)
 	return tmp;
 }
 
+/*
+ * Compute a strong ETag for the response body (64-bit FNV-1a hash).
+ */
+void req_set_etag(struct req *req)
+{
+	if (req->etag_valid)
+		return;
+
+	req->etag = fnv1a_hash(req->scgi->response.body,
+			       req->scgi->response.bodylen);
+	req->etag_valid = true;
+}
+
+/* the q-value of the Accept-Encoding entry at @cur, @len bytes long */
+static double __coding_qvalue(const char *cur, size_t len)
+{
+	const char *q;
+
+	q = memchr(cur, ';', len);
+	q = q ? strstr(q, "q=") : NULL;
+
+	if (!q || (q >= cur + len))
+		return 1;
+
+	return strtod(q + 2, NULL);
+}
+
+/*
+ * Does the client accept gzip?  An explicit gzip entry in Accept-Encoding
+ * decides it.  Otherwise, a * entry does.  Either way, q=0 means the
+ * coding is refused.
+ */
+static bool __accepts_gzip(struct req *req)
+{
+	const char *cur;
+	struct str *hdr;
+	double gzip_q;
+	double star_q;
+
+	hdr = nvl_lookup_str(req->scgi->request.headers,
+			     "HTTP_ACCEPT_ENCODING");
+	if (IS_ERR(hdr))
+		return false;
+
+	/* negative means not mentioned */
+	gzip_q = -1;
+	star_q = -1;
+
+	for (cur = str_cstr(hdr); *cur; ) {
+		size_t toklen;
+		size_t len;
+
+		cur += strspn(cur, " \t,");
+		len = strcspn(cur, ",");
+		toklen = strcspn(cur, " \t;,");
+
+		if ((toklen == 4) && !strncasecmp(cur, "gzip", 4))
+			gzip_q = __coding_qvalue(cur, len);
+		else if ((toklen == 1) && (*cur == '*'))
+			star_q = __coding_qvalue(cur, len);
+
+		cur += len;
+	}
+
+	str_putref(hdr);
+
+	if (gzip_q >= 0)
+		return gzip_q > 0;
+
+	return star_q > 0;
+}
+
+/*
+ * If there is a precompressed variant of the body and the client accepts
+ * it, serve it instead of the body.
+ */
+static void select_encoding(struct req *req)
+{
+	if (!req->gz_body || (req->scgi->response.status != SCGI_STATUS_OK))
+		return;
+
+	req_head(req, "Vary", "Accept-Encoding");
+
+	if (!__accepts_gzip(req))
+		return;
+
+	/* make sure the ETag is of the uncompressed body */
+	req_set_etag(req);
+
+	req->scgi->response.body = (char *) req->gz_body;
+	req->scgi->response.bodylen = req->gz_len;
+	req->gzip = true;
+
+	req_head(req, "Content-Encoding", "gzip");
+}
+
+static bool __etag_matches(struct req *req, const char *etag)
+{
+	struct str *hdr;
+	bool match;
+
+	hdr = nvl_lookup_str(req->scgi->request.headers, "HTTP_IF_NONE_MATCH");
+	if (IS_ERR(hdr))
+		return false;
+
+	/*
+	 * The header is a list of (possibly weak) quoted ETags, or "*".
+	 * Our quoted ETag cannot appear as a substring of a different
+	 * ETag, so a substring search is good enough.
+	 */
+	match = !strcmp(str_cstr(hdr), "*") || strstr(str_cstr(hdr), etag);
+
+	str_putref(hdr);
+
+	return match;
+}
+
+static bool __not_modified_since(struct req *req)
+{
+	struct str *hdr;
+	struct tm tm;
+	char *end;
+	bool ret;
+
+	if (!req->last_modified)
+		return false;
+
+	hdr = nvl_lookup_str(req->scgi->request.headers,
+			     "HTTP_IF_MODIFIED_SINCE");
+	if (IS_ERR(hdr))
+		return false;
+
+	memset(&tm, 0, sizeof(tm));
+
+	end = strptime(str_cstr(hdr), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	ret = end && (req->last_modified <= timegm(&tm));
+
+	str_putref(hdr);
+
+	return ret;
+}
+
+/*
+ * Attach validators to successful GET responses, and turn the response
+ * into a 304 if the client already has this version.  Static files come
+ * with their ETag precomputed.
+ *
+ * Pages that show the current time (e.g., the comment form's think time
+ * start) are different on every request, so they get no validators and
+ * are marked as not to be reused without asking.
+ */
+static void check_not_modified(struct req *req)
+{
+	struct str *method;
+	char etag[32];
+	bool not_modified;
+	int ret;
+
+	if (req->scgi->response.status != SCGI_STATUS_OK)
+		return;
+
+	method = nvl_lookup_str(req->scgi->request.headers,
+				SCGI_REQUEST_METHOD);
+	if (IS_ERR(method))
+		return;
+
+	ret = strcmp(str_cstr(method), "GET");
+
+	str_putref(method);
+
+	if (ret)
+		return;
+
+	if (req->uses_now) {
+		req_head(req, "Cache-Control", "no-cache");
+		return;
+	}
+
+	req_set_etag(req);
+
+	/* each encoding is a different representation */
+	snprintf(etag, sizeof(etag), "\"%016"PRIx64"%s\"", req->etag,
+		 req->gzip ? "-gz" : "");
+	req_head(req, "ETag", etag);
+
+	if (req->last_modified) {
+		time_t lm = req->last_modified;
+		char buf[64];
+		struct tm tm;
+
+		gmtime_r(&lm, &tm);
+		strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+		req_head(req, "Last-Modified", buf);
+	}
+
+	/* If-None-Match takes precedence over If-Modified-Since */
+	if (nvl_exists(req->scgi->request.headers, "HTTP_IF_NONE_MATCH"))
+		not_modified = __etag_matches(req, etag);
+	else
+		not_modified = __not_modified_since(req);
+
+	if (!not_modified)
+		return;
+
+	/* drop the body */
+	if (req->body_release)
+		req->body_release(req->body_release_arg);
+	else
+		free(req->scgi->response.body);
+
+	req->body_release = NULL;
+	req->body_release_arg = NULL;
+	req->gz_body = NULL;
+
+	req->scgi->response.status = SCGI_STATUS_NOTMODIFIED;
+	req->scgi->response.body = xstrdup("");
+	req->scgi->response.bodylen = 0;
+}
+
+/*
+ * Pages built from posts know when the posts last changed, but they are
+ * also built from templates and the index (e.g., the tag cloud and post
+ * listings), so the Last-Modified has to account for those as well.  Pages
+ * that don't come from posts don't get a Last-Modified at all.
+ */
+static void finish_last_modified(struct req *req)
+{
+	if (!req->last_modified)
+		return;
+
+	req->last_modified = MAX(req->last_modified, req->tmpl_modified);
+	req->last_modified = MAX(req->last_modified, index_get_last_change());
+}
+
 int req_dispatch(struct req *req)
 {
+	int ret;
+
 	if (!select_page(req))
 		return R404(req, NULL);
 
@@ -394,27 +691,58 @@ int req_dispatch(struct req *req)
 	if (!switch_content_type(req))
 		return R404(req, "{error_unsupported_feed_fmt}");
 
+	/*
+	 * Conditional requests can be answered without rendering only on a
+	 * page cache hit.  On a miss, we have no validators to compare
+	 * against: the ETag is a hash of the body, and the Last-Modified
+	 * depends on every post, template, and index state the page ends up
+	 * using - none of which are known until the page is rendered.
+	 */
+	if (pagecache_lookup(req)) {
+		select_encoding(req);
+		check_not_modified(req);
+		return 0;
+	}
+
 	switch (req->page) {
 		case PAGE_STATIC:
-			return blahg_static(req);
+			ret = blahg_static(req);
+			break;
 		case PAGE_ARCHIVE:
-			return blahg_archive(req, get_page_number(req));
+			ret = blahg_archive(req, get_page_number(req));
+			break;
 		case PAGE_CATEGORY:
-			return blahg_category(req, get_page_number(req));
+			ret = blahg_category(req, get_page_number(req));
+			break;
 		case PAGE_TAG:
-			return blahg_tag(req, get_page_number(req));
+			ret = blahg_tag(req, get_page_number(req));
+			break;
 		case PAGE_COMMENT:
-			return blahg_comment(req);
+			ret = blahg_comment(req);
+			break;
 		case PAGE_INDEX:
-			return blahg_index(req, get_page_number(req));
+			ret = blahg_index(req, get_page_number(req));
+			break;
 		case PAGE_STORY:
-			return blahg_story(req);
+			ret = blahg_story(req);
+			break;
 		case PAGE_ADMIN:
-			return blahg_admin(req);
+			ret = blahg_admin(req);
+			break;
 		default:
 			// FIXME: send $SCRIPT_URL, $PATH_INFO, and $QUERY_STRING via email
-			return R404(req, NULL);
+			ret = R404(req, NULL);
+			break;
+	}
+
+	if (!ret) {
+		finish_last_modified(req);
+		pagecache_insert(req);
+		select_encoding(req);
+		check_not_modified(req);
 	}
+
+	return ret;
 }
 
 int R404(struct req *req, char *tmpl)
@@ -432,7 +760,7 @@ int R404(struct req *req, char *tmpl)
 
 	sidebar(req);
 
-	req->scgi->response.body = render_page(req, tmpl);
+	render_page(req, tmpl);
 
 	return 0;
 }
@@ -453,7 +781,7 @@ int R301(struct req *req, struct str *url)
 
 	vars_set_str(&req->vars, "redirect", url);
 
-	req->scgi->response.body = render_page(req, "{301}");
+	render_page(req, "{301}");
 
 	return 0;
 }
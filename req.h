@@ -29,6 +29,7 @@
 #include <jeffpc/scgi.h>
 
 #include "vars.h"
+#include "arena.h"
 
 enum page {
 	PAGE_ARCHIVE,
@@ -49,18 +50,52 @@ struct req {
 
 	/* state */
 	struct vars vars;
+	struct arena arena;	/* scratch memory freed with the request */
 
 	struct str *fmt;	/* format (e.g., "html") */
 
 	struct {
 		int index_stories;
 	} opts;
+
+	/*
+	 * If set, the response body is not ours to free() and this is
+	 * called to release it instead.
+	 */
+	void (*body_release)(void *);
+	void *body_release_arg;
+
+	/*
+	 * Precompressed variant of the body, owned by whoever owns the
+	 * body.  If the client accepts it, it replaces the body.
+	 */
+	const char *gz_body;
+	size_t gz_len;
+	bool gzip;			/* serving gz_body */
+
+	/* validators for conditional requests */
+	bool etag_valid;
+	uint64_t etag;
+	uint64_t last_modified;		/* unix time, 0 if unknown */
+	uint64_t tmpl_modified;		/* newest template used */
+
+	/* page cache state (see pagecache.c) */
+	char *cache_key;
+	uint64_t cache_index_gen;
+	struct nvlist *deps;		/* files the output depends on */
+	bool uses_now;			/* the body contains {now} */
+	size_t *now_offs;		/* where {now} was left out */
+	size_t nnow;
 };
 
+extern void init_req_subsys(void);
 extern void req_init(struct req *req, struct scgi *scgi);
 extern void req_destroy(struct req *req);
 extern void req_output(struct req *req);
 extern void req_head(struct req *req, const char *name, const char *val);
+extern void req_add_dep(struct req *req, const char *path, uint64_t rev);
+extern void req_add_deps(struct req *req, struct nvlist *deps);
+extern void req_set_etag(struct req *req);
 extern int req_dispatch(struct req *req);
 
 extern int R404(struct req *req, char *tmpl);
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <jeffpc/atomic.h>
+#include <jeffpc/error.h>
+#include <jeffpc/thread.h>
+#include <jeffpc/time.h>
+
+#include "reqlog.h"
+#include "config.h"
+#include "utils.h"
+#include "debug.h"
+
+/*
+ * Asynchronous request logger
+ *
+ * Request processing threads push log entries (nvlists) onto a bounded
+ * lock-free ring.  A single writer thread drains the ring, packs the
+ * entries into CBOR, and appends them to a segment file under
+ * data/requests.  Since CBOR items are self-delimiting, a segment is just
+ * the packed entries back to back.  Once a segment grows past
+ * request-log-segment-size bytes, the writer starts a new one.
+ *
+ * If the ring is full, the entry is dropped (and counted) instead of
+ * making the request wait for the writer.
+ *
+ * The ring is the bounded MPMC queue by Dmitry Vyukov, simplified for a
+ * single consumer.  Each slot has a sequence number which tells the
+ * producers and the consumer whose turn it is to use the slot.
+ */
+
+#define REQLOG_BATCH		256	/* max entries per write */
+#define REQLOG_IDLE_USEC	100000	/* sleep when there is nothing to do */
+#define REQLOG_STDIO_BUFSIZE	(64 * 1024)
+
+struct reqlog_slot {
+	atomic64_t seq;
+	struct nvlist *entry;
+};
+
+static struct reqlog_slot *ring;
+static uint64_t ring_mask;
+static atomic64_t enqueue_pos;
+static uint64_t dequeue_pos;		/* writer thread only */
+static atomic64_t dropped;
+
+/* writer thread only */
+static FILE *segment;
+static uint64_t segment_size;
+
+bool reqlog_sampled(uint32_t id)
+{
+	if (!config.request_log_sample)
+		return false;
+
+	return (id % config.request_log_sample) == 0;
+}
+
+uint64_t reqlog_dropped(void)
+{
+	return atomic_read(&dropped);
+}
+
+/* consumes the passed in reference */
+void reqlog_submit(struct nvlist *entry)
+{
+	struct reqlog_slot *slot;
+	uint64_t pos;
+
+	if (!ring) {
+		nvl_putref(entry);
+		return;
+	}
+
+	pos = atomic_read(&enqueue_pos);
+
+	for (;;) {
+		int64_t diff;
+
+		slot = &ring[pos & ring_mask];
+
+		diff = (int64_t) atomic_read(&slot->seq) - (int64_t) pos;
+		if (!diff) {
+			uint64_t old;
+
+			/* the slot is free, try to claim it */
+			old = atomic_cas(&enqueue_pos, pos, pos + 1);
+			if (old == pos)
+				break;
+
+			pos = old;
+		} else if (diff < 0) {
+			/* the ring is full */
+			atomic_inc(&dropped);
+			nvl_putref(entry);
+			return;
+		} else {
+			/* someone else claimed the slot */
+			pos = atomic_read(&enqueue_pos);
+		}
+	}
+
+	slot->entry = entry;
+
+	atomic_set(&slot->seq, pos + 1);
+}
+
+static struct nvlist *reqlog_dequeue(void)
+{
+	struct reqlog_slot *slot;
+	struct nvlist *entry;
+
+	slot = &ring[dequeue_pos & ring_mask];
+
+	if (atomic_read(&slot->seq) != (dequeue_pos + 1))
+		return NULL; /* empty */
+
+	entry = slot->entry;
+
+	atomic_set(&slot->seq, dequeue_pos + ring_mask + 1);
+
+	dequeue_pos++;
+
+	return entry;
+}
+
+static int segment_open(void)
+{
+	char path[FILENAME_MAX];
+	uint64_t now;
+
+	now = gettime();
+
+	snprintf(path, sizeof(path), "%s/requests/%"PRIu64".%09"PRIu64"-%d.cbor",
+		 str_cstr(config.data_dir), now / 1000000000u,
+		 now % 1000000000u, (int) getpid());
+
+	segment = fopen(path, "a");
+	if (!segment)
+		return -errno;
+
+	setvbuf(segment, NULL, _IOFBF, REQLOG_STDIO_BUFSIZE);
+
+	segment_size = 0;
+
+	return 0;
+}
+
+static void segment_close(void)
+{
+	if (!segment)
+		return;
+
+	fclose(segment);
+	segment = NULL;
+}
+
+static void segment_append(struct nvlist *entry)
+{
+	struct buffer *buf;
+	size_t len;
+
+	if (segment && (segment_size >= config.request_log_segment_size))
+		segment_close();
+
+	if (!segment && segment_open()) {
+		DBG("Failed to open request log segment");
+		atomic_inc(&dropped);
+		return;
+	}
+
+	buf = nvl_pack(entry, VF_CBOR);
+	if (IS_ERR(buf)) {
+		atomic_inc(&dropped);
+		return;
+	}
+
+	len = buffer_size(buf);
+
+	if (fwrite(buffer_data(buf), 1, len, segment) != len) {
+		DBG("Failed to write request log entry");
+		atomic_inc(&dropped);
+		segment_close();
+	} else {
+		segment_size += len;
+	}
+
+	buffer_free(buf);
+}
+
+static void *reqlog_writer(void *arg)
+{
+	for (;;) {
+		struct nvlist *entry;
+		size_t n;
+
+		for (n = 0; n < REQLOG_BATCH; n++) {
+			entry = reqlog_dequeue();
+			if (!entry)
+				break;
+
+			segment_append(entry);
+
+			nvl_putref(entry);
+		}
+
+		/* the whole batch goes out in as few writes as possible */
+		if (segment)
+			fflush(segment);
+
+		if (!n)
+			usleep(REQLOG_IDLE_USEC);
+	}
+
+	return NULL;
+}
+
+void init_reqlog_subsys(void)
+{
+	pthread_t writer;
+	uint64_t size;
+	uint64_t i;
+	int ret;
+
+	if (!config.request_log_sample)
+		return; /* logging disabled */
+
+	/* round up to a power of two */
+	for (size = 1; size < config.request_log_queue_size; size <<= 1)
+		;
+
+	ring = calloc(size, sizeof(struct reqlog_slot));
+	ASSERT(ring);
+
+	ring_mask = size - 1;
+
+	for (i = 0; i < size; i++)
+		atomic_set(&ring[i].seq, i);
+
+	ret = xthr_create(&writer, reqlog_writer, NULL);
+	if (ret)
+		panic("failed to create request log writer thread: %s",
+		      xstrerror(ret));
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/mem.h>
+
+#include "rope.h"
+
+struct rope_ref {
+	struct rope_ref *next;
+	struct str *str;
+};
+
+void rope_init(struct rope *rope)
+{
+	arena_init(&rope->arena);
+	rope->refs = NULL;
+}
+
+void rope_destroy(struct rope *rope)
+{
+	struct rope_ref *ref;
+
+	for (ref = rope->refs; ref; ref = ref->next)
+		str_putref(ref->str);
+
+	arena_destroy(&rope->arena);
+	rope->refs = NULL;
+}
+
+struct rope_node *rope_mem(struct rope *rope, const char *ptr, size_t len)
+{
+	struct rope_node *node;
+
+	node = arena_alloc(&rope->arena, sizeof(struct rope_node));
+
+	node->left = NULL;
+	node->right = NULL;
+	node->ptr = ptr;
+	node->len = len;
+	node->depth = 1;
+
+	return node;
+}
+
+/* consumes the reference */
+struct rope_node *rope_str(struct rope *rope, struct str *str)
+{
+	struct rope_ref *ref;
+
+	if (!str)
+		return NULL;
+
+	ref = arena_alloc(&rope->arena, sizeof(struct rope_ref));
+	ref->str = str;
+	ref->next = rope->refs;
+	rope->refs = ref;
+
+	return rope_mem(rope, str_cstr(str), str_len(str));
+}
+
+static struct rope_node *__cat(struct rope *rope, struct rope_node *a,
+			       struct rope_node *b)
+{
+	struct rope_node *node;
+
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+
+	node = arena_alloc(&rope->arena, sizeof(struct rope_node));
+
+	node->left = a;
+	node->right = b;
+	node->ptr = NULL;
+	node->len = a->len + b->len;
+	node->depth = MAX(a->depth, b->depth) + 1;
+
+	return node;
+}
+
+/* NULL arguments are skipped */
+struct rope_node *rope_cat(struct rope *rope, int n, ...)
+{
+	struct rope_node *ret;
+	va_list ap;
+	int i;
+
+	ret = NULL;
+
+	va_start(ap, n);
+	for (i = 0; i < n; i++)
+		ret = __cat(rope, ret, va_arg(ap, struct rope_node *));
+	va_end(ap);
+
+	return ret;
+}
+
+/*
+ * Copy all the pieces into a single string.  Grammars tend to produce
+ * very lopsided trees, so walk it with an explicit stack instead of
+ * recursing.  The stack never holds more than depth entries.
+ */
+struct str *rope_flatten(struct rope_node *node)
+{
+	struct rope_node **stack;
+	size_t depth;
+	char *buf;
+	char *out;
+
+	if (!node)
+		return NULL;
+
+	buf = malloc(node->len + 1);
+	ASSERT(buf);
+
+	stack = mem_reallocarray(NULL, node->depth, sizeof(struct rope_node *));
+	ASSERT(stack);
+
+	out = buf;
+	depth = 0;
+	stack[depth++] = node;
+
+	while (depth) {
+		node = stack[--depth];
+
+		if (node->left) {
+			stack[depth++] = node->right;
+			stack[depth++] = node->left;
+			continue;
+		}
+
+		memcpy(out, node->ptr, node->len);
+		out += node->len;
+	}
+
+	*out = '\0';
+
+	free(stack);
+
+	return str_alloc(buf);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __ROPE_H
+#define __ROPE_H
+
+#include <string.h>
+
+#include <jeffpc/str.h>
+
+#include "arena.h"
+
+/*
+ * An immutable rope used to assemble output out of many small pieces.
+ *
+ * Concatenation just links nodes together, so wrapping some text in
+ * markup doesn't copy the text.  The bytes are copied exactly once, when
+ * the rope is flattened into a string.  Since nodes are never modified,
+ * a node may be used more than once (e.g., a link's URL doubling as its
+ * text).
+ *
+ * All nodes are allocated from the arena in struct rope and go away with
+ * it.  Leaves point at memory that must stay around until the rope is
+ * flattened - either static strings, the parser's input, or strings the
+ * rope holds a reference to.
+ */
+
+struct rope_ref;
+
+struct rope {
+	struct arena arena;
+	struct rope_ref *refs;		/* strings to release on destroy */
+};
+
+struct rope_node {
+	struct rope_node *left;		/* concatenation if non-NULL */
+	struct rope_node *right;
+	const char *ptr;		/* leaf data */
+	size_t len;			/* total length */
+	size_t depth;
+};
+
+extern void rope_init(struct rope *rope);
+extern void rope_destroy(struct rope *rope);
+extern struct rope_node *rope_mem(struct rope *rope, const char *ptr,
+				  size_t len);
+extern struct rope_node *rope_str(struct rope *rope, struct str *str);
+extern struct rope_node *rope_cat(struct rope *rope, int n, ...);
+extern struct str *rope_flatten(struct rope_node *node);
+
+/* @s must be a string literal or otherwise outlive the rope */
+static inline struct rope_node *rope_lit(struct rope *rope, const char *s)
+{
+	return rope_mem(rope, s, strlen(s));
+}
+
+#endif
@@ -26,6 +26,8 @@
 
 #include <jeffpc/error.h>
 #include <jeffpc/mem.h>
+#include <jeffpc/synch.h>
+#include <jeffpc/atomic.h>
 
 #include "req.h"
 #include "vars.h"
@@ -33,6 +35,22 @@
 #include "utils.h"
 #include "post.h"
 
+/*
+ * The tag cloud only changes when the index does, so instead of building
+ * it for every request we cache it as an array val along with the index
+ * generation it was built from.  Requests just get a reference to it.
+ *
+ * The lock only protects the two cached fields - it is never held while
+ * building.  When the index changes, the first request to notice builds
+ * and publishes the new cloud.  Any requests that show up in the meantime
+ * build a private copy instead of waiting for it.
+ */
+static struct rwlock tagcloud_lock;
+static LOCK_CLASS(tagcloud_lc);
+static struct val *tagcloud_cache;
+static uint64_t tagcloud_gen;
+static atomic_t tagcloud_building;
+
 struct tagcloud_state {
 	unsigned long ntags;
 	struct val **cloud;
@@ -100,15 +118,85 @@ err:
 	nvl_putref(tmp);
 }
 
-static void tagcloud(struct req *req)
+static struct val *__tagcloud_build(void)
 {
-	struct tagcloud_state state;
+	struct tagcloud_state state = {
+		.ntags = 0,
+		.cloud = NULL,
+	};
 
 	/* gather up tag info */
 	index_for_each_tag(__tagcloud_init, __tagcloud_step, &state);
 
+	return VAL_ALLOC_ARRAY(state.cloud, state.ntags);
+}
+
+static struct val *tagcloud_get(void)
+{
+	struct val *cloud;
+	struct val *old;
+	bool publish;
+	uint64_t gen;
+
+	/*
+	 * Grab the generation before walking the index - if it changes
+	 * while we are building the cloud, the next request will rebuild
+	 * it again.
+	 */
+	gen = index_get_generation();
+
+	RWLOCK(&tagcloud_lock, false);
+	if (tagcloud_cache && (tagcloud_gen == gen))
+		cloud = val_getref(tagcloud_cache);
+	else
+		cloud = NULL;
+	RWUNLOCK(&tagcloud_lock);
+
+	if (cloud)
+		return cloud;
+
+	publish = (atomic_cas(&tagcloud_building, 0, 1) == 0);
+
+	cloud = __tagcloud_build();
+	if (IS_ERR(cloud))
+		cloud = NULL;
+
+	if (!publish)
+		return cloud;
+
+	old = NULL;
+
+	if (cloud) {
+		RWLOCK(&tagcloud_lock, true);
+		old = tagcloud_cache;
+		tagcloud_cache = val_getref(cloud);
+		tagcloud_gen = gen;
+		RWUNLOCK(&tagcloud_lock);
+	}
+
+	atomic_set(&tagcloud_building, 0);
+
+	val_putref(old);
+
+	return cloud;
+}
+
+static void tagcloud(struct req *req)
+{
+	struct val *cloud;
+
+	cloud = tagcloud_get();
+
 	/* stash the info in request vars */
-	vars_set_array(&req->vars, "tagcloud", state.cloud, state.ntags);
+	if (cloud)
+		vars_set_val(&req->vars, "tagcloud", cloud);
+	else
+		vars_set_array(&req->vars, "tagcloud", NULL, 0);
+}
+
+void init_sidebar_subsys(void)
+{
+	RWINIT(&tagcloud_lock, &tagcloud_lc);
 }
 
 void sidebar(struct req *req)
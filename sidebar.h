@@ -23,6 +23,7 @@
 #ifndef __SIDEBAR_H
 #define __SIDEBAR_H
 
+extern void init_sidebar_subsys(void);
 extern void sidebar(struct req *req);
 
 #endif
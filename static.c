@@ -21,25 +21,128 @@
  */
 
 #include <jeffpc/error.h>
+#include <jeffpc/synch.h>
+#include <jeffpc/refcnt.h>
 
 #include "static.h"
+#include "config.h"
 #include "utils.h"
 
+/* static assets are revalidated on every hit, so let clients cache briefly */
+#define STATIC_CACHE_CONTROL	"public, max-age=3600"
+
 struct uri_info {
 	const char *uri;
 	const char *content_type;	/* required for URI_STATIC */
 	enum uri_type type;
+	bool compress;			/* keep a gzip'd variant */
 };
 
 static const struct uri_info safe_uris[] = {
-	{ "/",			NULL,		URI_DYNAMIC, },
-	{ "/bug.png",		"image/png",	URI_STATIC,  },
-	{ "/favicon.ico",	"image/png",	URI_STATIC,  },
-	{ "/style.css",		"text/css",	URI_STATIC,  },
-	{ "/wiki.png",		"image/png",	URI_STATIC,  },
-	{ NULL,			NULL,		URI_BAD,     },
+	{ "/",			NULL,		URI_DYNAMIC, false, },
+	{ "/bug.png",		"image/png",	URI_STATIC,  false, },
+	{ "/favicon.ico",	"image/png",	URI_STATIC,  false, },
+	{ "/style.css",		"text/css",	URI_STATIC,  true,  },
+	{ "/wiki.png",		"image/png",	URI_STATIC,  false, },
+	{ NULL,			NULL,		URI_BAD,     false, },
+};
+
+/*
+ * Cached static files
+ *
+ * Each URI in safe_uris has (at most) one cache entry holding a reference
+ * to the file contents.  Responses borrow the contents directly from the
+ * entry - the request holds a reference on the entry until it is done
+ * with the body.
+ */
+struct static_entry {
+	refcnt_t refcnt;
+
+	struct str *data;
+	uint64_t rev;
+	uint64_t etag;
+
+	char *gz_body;			/* NULL if not worth compressing */
+	size_t gz_len;
 };
 
+static void static_entry_free(struct static_entry *entry);
+
+REFCNT_INLINE_FXNS(struct static_entry, static_entry, refcnt,
+		   static_entry_free, NULL)
+
+static struct static_entry *static_cache[ARRAY_LEN(safe_uris)];
+static struct lock static_cache_lock;
+static LOCK_CLASS(static_cache_lc);
+
+void init_static_subsys(void)
+{
+	MXINIT(&static_cache_lock, &static_cache_lc);
+}
+
+static void static_entry_free(struct static_entry *entry)
+{
+	str_putref(entry->data);
+	free(entry->gz_body);
+	free(entry);
+}
+
+static void release_body(void *arg)
+{
+	static_entry_putref(arg);
+}
+
+static struct static_entry *static_cache_get(const struct uri_info *info,
+					     const char *path)
+{
+	const size_t idx = info - safe_uris;
+	struct static_entry *entry;
+	struct str *data;
+	uint64_t rev;
+
+	MXLOCK(&static_cache_lock);
+	entry = static_cache[idx];
+	if (entry && !file_cache_has_newer(path, entry->rev)) {
+		entry = static_entry_getref(entry);
+		MXUNLOCK(&static_cache_lock);
+		return entry;
+	}
+	MXUNLOCK(&static_cache_lock);
+
+	/* not cached or stale - (re)load it outside of the lock */
+	data = file_cache_get(path, &rev);
+	if (IS_ERR(data))
+		return NULL;
+
+	entry = malloc(sizeof(struct static_entry));
+	if (!entry) {
+		str_putref(data);
+		return NULL;
+	}
+
+	refcnt_init(&entry->refcnt, 1);
+	entry->data = data;
+	entry->rev = rev;
+	entry->gz_body = NULL;
+
+	if (info->compress)
+		entry->gz_body = gzip_buf(str_cstr(data), str_len(data),
+					  &entry->gz_len);
+
+	/* hash the contents once per revision */
+	entry->etag = fnv1a_hash(str_cstr(data), str_len(data));
+
+	MXLOCK(&static_cache_lock);
+	if (!static_cache[idx] || (static_cache[idx]->rev < rev)) {
+		if (static_cache[idx])
+			static_entry_putref(static_cache[idx]);
+		static_cache[idx] = static_entry_getref(entry);
+	}
+	MXUNLOCK(&static_cache_lock);
+
+	return entry;
+}
+
 static const struct uri_info *get_uri_info(const char *path)
 {
 	int i;
@@ -73,6 +176,7 @@ int blahg_static(struct req *req)
 {
 	char path[FILENAME_MAX];
 	const struct uri_info *info;
+	struct static_entry *entry;
 	struct str *uri_str;
 	const char *uri;
 
@@ -95,13 +199,22 @@ int blahg_static(struct req *req)
 	 * We assume that the URI is relative to the web dir.  Since we
 	 * have a whitelist of allowed URIs, whe should be safe here.
 	 */
-	req->scgi->response.body = read_file_len(path,
-						 &req->scgi->response.bodylen);
-
-	if (IS_ERR(req->scgi->response.body))
+	entry = static_cache_get(info, path);
+	if (!entry)
 		return R404(req, NULL);
 
+	/* borrow the contents from the cache entry */
+	req->scgi->response.body = (char *) str_cstr(entry->data);
+	req->scgi->response.bodylen = str_len(entry->data);
+	req->body_release = release_body;
+	req->body_release_arg = entry;
+	req->gz_body = entry->gz_body;
+	req->gz_len = entry->gz_len;
+	req->etag = entry->etag;
+	req->etag_valid = true;
+
 	req_head(req, "Content-Type", info->content_type);
+	req_head(req, "Cache-Control", STATIC_CACHE_CONTROL);
 
 	return 0;
 }
@@ -33,6 +33,7 @@ enum uri_type {
 	URI_BAD,
 };
 
+extern void init_static_subsys(void);
 extern enum uri_type get_uri_type(struct str *path);
 extern int blahg_static(struct req *req);
 
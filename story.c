@@ -97,7 +97,7 @@ int blahg_story(struct req *req)
 	if (__load_post(req, postid, is_preview(req)))
 		return R404(req, NULL);
 
-	req->scgi->response.body = render_page(req, "{storyview}");
+	render_page(req, "{storyview}");
 
 	return 0;
 }
@@ -89,7 +89,7 @@ int blahg_tag(struct req *req, int page)
 
 	str_putref(tag);
 
-	req->scgi->response.body = render_page(req, "{tagindex}");
+	render_page(req, "{tagindex}");
 
 	return 0;
 }
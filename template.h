@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2013-2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __TEMPLATE_H
+#define __TEMPLATE_H
+
+#include <jeffpc/refcnt.h>
+#include <jeffpc/list.h>
+
+#include "pipeline.h"
+
+/*
+ * A compiled template.
+ *
+ * The template grammar (template.y) turns the template source into a tree
+ * of instructions.  Conditionals (ifgt, iflt, ifeq, ifset) own two blocks
+ * of instructions - one executed when the condition holds, the other
+ * executed when it does not.  An else() merely switches which of the two
+ * blocks the following instructions get appended to.
+ */
+
+enum tmpl_insn_type {
+	TI_TEXT,	/* literal run of characters */
+	TI_VAR,		/* {var} - variable or nested template */
+	TI_PIPELINE,	/* {var|stage|...} */
+	TI_FOREACH,	/* {var%tmpl} */
+	TI_COND,	/* {ifxx(arg1,arg2)}...{else()}...{endif()} */
+};
+
+enum tmpl_cond {
+	TC_GT,
+	TC_LT,
+	TC_EQ,
+	TC_SET,
+};
+
+#define TMPL_BRANCH_TRUE	0
+#define TMPL_BRANCH_FALSE	1
+
+/* a condition argument - either an integer literal or a variable */
+struct tmpl_arg {
+	char *str;
+	bool literal;
+	uint64_t value;		/* literal */
+	unsigned int sym;	/* variable */
+};
+
+struct tmpl_insn {
+	struct list_node node;
+
+	enum tmpl_insn_type type;
+
+	/* TI_TEXT */
+	char *text;
+	size_t len;
+	size_t alloc;
+
+	/* TI_VAR, TI_PIPELINE, TI_FOREACH */
+	char *var;
+	unsigned int sym;	/* interned var */
+	struct pipeline *pipeline;
+	char *tmpl;
+
+	/* TI_COND */
+	enum tmpl_cond cond;
+	struct tmpl_arg arg[2];
+	struct list branch[2];
+};
+
+struct tmpl {
+	refcnt_t refcnt;
+
+	struct list insns;
+};
+
+extern struct tmpl *tmpl_compile(const char *str, size_t len);
+extern void tmpl_destroy(struct tmpl *tmpl);
+extern void tmpl_init_block(struct list *block);
+
+REFCNT_INLINE_FXNS(struct tmpl, tmpl, refcnt, tmpl_destroy, NULL)
+
+#endif
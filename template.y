@@ -34,9 +34,9 @@
 #include <jeffpc/val.h>
 
 #include "config.h"
-#include "vars.h"
-#include "render.h"
 #include "pipeline.h"
+#include "template.h"
+#include "vars.h"
 #include "utils.h"
 #include "debug.h"
 
@@ -51,285 +51,127 @@ void yyerror(void *scan, char *e)
 	DBG("Error: %s", e);
 }
 
-static char *tostr(char c)
+static struct tmpl_insn *insn_alloc(struct parser_output *data,
+				    enum tmpl_insn_type type)
 {
-	char *ret;
+	struct tmpl_insn *insn;
 
-	ret = malloc(2);
-	ASSERT(ret);
+	insn = malloc(sizeof(struct tmpl_insn));
+	ASSERT(insn);
 
-	ret[0] = c;
-	ret[1] = '\0';
+	memset(insn, 0, sizeof(struct tmpl_insn));
 
-	return ret;
-}
+	insn->type = type;
 
-static char *condconcat(struct parser_output *data, char *a, char *b)
-{
-	if (!cond_value(data)) {
-		free(b);
-		return a;
+	if (type == TI_COND) {
+		tmpl_init_block(&insn->branch[TMPL_BRANCH_TRUE]);
+		tmpl_init_block(&insn->branch[TMPL_BRANCH_FALSE]);
 	}
 
-	return concat(a, b);
-}
-
-static char *__foreach(struct req *req, const struct nvpair *var, char *tmpl)
-{
-	struct val **items;
-	size_t nitems;
-	size_t i;
-	char *out;
-	int ret;
-
-	out = NULL;
-
-	ret = nvpair_value_array(var, &items, &nitems);
-	ASSERT0(ret);
-
-	for (i = 0; i < nitems; i++) {
-		vars_scope_push(&req->vars);
-
-		switch (items[i]->type) {
-			case VT_NVL:
-				vars_merge(&req->vars,
-					   val_cast_to_nvl(items[i]));
-				break;
-			case VT_STR:
-				vars_set_str(&req->vars, nvpair_name(var),
-					     val_getref_str(items[i]));
-				break;
-			default:
-				//vars_dump(&req->vars);
-				panic("%s called with '%s' which has type %d",
-				      __func__, nvpair_name(var),
-				      nvpair_type(var));
-		}
-
-		out = concat(out, render_template(req, tmpl));
-
-		vars_scope_pop(&req->vars);
-	}
+	list_insert_tail(cond_block(data), insn);
 
-	return out;
+	return insn;
 }
 
-static char *foreach(struct parser_output *data, struct req *req, char *varname,
-                     char *tmpl)
+/* append literal text, extending the previous text run if possible */
+static void text(struct parser_output *data, const char *str, size_t len)
 {
-	const struct nvpair *var;
+	struct tmpl_insn *insn;
 
-	if (!cond_value(data))
-		return xstrdup("");
+	insn = list_tail(cond_block(data));
+	if (!insn || (insn->type != TI_TEXT))
+		insn = insn_alloc(data, TI_TEXT);
 
-	var = vars_lookup(&req->vars, varname);
-	if (!var)
-		return xstrdup("");
-
-	return __foreach(req, var, tmpl);
-}
-
-static char *print_val(struct val *val)
-{
-	char buf[32];
-	const char *tmp;
-
-	tmp = NULL;
-
-	switch (val->type) {
-		case VT_STR:
-			tmp = str_cstr(val_cast_to_str(val));
-			break;
-		case VT_INT:
-			snprintf(buf, sizeof(buf), "%"PRIu64, val->i);
-			tmp = buf;
-			break;
-		case VT_BLOB:
-		case VT_NULL:
-		case VT_SYM:
-		case VT_CONS:
-		case VT_BOOL:
-		case VT_CHAR:
-		case VT_ARRAY:
-		case VT_NVL:
-			panic("%s called with value of type %d", __func__,
-			      val->type);
+	if ((insn->len + len + 1) > insn->alloc) {
+		insn->alloc = MAX(insn->alloc * 2, insn->len + len + 1);
+		insn->text = realloc(insn->text, insn->alloc);
+		ASSERT(insn->text);
 	}
 
-	return xstrdup(tmp);
+	memcpy(insn->text + insn->len, str, len);
+	insn->len += len;
+	insn->text[insn->len] = '\0';
 }
 
-static char *print_var(const struct nvpair *var)
+static void foreach(struct parser_output *data, char *varname, char *tmpl)
 {
-	struct str *str;
-	char buf[32];
-	char *ret;
-
-	switch (nvpair_type(var)) {
-		case VT_STR:
-			str = nvpair_value_str(var);
-			ret = xstrdup(str_cstr(str));
-			str_putref(str);
-			break;
-		case VT_INT:
-			snprintf(buf, sizeof(buf), "%"PRIu64, pair2int(var));
-			ret = xstrdup(buf);
-			break;
-		default:
-			panic("%s called with '%s' which has type %d", __func__,
-			      nvpair_name(var), nvpair_type(var));
-			break;
-	}
+	struct tmpl_insn *insn;
 
-	return ret;
+	insn = insn_alloc(data, TI_FOREACH);
+	insn->var = varname;
+	insn->sym = vars_intern(varname);
+	insn->tmpl = tmpl;
 }
 
-static char *pipeline(struct parser_output *data, struct req *req,
-		      char *varname, struct pipeline *line)
+static void pipeline(struct parser_output *data, char *varname,
+		     struct pipeline *line)
 {
-	const struct nvpair *var;
-	struct pipestage *cur;
-	struct val *val;
-	char *out;
-
-	if (!cond_value(data)) {
-		pipeline_destroy(line);
-		return xstrdup("");
-	}
-
-	var = vars_lookup(&req->vars, varname);
-	if (!var) {
-		pipeline_destroy(line);
-		return xstrdup("");
-	}
-
-	switch (nvpair_type(var)) {
-		case VT_STR:
-			val = str_cast_to_val(nvpair_value_str(var));
-			break;
-		case VT_INT:
-			val = VAL_ALLOC_INT(pair2int(var));
-			break;
-		default:
-			vars_dump(&req->vars);
-			panic("%s called with '%s' which has type %d", __func__,
-			      varname, nvpair_type(var));
-			break;
-	}
-
-	list_for_each(cur, &line->pipe)
-		val = cur->stage->f(val);
+	struct tmpl_insn *insn;
 
-	pipeline_destroy(line);
-
-	out = print_val(val);
-
-	val_putref(val);
-
-	return out;
+	insn = insn_alloc(data, TI_PIPELINE);
+	insn->var = varname;
+	insn->sym = vars_intern(varname);
+	insn->pipeline = line;
 }
 
-static char *variable(struct parser_output *data, struct req *req, char *name)
+static void variable(struct parser_output *data, char *name)
 {
-	const struct nvpair *var;
-
-	if (!cond_value(data))
-		return xstrdup("");
-
-	var = vars_lookup(&req->vars, name);
+	struct tmpl_insn *insn;
 
-	if (!var)
-		return render_template(req, name);
-	else
-		return print_var(var);
+	insn = insn_alloc(data, TI_VAR);
+	insn->var = name;
+	insn->sym = vars_intern(name);
 }
 
-enum if_fxns {
-	IFFXN_GT,
-	IFFXN_LT,
-	IFFXN_EQ,
-};
-
-static uint64_t __function_get_arg(struct req *req, const char *arg)
+static void __arg(struct tmpl_arg *arg, char *str)
 {
-	const struct nvpair *var;
-	uint64_t val;
-
-	if (!str2u64(arg, &val))
-		return val;
-
-	var = vars_lookup(&req->vars, arg);
-	if (!var)
-		return 0;
-
-	switch (nvpair_type(var)) {
-		case VT_INT:
-			return pair2int(var);
-		default:
-			panic("unexpected nvpair type: %d",
-			      nvpair_type(var));
-	}
-}
+	arg->str = str;
 
-static char *__function(struct parser_output *data, struct req *req,
-			enum if_fxns fxn, const char *sa1,
-			const char *sa2)
-{
-	uint64_t ia1, ia2;		/* int value of saX */
-	bool result = true;
-
-	ia1 = __function_get_arg(req, sa1);
-	ia2 = __function_get_arg(req, sa2);
-
-	switch (fxn) {
-		case IFFXN_GT:
-			result = ia1 > ia2;
-			break;
-		case IFFXN_LT:
-			result = ia1 < ia2;
-			break;
-		case IFFXN_EQ:
-			result = ia1 == ia2;
-			break;
-	}
-
-	cond_if(data, result);
+	if (!str)
+		return;
 
-	return xstrdup(NULL);
+	arg->literal = !str2u64(str, &arg->value);
+	arg->sym = arg->literal ? VARS_NO_SYM : vars_intern(str);
 }
 
-static char *__function_ifset(struct parser_output *data, struct req *req,
-			      const char *arg)
+static void __function(struct parser_output *data, enum tmpl_cond cond,
+		       char *sa1, char *sa2)
 {
-	const struct nvpair *var;
-
-	var = vars_lookup(&req->vars, arg);
+	struct tmpl_insn *insn;
 
-	cond_if(data, var != NULL);
+	insn = insn_alloc(data, TI_COND);
+	insn->cond = cond;
+	__arg(&insn->arg[0], sa1);
+	__arg(&insn->arg[1], sa2);
 
-	return xstrdup(NULL);
+	cond_if(data, insn);
 }
 
-static char *function(struct parser_output *data, struct req *req,
-                      const char *fxn, const char *sa1, const char *sa2)
+static void function(struct parser_output *data, char *fxn, char *sa1,
+		     char *sa2)
 {
 	if (!strcmp(fxn, "ifgt")) {
-		return __function(data, req, IFFXN_GT, sa1, sa2);
+		__function(data, TC_GT, sa1, sa2);
 	} else if (!strcmp(fxn, "iflt")) {
-		return __function(data, req, IFFXN_LT, sa1, sa2);
+		__function(data, TC_LT, sa1, sa2);
 	} else if (!strcmp(fxn, "ifeq")) {
-		return __function(data, req, IFFXN_EQ, sa1, sa2);
+		__function(data, TC_EQ, sa1, sa2);
 	} else if (!strcmp(fxn, "ifset")) {
-		return __function_ifset(data, req, sa1);
+		__function(data, TC_SET, sa1, NULL);
+		free(sa2);
 	} else if (!strcmp(fxn, "endif")) {
 		cond_endif(data);
+		free(sa1);
+		free(sa2);
 	} else if (!strcmp(fxn, "else")) {
 		cond_else(data);
+		free(sa1);
+		free(sa2);
 	} else {
 		panic("unknown template function '%s'", fxn);
 	}
 
-	return xstrdup(NULL);
+	free(fxn);
 }
 %}
 
@@ -343,54 +185,31 @@ static char *function(struct parser_output *data, struct req *req,
 %token <ptr> WORD
 %token <c> CHAR
 
-%type <ptr> words cmd
 %type <pipeline> pipeline
 %type <pipestage> pipe
 
 %%
 
-page : words					{ data->output = $1; }
+page : words
      ;
 
-words : words CHAR				{ $$ = condconcat(data, $1, tostr($2)); }
-      | words WORD				{ $$ = condconcat(data, $1, $2); }
-      | words '|'				{ $$ = condconcat(data, $1, xstrdup("|")); }
-      | words '%'				{ $$ = condconcat(data, $1, xstrdup("%")); }
-      | words '('				{ $$ = condconcat(data, $1, xstrdup("(")); }
-      | words ')'				{ $$ = condconcat(data, $1, xstrdup(")")); }
-      | words ','				{ $$ = condconcat(data, $1, xstrdup(",")); }
-      | words cmd				{ $$ = concat($1, $2); }
-      |						{ $$ = xstrdup(""); }
+words : words CHAR				{ text(data, &$2, 1); }
+      | words WORD				{ text(data, $2, strlen($2)); free($2); }
+      | words '|'				{ text(data, "|", 1); }
+      | words '%'				{ text(data, "%", 1); }
+      | words '('				{ text(data, "(", 1); }
+      | words ')'				{ text(data, ")", 1); }
+      | words ','				{ text(data, ",", 1); }
+      | words cmd
+      |
       ;
 
-cmd : '{' WORD pipeline '}'		{
-						$$ = pipeline(data, data->req, $2, $3);
-						free($2);
-					}
-    | '{' WORD '%' WORD '}'		{
-						$$ = foreach(data, data->req, $2, $4);
-						free($2);
-						free($4);
-					}
-    | '{' WORD '(' WORD ',' WORD ')' '}'{
-						$$ = function(data, data->req, $2, $4, $6);
-						free($2);
-						free($4);
-						free($6);
-					}
-    | '{' WORD '(' WORD ')' '}'		{
-						$$ = function(data, data->req, $2, $4, NULL);
-						free($2);
-						free($4);
-					}
-    | '{' WORD '(' ')' '}'		{
-						$$ = function(data, data->req, $2, NULL, NULL);
-						free($2);
-					}
-    | '{' WORD '}'			{
-						$$ = variable(data, data->req, $2);
-						free($2);
-					}
+cmd : '{' WORD pipeline '}'		{ pipeline(data, $2, $3); }
+    | '{' WORD '%' WORD '}'		{ foreach(data, $2, $4); }
+    | '{' WORD '(' WORD ',' WORD ')' '}'{ function(data, $2, $4, $6); }
+    | '{' WORD '(' WORD ')' '}'		{ function(data, $2, $4, NULL); }
+    | '{' WORD '(' ')' '}'		{ function(data, $2, NULL, NULL); }
+    | '{' WORD '}'			{ variable(data, $2); }
     ;
 
 pipeline : pipeline pipe		{
@@ -21,82 +21,171 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 
 #include <jeffpc/jeffpc.h>
 #include <jeffpc/error.h>
 #include <jeffpc/val.h>
+#include <jeffpc/time.h>
 #include <jeffpc/file-cache.h>
 
 #include "parse.h"
+#include "config.h"
 #include "utils.h"
 
+static int parse(struct parser_output *x, struct post *post, char *ibuf,
+		 size_t len)
+{
+	int ret;
+
+	x->req            = NULL;
+	x->post           = post;
+	x->input          = ibuf;
+	x->len            = len;
+	x->pos            = 0;
+	x->tokpos         = 0;
+	x->lineno         = 0;
+	x->table_nesting  = 0;
+	x->texttt_nesting = 0;
+	x->sc_title       = NULL;
+	x->sc_pub         = NULL;
+	x->sc_tags        = NULL;
+	x->sc_cats        = NULL;
+	x->sc_twitter_img = NULL;
+
+	rope_init(&x->rope);
+	fmt3_lex_init(&x->scanner);
+	fmt3_set_extra(x, x->scanner);
+
+	ret = fmt3_parse(x);
+
+	fmt3_lex_destroy(x->scanner);
+	rope_destroy(&x->rope);
+
+	return ret;
+}
+
+static void free_output(struct parser_output *x)
+{
+	str_putref(x->stroutput);
+	str_putref(x->sc_title);
+	str_putref(x->sc_pub);
+	val_putref(x->sc_tags);
+	val_putref(x->sc_cats);
+	str_putref(x->sc_twitter_img);
+}
+
+static void print_str(const char *name, struct str *str)
+{
+	printf("%s:\n", name);
+	if (str)
+		printf(">>>%s<<<\n", str_cstr(str));
+}
+
+static void print_list(const char *name, struct val *list)
+{
+	struct val *item;
+	struct val *tmp;
+
+	printf("%s:\n", name);
+	sexpr_for_each_noref(item, tmp, list)
+		printf(">>>%s<<<\n", str_cstr(val_cast_to_str(item)));
+}
+
 static int onefile(struct post *post, char *ibuf, size_t len)
 {
 	struct parser_output x;
 	int ret;
 
-	x.req            = NULL;
-	x.post           = post;
-	x.input          = ibuf;
-	x.len            = len;
-	x.pos            = 0;
-	x.lineno         = 0;
-	x.table_nesting  = 0;
-	x.texttt_nesting = 0;
-	x.sc_title       = NULL;
-	x.sc_pub         = NULL;
-	x.sc_tags        = NULL;
-	x.sc_cats        = NULL;
-	x.sc_twitter_img = NULL;
-
-	fmt3_lex_init(&x.scanner);
-	fmt3_set_extra(&x, x.scanner);
-
-	ret = fmt3_parse(&x);
+	ret = parse(&x, post, ibuf, len);
 	if (!ret) {
-		printf("output:\n>>>%s<<<\n", str_cstr(x.stroutput));
-		printf("sc_title:\n>>>%s<<<\n", str_cstr(x.sc_title));
-		printf("sc_pub:\n>>>%s<<<\n", str_cstr(x.sc_pub));
-		printf("sc_tags:\n");
-		sexpr_dump_file(stdout, x.sc_tags, false);
-		printf("\nsc_cats:\n");
-		sexpr_dump_file(stdout, x.sc_cats, false);
-		printf("\nsc_twitter_img:\n>>>%s<<<\n",
-		       str_cstr(x.sc_twitter_img));
-		str_putref(x.stroutput);
-		str_putref(x.sc_title);
-		str_putref(x.sc_pub);
-		val_putref(x.sc_tags);
-		val_putref(x.sc_cats);
-		str_putref(x.sc_twitter_img);
+		print_str("output", x.stroutput);
+		print_str("sc_title", x.sc_title);
+		print_str("sc_pub", x.sc_pub);
+		print_list("sc_tags", x.sc_tags);
+		print_list("sc_cats", x.sc_cats);
+		print_str("sc_twitter_img", x.sc_twitter_img);
+		free_output(&x);
 	} else {
 		fprintf(stderr, "failed to parse\n");
 	}
 
-	fmt3_lex_destroy(x.scanner);
-
 	return ret;
 }
 
+/*
+ * Throughput mode: parse each file @iters times without printing anything
+ * and report how fast the parser chewed through the input.
+ */
+static int throughput(struct post *post, char *ibuf, size_t len,
+		      const char *fname, unsigned long iters)
+{
+	struct parser_output x;
+	uint64_t start, delta;
+	unsigned long i;
+
+	start = gettime();
+
+	for (i = 0; i < iters; i++) {
+		if (parse(&x, post, ibuf, len)) {
+			fprintf(stderr, "failed to parse\n");
+			return 1;
+		}
+
+		free_output(&x);
+	}
+
+	delta = gettime() - start;
+
+	printf("%-40s %8zu bytes %10.3f us/parse %8.2f MB/s\n", fname, len,
+	       (double) delta / iters / 1000.0,
+	       ((double) len * iters / 1048576.0) /
+	       ((double) delta / 1000000000.0));
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
+	unsigned long iters;
 	struct post post;
 	char *in;
 	int i;
 	int result;
 
 	result = 0;
+	iters = 0;
 
 	ASSERT0(putenv("UMEM_DEBUG=default,verbose"));
 
 	ASSERT0(file_cache_init());
 
-	for (i = 1; i < argc; i++) {
+	/* fixed values, so that the output can be compared across builds */
+	memset(&post, 0, sizeof(post));
+	config.base_url = STATIC_STR("http://blahg.example.com");
+	config.bug_base_url = STATIC_STR("http://bugs.example.com");
+	config.wiki_base_url = STATIC_STR("http://wiki.example.com/wiki");
+	config.photo_base_url = STATIC_STR("http://photos.example.com");
+
+	i = 1;
+
+	if ((argc > 2) && !strcmp(argv[1], "-t")) {
+		iters = strtoul(argv[2], NULL, 10);
+		ASSERT3U(iters, >, 0);
+		i = 3;
+	}
+
+	for (; i < argc; i++) {
 		in = read_file(argv[i]);
 		ASSERT(!IS_ERR(in));
 
-		if (onefile(&post, in, strlen(in)))
+		if (iters) {
+			if (throughput(&post, in, strlen(in), argv[i], iters))
+				result = 1;
+		} else if (onefile(&post, in, strlen(in))) {
 			result = 1;
+		}
 
 		free(in);
 	}
@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Randomized test for the rank tree.
+ *
+ * It applies a long random sequence of inserts, removes, and counted
+ * flips to a tree and mirrors them in a plain array.  After every
+ * operation, the tree's shape is checked, and every so often its
+ * contents, counted ranks, and pages are compared against a linear scan
+ * of the array.  Periodically, the tree is thrown away and rebuilt with
+ * rank_build() from the array, and the test carries on with the rebuilt
+ * tree.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <jeffpc/jeffpc.h>
+#include <jeffpc/error.h>
+
+#include "ranktree.h"
+
+#define NKEYS		2000
+#define NOPS		200000
+#define CHECK_EVERY	997	/* full comparison every this many ops */
+#define REBUILD_EVERY	20011	/* rebuild every this many ops */
+#define PAGE_SIZE	7
+
+struct item {
+	struct rank_node node;
+	unsigned int key;
+	bool present;		/* in the tree */
+	bool counted;
+};
+
+static struct item items[NKEYS];
+static uint64_t rng_state;
+
+/* xorshift64 - reproducible on every platform for a given seed */
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+
+	return rng_state;
+}
+
+static int item_cmp(const void *va, const void *vb)
+{
+	const struct item *a = va;
+	const struct item *b = vb;
+
+	if (a->key < b->key)
+		return -1;
+	if (a->key > b->key)
+		return 1;
+	return 0;
+}
+
+static bool item_counted(void *item)
+{
+	return ((struct item *) item)->counted;
+}
+
+/* check the AVL invariants and the counts; returns the subtree height */
+static int check_node(struct rank_node *node, struct rank_node *parent,
+		      size_t *nodes)
+{
+	struct item *item;
+	size_t count;
+	int lh, rh;
+
+	if (!node)
+		return 0;
+
+	VERIFY3P(node->parent, ==, parent);
+
+	lh = check_node(node->left, node, nodes);
+	rh = check_node(node->right, node, nodes);
+
+	VERIFY3S(abs(lh - rh), <=, 1);
+	VERIFY3S(node->height, ==, 1 + MAX(lh, rh));
+
+	item = (struct item *) ((char *) node - offsetof(struct item, node));
+	VERIFY(item->present);
+	VERIFY3U(node->counted, ==, item->counted);
+
+	count = node->counted;
+	if (node->left)
+		count += node->left->count;
+	if (node->right)
+		count += node->right->count;
+	VERIFY3U(node->count, ==, count);
+
+	(*nodes)++;
+
+	return node->height;
+}
+
+static void check_shape(struct rank_tree *tree)
+{
+	size_t nodes = 0;
+
+	check_node(tree->root, NULL, &nodes);
+
+	VERIFY3U(nodes, ==, rank_numnodes(tree));
+}
+
+/* compare everything the tree answers against a scan of the array */
+static void check_contents(struct rank_tree *tree)
+{
+	struct item *counted[NKEYS];
+	size_t ncounted;
+	size_t npresent;
+	struct item *cur;
+	size_t i;
+
+	npresent = 0;
+	ncounted = 0;
+
+	/* walk order */
+	cur = rank_first(tree);
+	for (i = 0; i < NKEYS; i++) {
+		if (!items[i].present) {
+			VERIFY3P(rank_find(tree, &items[i]), ==, NULL);
+			continue;
+		}
+
+		VERIFY3P(cur, ==, &items[i]);
+		VERIFY3P(rank_find(tree, &items[i]), ==, &items[i]);
+
+		if (items[i].counted)
+			counted[ncounted++] = &items[i];
+
+		npresent++;
+		cur = rank_next(tree, cur);
+	}
+
+	VERIFY3P(cur, ==, NULL);
+	VERIFY3U(rank_numnodes(tree), ==, npresent);
+	VERIFY3U(rank_numcounted(tree), ==, ncounted);
+
+	/* counted ranks */
+	for (i = 0; i < ncounted; i++)
+		VERIFY3P(rank_nth_last(tree, i), ==,
+			 counted[ncounted - 1 - i]);
+	VERIFY3P(rank_nth_last(tree, ncounted), ==, NULL);
+
+	/* pages, newest first, the way the post index hands them out */
+	for (i = 0; i < ncounted; i += PAGE_SIZE) {
+		size_t got;
+
+		cur = rank_nth_last(tree, i);
+
+		for (got = 0; cur && (got < PAGE_SIZE);
+		     cur = rank_prev(tree, cur)) {
+			if (!cur->counted)
+				continue;
+
+			VERIFY3P(cur, ==, counted[ncounted - 1 - i - got]);
+			got++;
+		}
+
+		VERIFY3U(got, ==, MIN(PAGE_SIZE, ncounted - i));
+	}
+}
+
+static void rebuild(struct rank_tree *tree)
+{
+	struct rank_cookie cookie;
+	void *sorted[NKEYS];
+	size_t n;
+	size_t i;
+
+	memset(&cookie, 0, sizeof(cookie));
+	while (rank_destroy_nodes(tree, &cookie))
+		;
+	rank_destroy(tree);
+
+	n = 0;
+	for (i = 0; i < NKEYS; i++)
+		if (items[i].present)
+			sorted[n++] = &items[i];
+
+	rank_create(tree, item_cmp, sizeof(struct item),
+		    offsetof(struct item, node));
+	rank_build(tree, sorted, n, item_counted);
+}
+
+static void one_op(struct rank_tree *tree)
+{
+	struct item *item = &items[rng() % NKEYS];
+
+	if (!item->present) {
+		item->counted = rng() & 1;
+		item->present = true;
+
+		VERIFY3P(rank_insert(tree, item, item->counted), ==, NULL);
+	} else if (rng() & 1) {
+		item->present = false;
+
+		rank_remove(tree, item);
+	} else {
+		item->counted = !item->counted;
+
+		rank_set_counted(tree, item, item->counted);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct rank_tree tree;
+	uint64_t seed;
+	size_t i;
+
+	seed = (argc > 1) ? strtoull(argv[1], NULL, 0) : 0x1985;
+	rng_state = seed ? seed : 1;
+
+	printf("seed: %#"PRIx64"\n", seed);
+
+	for (i = 0; i < NKEYS; i++)
+		items[i].key = i;
+
+	rank_create(&tree, item_cmp, sizeof(struct item),
+		    offsetof(struct item, node));
+
+	for (i = 1; i <= NOPS; i++) {
+		one_op(&tree);
+		check_shape(&tree);
+
+		if (!(i % CHECK_EVERY))
+			check_contents(&tree);
+
+		if (!(i % REBUILD_EVERY)) {
+			rebuild(&tree);
+			check_shape(&tree);
+			check_contents(&tree);
+		}
+	}
+
+	check_contents(&tree);
+
+	printf("ok\n");
+
+	return 0;
+}
@@ -27,6 +27,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <zlib.h>
 
 #include "utils.h"
 
@@ -153,3 +154,73 @@ time_t parse_time_cstr(const char *str)
 
 	return mktime(&tm);
 }
+
+/*
+ * Compress @in with gzip.  Returns a malloc'd buffer, or NULL if the
+ * input is too small to bother with or the output would not be smaller
+ * than the input.
+ */
+char *gzip_buf(const char *in, size_t inlen, size_t *outlen)
+{
+	z_stream zs;
+	size_t alloc;
+	char *out;
+	int ret;
+
+	if (inlen < GZIP_MIN_LEN)
+		return NULL;
+
+	memset(&zs, 0, sizeof(zs));
+
+	/*
+	 * 15 bits of window + 16 = gzip header and trailer.  The default
+	 * level gets nearly all of the size reduction for a fraction of
+	 * the time the best one takes.
+	 */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	alloc = deflateBound(&zs, inlen);
+
+	out = malloc(alloc);
+	if (!out) {
+		deflateEnd(&zs);
+		return NULL;
+	}
+
+	zs.next_in = (Bytef *) in;
+	zs.avail_in = inlen;
+	zs.next_out = (Bytef *) out;
+	zs.avail_out = alloc;
+
+	ret = deflate(&zs, Z_FINISH);
+
+	deflateEnd(&zs);
+
+	if ((ret != Z_STREAM_END) || (zs.total_out >= inlen)) {
+		free(out);
+		return NULL;
+	}
+
+	*outlen = zs.total_out;
+
+	return out;
+}
+
+/* 64-bit FNV-1a hash of @buf, used for ETags */
+uint64_t fnv1a_hash(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t hash;
+	size_t i;
+
+	hash = 0xcbf29ce484222325ull;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
@@ -36,6 +36,11 @@
 extern int hasdotdot(const char *path);
 extern char *concat5(char *a, char *b, char *c, char *d, char *e);
 extern time_t parse_time_cstr(const char *str);
+extern char *gzip_buf(const char *in, size_t inlen, size_t *outlen);
+extern uint64_t fnv1a_hash(const void *buf, size_t len);
+
+/* bodies shorter than this are not worth compressing */
+#define GZIP_MIN_LEN		256
 
 #define concat4(a, b, c, d)	concat5((a), (b), (c), (d), NULL)
 #define concat3(a, b, c)	concat5((a), (b), (c), NULL, NULL)
@@ -21,37 +21,343 @@
  */
 
 #include <jeffpc/error.h>
+#include <jeffpc/synch.h>
+#include <jeffpc/rbtree.h>
 
 #include "nvl.h"
 #include "vars.h"
+#include "utils.h"
 
-#define SCOPE(vars, scope)	((vars)->scopes[scope])
-#define C(vars)			SCOPE((vars), (vars)->cur)
+/*
+ * Symbol table
+ *
+ * Symbols are never removed, so once a thread has a symbol number, it
+ * can use it without any locking.  The name array grows as symbols are
+ * added, so looking up a name requires the lock.
+ */
+struct vars_sym {
+	struct rb_node node;
+	char *name;
+	unsigned int sym;
+};
+
+static struct rb_tree symtab;
+static const char **symnames;
+static size_t nsymnames;
+static unsigned int nsyms;
+static struct rwlock symtab_lock;
+static LOCK_CLASS(symtab_lc);
+
+static int symtab_cmp(const void *va, const void *vb)
+{
+	const struct vars_sym *a = va;
+	const struct vars_sym *b = vb;
+	int ret;
+
+	ret = strcmp(a->name, b->name);
+	if (ret < 0)
+		return -1;
+	if (ret > 0)
+		return 1;
+	return 0;
+}
+
+void init_vars_subsys(void)
+{
+	rb_create(&symtab, symtab_cmp, sizeof(struct vars_sym),
+		  offsetof(struct vars_sym, node));
+
+	RWINIT(&symtab_lock, &symtab_lc);
+}
+
+unsigned int vars_intern(const char *name)
+{
+	struct vars_sym key = {
+		.name = (char *) name,
+	};
+	struct vars_sym *sym;
+	struct rb_cookie where;
+	unsigned int ret;
+
+	RWLOCK(&symtab_lock, false);
+	sym = rb_find(&symtab, &key, NULL);
+	ret = sym ? sym->sym : VARS_NO_SYM;
+	RWUNLOCK(&symtab_lock);
+
+	if (ret != VARS_NO_SYM)
+		return ret;
+
+	RWLOCK(&symtab_lock, true);
+	sym = rb_find(&symtab, &key, &where);
+	if (!sym) {
+		if (nsyms == nsymnames) {
+			nsymnames = MAX(nsymnames * 2, 64);
+			symnames = mem_reallocarray(symnames, nsymnames,
+						    sizeof(const char *));
+			ASSERT(symnames);
+		}
+
+		sym = malloc(sizeof(struct vars_sym));
+		ASSERT(sym);
+
+		sym->name = xstrdup(name);
+		sym->sym = nsyms;
+
+		symnames[nsyms++] = sym->name;
+
+		rb_insert_here(&symtab, sym, &where);
+	}
+	ret = sym->sym;
+	RWUNLOCK(&symtab_lock);
+
+	return ret;
+}
+
+static const char *symname(unsigned int sym)
+{
+	const char *name;
+
+	RWLOCK(&symtab_lock, false);
+	ASSERT3U(sym, <, nsyms);
+	name = symnames[sym];
+	RWUNLOCK(&symtab_lock);
+
+	return name;
+}
+
+/* grow a slot array to hold at least @n slots */
+static void *grow_slots(void *slots, size_t *nslots, size_t n, size_t size)
+{
+	slots = mem_reallocarray(slots, n, size);
+	ASSERT(slots);
+
+	memset((char *) slots + (*nslots * size), 0, (n - *nslots) * size);
+
+	*nslots = n;
+
+	return slots;
+}
+
+/*
+ * Shared base
+ */
+struct vars_base *vars_base_alloc(struct nvlist *vals)
+{
+	const struct nvpair *pair;
+	struct vars_base *base;
+
+	base = malloc(sizeof(struct vars_base));
+	ASSERT(base);
+
+	refcnt_init(&base->refcnt, 1);
+	base->slots = NULL;
+	base->nslots = 0;
+
+	nvl_for_each(pair, vals) {
+		unsigned int sym = vars_intern(nvpair_name(pair));
+
+		if (sym >= base->nslots)
+			base->slots = grow_slots(base->slots, &base->nslots,
+						 sym + 1, sizeof(struct val *));
+
+		base->slots[sym] = nvpair_value(pair);
+	}
+
+	return base;
+}
+
+void vars_base_free(struct vars_base *base)
+{
+	size_t i;
+
+	for (i = 0; i < base->nslots; i++)
+		if (base->slots[i])
+			val_putref(base->slots[i]);
+
+	free(base->slots);
+	free(base);
+}
+
+/*
+ * Frame indices
+ */
+static int frame_entry_cmp(const void *va, const void *vb)
+{
+	const struct vars_frame_entry *a = va;
+	const struct vars_frame_entry *b = vb;
+
+	if ((uintptr_t) a->items < (uintptr_t) b->items)
+		return -1;
+	if ((uintptr_t) a->items > (uintptr_t) b->items)
+		return 1;
+	return 0;
+}
+
+static void __index_add(struct vars_frame_index *index, size_t *alloc,
+			struct nvlist *items)
+{
+	struct vars_frame_entry *entry;
+
+	if (index->nentries == *alloc) {
+		*alloc = MAX(*alloc * 2, 8);
+		index->entries = mem_reallocarray(index->entries, *alloc,
+						  sizeof(struct vars_frame_entry));
+		ASSERT(index->entries);
+	}
+
+	entry = &index->entries[index->nentries++];
+	entry->items = items;
+	entry->table = vars_base_alloc(items);
+}
+
+static void __index_add_array(struct vars_frame_index *index, size_t *alloc,
+			      struct val *array)
+{
+	size_t i;
+
+	for (i = 0; i < array->array.nelem; i++) {
+		struct val *item = array->array.vals[i];
+
+		if (item->type == VT_NVL)
+			__index_add(index, alloc, val_cast_to_nvl(item));
+	}
+}
 
-static void __init_scope(struct vars *vars)
+static struct vars_frame_index *__index_alloc(void)
 {
-	vars->scopes[vars->cur] = nvl_alloc();
-	ASSERT(vars->scopes[vars->cur]);
+	struct vars_frame_index *index;
+
+	index = malloc(sizeof(struct vars_frame_index));
+	ASSERT(index);
+
+	refcnt_init(&index->refcnt, 1);
+	index->root = NULL;
+	index->array = NULL;
+	index->entries = NULL;
+	index->nentries = 0;
+
+	return index;
 }
 
-static void __free_scope(struct nvlist *scope)
+static void __index_sort(struct vars_frame_index *index)
 {
-	nvl_putref(scope);
+	qsort(index->entries, index->nentries,
+	      sizeof(struct vars_frame_entry), frame_entry_cmp);
 }
 
-void vars_init(struct vars *vars)
+/*
+ * Build the symbol-indexed tables for @root and for every nvlist directly
+ * inside its arrays (e.g., a post and its comments).
+ */
+struct vars_frame_index *vars_frame_index_alloc(struct nvlist *root)
 {
+	struct vars_frame_index *index;
+	const struct nvpair *pair;
+	size_t alloc;
+
+	index = __index_alloc();
+	index->root = nvl_getref(root);
+
+	alloc = 0;
+
+	__index_add(index, &alloc, root);
+
+	nvl_for_each(pair, root) {
+		struct val *val = nvpair_value(pair);
+
+		if (val->type == VT_ARRAY)
+			__index_add_array(index, &alloc, val);
+
+		val_putref(val);
+	}
+
+	__index_sort(index);
+
+	return index;
+}
+
+void vars_frame_index_free(struct vars_frame_index *index)
+{
+	size_t i;
+
+	for (i = 0; i < index->nentries; i++)
+		vars_base_putref(index->entries[i].table);
+
+	free(index->entries);
+	if (index->root)
+		nvl_putref(index->root);
+	if (index->array)
+		val_putref(index->array);
+	free(index);
+}
+
+/* find the table for @items in the registered indices */
+static struct vars_base *__find_table(struct vars *vars,
+				      const struct nvlist *items)
+{
+	struct vars_frame_entry key = {
+		.items = items,
+	};
+	size_t i;
+
+	for (i = 0; i < vars->nindices; i++) {
+		struct vars_frame_index *index = vars->indices[i];
+		struct vars_frame_entry *entry;
+
+		entry = bsearch(&key, index->entries, index->nentries,
+				sizeof(struct vars_frame_entry),
+				frame_entry_cmp);
+		if (entry)
+			return entry->table;
+	}
+
+	return NULL;
+}
+
+/*
+ * Per-user variables
+ */
+void vars_init(struct vars *vars, struct vars_base *base)
+{
+	vars->base = base ? vars_base_getref(base) : NULL;
+	vars->slots = NULL;
+	vars->nslots = 0;
+	vars->undo = NULL;
+	vars->nundo = 0;
+	vars->undo_alloc = 0;
+	vars->nframes = 0;
+	vars->indices = NULL;
+	vars->nindices = 0;
 	vars->cur = 0;
+	vars->scopes[0] = 0;
+}
 
-	__init_scope(vars);
+/* restore all the bindings made since undo log position @pos */
+static void __unwind(struct vars *vars, size_t pos)
+{
+	while (vars->nundo > pos) {
+		struct vars_undo *undo = &vars->undo[--vars->nundo];
+
+		val_putref(vars->slots[undo->sym].val);
+		vars->slots[undo->sym] = undo->old;
+	}
 }
 
 void vars_destroy(struct vars *vars)
 {
-	int i;
+	size_t i;
+
+	__unwind(vars, 0);
 
-	for (i = 0; i <= vars->cur; i++)
-		__free_scope(vars->scopes[i]);
+	for (i = 0; i < vars->nindices; i++)
+		vars_frame_index_putref(vars->indices[i]);
+
+	free(vars->indices);
+	free(vars->slots);
+	free(vars->undo);
+
+	if (vars->base)
+		vars_base_putref(vars->base);
 }
 
 void vars_scope_push(struct vars *vars)
@@ -60,14 +366,94 @@ void vars_scope_push(struct vars *vars)
 
 	ASSERT(vars->cur < VAR_MAX_SCOPES);
 
-	__init_scope(vars);
+	vars->scopes[vars->cur] = vars->nundo;
+}
+
+/*
+ * Push a scope that is backed by @items.  The nvlist is neither copied
+ * nor referenced - the caller must keep it alive until the scope is
+ * popped.
+ */
+void vars_scope_push_nvl(struct vars *vars, struct nvlist *items)
+{
+	struct vars_base *table;
+
+	/* the array holding @items must have been indexed */
+	table = __find_table(vars, items);
+	ASSERT(table);
+
+	vars_scope_push(vars);
+
+	vars->frames[vars->nframes].items = items;
+	vars->frames[vars->nframes].table = table;
+	vars->frames[vars->nframes].scope = vars->cur;
+	vars->nframes++;
+}
+
+/*
+ * Make the tables in @index available to scopes borrowing its nvlists for
+ * the rest of the request.  Takes a new reference.
+ */
+void vars_add_frame_index(struct vars *vars, struct vars_frame_index *index)
+{
+	size_t i;
+
+	for (i = 0; i < vars->nindices; i++)
+		if (vars->indices[i] == index)
+			return;
+
+	vars->indices = mem_reallocarray(vars->indices, vars->nindices + 1,
+					 sizeof(struct vars_frame_index *));
+	ASSERT(vars->indices);
+
+	vars->indices[vars->nindices++] = vars_frame_index_getref(index);
+}
+
+/*
+ * Make sure the nvlists in @array have tables before the request borrows
+ * them.  Arrays not covered by a registered index get one of their own,
+ * which holds a reference to the array so that its nvlists' addresses
+ * can't be reused for the rest of the request.
+ */
+void vars_index_array(struct vars *vars, struct val *array)
+{
+	struct vars_frame_index *index;
+	size_t alloc;
+	size_t i;
+
+	for (i = 0; i < array->array.nelem; i++) {
+		struct val *item = array->array.vals[i];
+
+		if ((item->type == VT_NVL) &&
+		    !__find_table(vars, val_cast_to_nvl(item)))
+			break;
+	}
+
+	if (i == array->array.nelem)
+		return; /* all nvlists (if any) already indexed */
+
+	index = __index_alloc();
+	index->array = val_getref(array);
+
+	alloc = 0;
+
+	__index_add_array(index, &alloc, array);
+
+	__index_sort(index);
+
+	vars_add_frame_index(vars, index);
+	vars_frame_index_putref(index);
 }
 
 void vars_scope_pop(struct vars *vars)
 {
-	vars->cur--;
+	if (vars->nframes &&
+	    (vars->frames[vars->nframes - 1].scope == vars->cur))
+		vars->nframes--;
+
+	__unwind(vars, vars->scopes[vars->cur]);
 
-	__free_scope(vars->scopes[vars->cur + 1]);
+	vars->cur--;
 
 	if (vars->cur < 0)
 		vars_scope_push(vars);
@@ -75,86 +461,128 @@ void vars_scope_pop(struct vars *vars)
 	ASSERT(vars->cur >= 0);
 }
 
-#define WRAP_SET1(varfxn, nvlfxn, ctype)				\
-void varfxn(struct vars *vars, const char *name, ctype val)		\
-{									\
-	int ret;							\
-									\
-	ret = nvlfxn(C(vars), name, val);				\
-	ASSERT0(ret);							\
-}
+/* bind @sym to @val in the current scope, consuming the reference */
+void vars_set_sym(struct vars *vars, unsigned int sym, struct val *val)
+{
+	struct vars_undo *undo;
+
+	if (sym >= vars->nslots)
+		vars->slots = grow_slots(vars->slots, &vars->nslots,
+					 MAX(sym + 1, vars->nslots * 2),
+					 sizeof(struct vars_slot));
+
+	if (vars->nundo == vars->undo_alloc) {
+		vars->undo_alloc = MAX(vars->undo_alloc * 2, 64);
+		vars->undo = mem_reallocarray(vars->undo, vars->undo_alloc,
+					      sizeof(struct vars_undo));
+		ASSERT(vars->undo);
+	}
 
-#define WRAP_SET2(varfxn, nvlfxn, ctype)				\
-void varfxn(struct vars *vars, const char *name, ctype val, size_t len)	\
-{									\
-	int ret;							\
-									\
-	ret = nvlfxn(C(vars), name, val, len);				\
-	ASSERT0(ret);							\
-}
+	undo = &vars->undo[vars->nundo++];
+	undo->sym = sym;
+	undo->old = vars->slots[sym];
 
-WRAP_SET1(vars_set_str, nvl_set_str, struct str *);
-WRAP_SET1(vars_set_int, nvl_set_int, uint64_t);
-WRAP_SET2(vars_set_array, nvl_set_array, struct val **);
+	vars->slots[sym].val = val;
+	vars->slots[sym].scope = vars->cur;
+}
 
-const struct nvpair *vars_lookup(struct vars *vars, const char *name)
+/*
+ * Look up @sym in the borrowed frames that are newer than @scope.
+ */
+struct val *__vars_lookup_frames(struct vars *vars, unsigned int sym,
+				 int scope)
 {
-	const struct nvpair *ret;
-	int scope;
+	int i;
+
+	for (i = vars->nframes - 1; i >= 0; i--) {
+		struct vars_base *table = vars->frames[i].table;
+
+		if (vars->frames[i].scope <= scope)
+			break;
 
-	for (scope = vars->cur; scope >= 0; scope--) {
-		ret = nvl_lookup(SCOPE(vars, scope), name);
-		if (!IS_ERR(ret))
-			return ret;
+		if ((sym < table->nslots) && table->slots[sym])
+			return table->slots[sym];
 	}
 
 	return NULL;
 }
 
-struct str *vars_lookup_str(struct vars *vars, const char *name)
+void vars_set_val(struct vars *vars, const char *name, struct val *val)
 {
-	const struct nvpair *pair;
-	struct str *ret;
+	vars_set_sym(vars, vars_intern(name), val);
+}
 
-	pair = vars_lookup(vars, name);
-	ASSERT(pair);
+void vars_set_str(struct vars *vars, const char *name, struct str *val)
+{
+	vars_set_val(vars, name, str_cast_to_val(val));
+}
 
-	ret = nvpair_value_str(pair);
-	ASSERT(!IS_ERR(ret));
+void vars_set_int(struct vars *vars, const char *name, uint64_t val)
+{
+	vars_set_val(vars, name, VAL_ALLOC_INT(val));
+}
 
-	return ret;
+void vars_set_array(struct vars *vars, const char *name, struct val **vals,
+		    size_t nval)
+{
+	vars_set_val(vars, name, VAL_ALLOC_ARRAY(vals, nval));
 }
 
-uint64_t vars_lookup_int(struct vars *vars, const char *name)
+struct str *vars_lookup_str(struct vars *vars, const char *name)
 {
-	const struct nvpair *pair;
-	uint64_t ret;
-	int err;
+	struct val *val;
 
-	pair = vars_lookup(vars, name);
-	ASSERT(pair);
+	val = vars_lookup_sym(vars, vars_intern(name));
+	ASSERT(val);
+	ASSERT3U(val->type, ==, VT_STR);
 
-	err = nvpair_value_int(pair, &ret);
-	ASSERT(!err);
+	return val_getref_str(val);
+}
 
-	return ret;
+uint64_t vars_lookup_int(struct vars *vars, const char *name)
+{
+	struct val *val;
+
+	val = vars_lookup_sym(vars, vars_intern(name));
+	ASSERT(val);
+	ASSERT3U(val->type, ==, VT_INT);
+
+	return val->i;
 }
 
 void vars_merge(struct vars *vars, struct nvlist *items)
 {
-	int ret;
+	const struct nvpair *pair;
 
-	ret = nvl_merge(C(vars), items);
-	ASSERT0(ret);
+	nvl_for_each(pair, items)
+		vars_set_val(vars, nvpair_name(pair), nvpair_value(pair));
 }
 
 void vars_dump(struct vars *vars)
 {
-	int i;
-
-	for (i = 0; i <= vars->cur; i++) {
-		fprintf(stderr, "VARS DUMP scope %d @ %p\n", i,
-			vars->scopes[i]);
-		nvl_dump_file(stderr, vars->scopes[i]);
+	unsigned int i;
+
+	fprintf(stderr, "VARS DUMP @ %p (scope %d)\n", vars, vars->cur);
+
+	for (i = 0; i < nsyms; i++) {
+		struct val *val = vars_lookup_sym(vars, i);
+
+		if (!val)
+			continue;
+
+		switch (val->type) {
+			case VT_STR:
+				fprintf(stderr, "  %s = '%s'\n", symname(i),
+					str_cstr(val_cast_to_str(val)));
+				break;
+			case VT_INT:
+				fprintf(stderr, "  %s = %"PRIu64"\n",
+					symname(i), val->i);
+				break;
+			default:
+				fprintf(stderr, "  %s = <type %d>\n",
+					symname(i), val->type);
+				break;
+		}
 	}
 }
@@ -23,26 +23,167 @@
 #ifndef __VARS2_H
 #define __VARS2_H
 
+#include <jeffpc/refcnt.h>
+
 #include "config.h"
 #include "nvl.h"
 
+/*
+ * Template variables
+ *
+ * Variable names are interned into small integer symbols.  Templates
+ * resolve their variable names to symbols when they are compiled, so
+ * that rendering never has to compare strings.
+ *
+ * Scoping uses shallow binding: each symbol has one slot holding its
+ * currently visible value.  Setting a variable saves the previous value
+ * in an undo log, and popping a scope restores everything set since the
+ * matching push.  A lookup is therefore a single array access.
+ *
+ * A scope can also borrow an existing nvlist (e.g., an item of a foreach)
+ * instead of copying its contents into slots.  Lookups consult these
+ * borrowed frames first, but only the ones newer than the symbol's
+ * binding.
+ *
+ * Borrowed frames are looked up through a frame index - a symbol-indexed
+ * table of values for each nvlist.  Long-lived nvlists (e.g., the ones
+ * built for each post version) come with an index covering the nvlist
+ * and every nvlist in its arrays, built once.  A request registers the
+ * indices of the nvlists it uses, and any other array gets an index of
+ * its own the first time the request iterates over it.  Either way, a
+ * lookup is an array access and never compares names.
+ */
+
+#define VARS_NO_SYM	(~0u)
+
+/*
+ * Shared, read-only variables visible to everyone using the base.  Also
+ * used as the symbol-indexed table of a frame.
+ */
+struct vars_base {
+	refcnt_t refcnt;
+
+	struct val **slots;
+	size_t nslots;
+};
+
+struct vars_slot {
+	struct val *val;
+	int scope;		/* scope the binding was made in */
+};
+
+struct vars_undo {
+	unsigned int sym;
+	struct vars_slot old;
+};
+
+struct vars_frame_entry {
+	const struct nvlist *items;
+	struct vars_base *table;
+};
+
+/* tables for an nvlist & the nvlists in its arrays, sorted by nvlist */
+struct vars_frame_index {
+	refcnt_t refcnt;
+
+	struct nvlist *root;	/* NULL if built for just an array */
+	struct val *array;	/* NULL if built for a root */
+	struct vars_frame_entry *entries;
+	size_t nentries;
+};
+
+struct vars_frame {
+	struct nvlist *items;	/* borrowed */
+	struct vars_base *table; /* borrowed */
+	int scope;
+};
+
 struct vars {
-	struct nvlist *scopes[VAR_MAX_SCOPES];
+	struct vars_base *base;	/* looked up if there is no binding */
+
+	/* current binding of each symbol (NULL val if unbound) */
+	struct vars_slot *slots;
+	size_t nslots;
+
+	/* scopes backed by borrowed nvlists, innermost last */
+	struct vars_frame frames[VAR_MAX_SCOPES];
+	int nframes;
+
+	/* frame indices registered with vars_add_frame_index() */
+	struct vars_frame_index **indices;
+	size_t nindices;
+
+	/* previous bindings to restore */
+	struct vars_undo *undo;
+	size_t nundo;
+	size_t undo_alloc;
+
+	/* undo log position at the start of each scope */
+	size_t scopes[VAR_MAX_SCOPES];
 	int cur;
 };
 
-extern void vars_init(struct vars *vars);
+extern void init_vars_subsys(void);
+extern unsigned int vars_intern(const char *name);
+
+extern struct vars_base *vars_base_alloc(struct nvlist *vals);
+extern void vars_base_free(struct vars_base *base);
+
+REFCNT_INLINE_FXNS(struct vars_base, vars_base, refcnt, vars_base_free, NULL)
+
+extern struct vars_frame_index *vars_frame_index_alloc(struct nvlist *root);
+extern void vars_frame_index_free(struct vars_frame_index *index);
+
+REFCNT_INLINE_FXNS(struct vars_frame_index, vars_frame_index, refcnt,
+		   vars_frame_index_free, NULL)
+
+extern void vars_init(struct vars *vars, struct vars_base *base);
 extern void vars_destroy(struct vars *vars);
 extern void vars_scope_push(struct vars *vars);
+extern void vars_scope_push_nvl(struct vars *vars, struct nvlist *items);
+extern void vars_add_frame_index(struct vars *vars,
+				 struct vars_frame_index *index);
+extern void vars_index_array(struct vars *vars, struct val *array);
 extern void vars_scope_pop(struct vars *vars);
+extern void vars_set_sym(struct vars *vars, unsigned int sym, struct val *val);
 extern void vars_set_str(struct vars *vars, const char *name, struct str *val);
 extern void vars_set_int(struct vars *vars, const char *name, uint64_t val);
+extern void vars_set_val(struct vars *vars, const char *name, struct val *val);
 extern void vars_set_array(struct vars *vars, const char *name,
 		struct val **vals, size_t nval);
-extern const struct nvpair *vars_lookup(struct vars *vars, const char *name);
 extern struct str *vars_lookup_str(struct vars *vars, const char *name);
 extern uint64_t vars_lookup_int(struct vars *vars, const char *name);
 extern void vars_merge(struct vars *vars, struct nvlist *items);
 extern void vars_dump(struct vars *vars);
+extern struct val *__vars_lookup_frames(struct vars *vars, unsigned int sym,
+					int scope);
+
+/*
+ * Returns the current value of @sym (without a new reference) or NULL if
+ * it is not set.
+ */
+static inline struct val *vars_lookup_sym(struct vars *vars, unsigned int sym)
+{
+	struct vars_slot *slot = NULL;
+
+	if ((sym < vars->nslots) && vars->slots[sym].val)
+		slot = &vars->slots[sym];
+
+	if (vars->nframes) {
+		struct val *val;
+
+		val = __vars_lookup_frames(vars, sym, slot ? slot->scope : -1);
+		if (val)
+			return val;
+	}
+
+	if (slot)
+		return slot->val;
+
+	if (vars->base && (sym < vars->base->nslots))
+		return vars->base->slots[sym];
+
+	return NULL;
+}
 
 #endif
@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2020 Josef 'Jeff' Sipek <jeffpc@josefsipek.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <jeffpc/error.h>
+#include <jeffpc/thread.h>
+#include <jeffpc/rbtree.h>
+#include <jeffpc/taskq.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+#include "post.h"
+#include "render.h"
+#include "utils.h"
+#include "debug.h"
+
+/*
+ * Filesystem watcher
+ *
+ * A background thread watches the posts directory tree and the template
+ * directory.  When a post's file changes, the post is marked as stale
+ * (see post_deps.c) and handed to a taskq to be refreshed, so that the
+ * next request for it doesn't have to reparse it.  Changed templates are
+ * recompiled on the watcher thread.
+ *
+ * If the kernel's event queue overflows, we don't know what changed, so
+ * every post is marked as stale and gets refreshed on its next use.
+ *
+ * Without inotify, we rely on the post dependency checker and on the
+ * template cache noticing changes on use.
+ */
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define WATCH_EVENTS	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+			 IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+/*
+ * How many posts get refreshed per batch of events.  Any others are
+ * still marked stale and get refreshed on their next use.
+ */
+#define WATCH_BATCH	64
+
+#define WATCH_REFRESH_THREADS	2
+
+struct watch_dir {
+	struct rb_node node;
+	int wd;
+	char *path;
+};
+
+static int watch_fd;
+static struct rb_tree watch_dirs;	/* by wd */
+static struct taskq *refresh_tq;
+
+static size_t posts_dir_len;
+static char posts_dir[FILENAME_MAX];
+static const char *template_dir;
+
+static int watch_cmp(const void *va, const void *vb)
+{
+	const struct watch_dir *a = va;
+	const struct watch_dir *b = vb;
+
+	if (a->wd < b->wd)
+		return -1;
+	if (a->wd > b->wd)
+		return 1;
+	return 0;
+}
+
+static void watch_add(const char *path)
+{
+	struct watch_dir *dir;
+	struct rb_cookie where;
+	int wd;
+
+	wd = inotify_add_watch(watch_fd, path, WATCH_EVENTS | IN_ONLYDIR);
+	if (wd < 0) {
+		cmn_err(CE_WARN, "failed to watch '%s': %s", path,
+			xstrerror(-errno));
+		return;
+	}
+
+	dir = rb_find(&watch_dirs, &(struct watch_dir){ .wd = wd }, &where);
+	if (dir)
+		return; /* already watched */
+
+	dir = malloc(sizeof(struct watch_dir));
+	ASSERT(dir);
+
+	dir->wd = wd;
+	dir->path = xstrdup(path);
+
+	rb_insert_here(&watch_dirs, dir, &where);
+}
+
+static void watch_remove(int wd)
+{
+	struct watch_dir *dir;
+
+	dir = rb_find(&watch_dirs, &(struct watch_dir){ .wd = wd }, NULL);
+	if (!dir)
+		return;
+
+	rb_remove(&watch_dirs, dir);
+	free(dir->path);
+	free(dir);
+}
+
+/* watch @path and all directories under it */
+static void watch_tree(const char *path)
+{
+	struct dirent *de;
+	DIR *dir;
+
+	watch_add(path);
+
+	dir = opendir(path);
+	if (!dir)
+		return;
+
+	while ((de = readdir(dir))) {
+		char sub[FILENAME_MAX];
+		struct stat statbuf;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+
+		if (stat(sub, &statbuf) || !S_ISDIR(statbuf.st_mode))
+			continue;
+
+		watch_tree(sub);
+	}
+
+	closedir(dir);
+}
+
+/*
+ * Figure out which post @path belongs to.  Returns 0 if it isn't in a
+ * post's directory.
+ */
+static unsigned int path_to_postid(const char *path)
+{
+	unsigned long id;
+	char *end;
+
+	if (strncmp(path, posts_dir, posts_dir_len) ||
+	    (path[posts_dir_len] != '/'))
+		return 0;
+
+	id = strtoul(&path[posts_dir_len + 1], &end, 10);
+	if ((*end != '/') && (*end != '\0'))
+		return 0;
+
+	return id;
+}
+
+static void __tq_refresh_post(void *arg)
+{
+	unsigned int postid = (uintptr_t) arg;
+	struct post *post;
+	int ret;
+
+	/* posts we don't know about yet get loaded on first use */
+	post = index_lookup_post(postid);
+	if (!post)
+		return;
+
+	/* if someone is already refreshing it, the next reader will catch up */
+	ret = post_try_refresh(post);
+	if (ret && (ret != -EBUSY))
+		cmn_err(CE_WARN, "failed to refresh post %u", postid);
+
+	post_putref(post);
+}
+
+static void process_event(struct inotify_event *ev, unsigned int *postids,
+			  size_t *npostids)
+{
+	char path[FILENAME_MAX];
+	struct watch_dir *dir;
+	unsigned int postid;
+	size_t i;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		cmn_err(CE_WARN, "inotify queue overflowed, marking all "
+			"posts as stale");
+
+		/* we may have missed new directories too */
+		watch_tree(posts_dir);
+		watch_tree(template_dir);
+
+		post_deps_changed_all();
+		return;
+	}
+
+	if (ev->mask & IN_IGNORED) {
+		watch_remove(ev->wd);
+		return;
+	}
+
+	dir = rb_find(&watch_dirs, &(struct watch_dir){ .wd = ev->wd }, NULL);
+	if (!dir)
+		return;
+
+	if (ev->len)
+		snprintf(path, sizeof(path), "%s/%s", dir->path, ev->name);
+	else
+		strlcpy(path, dir->path, sizeof(path));
+
+	/* new directories need watching too */
+	if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+		watch_tree(path);
+
+	if (!strncmp(path, template_dir, strlen(template_dir))) {
+		if (!(ev->mask & IN_ISDIR))
+			tmpl_cache_refresh(path);
+		return;
+	}
+
+	postid = path_to_postid(path);
+	if (!postid)
+		return;
+
+	post_deps_changed(path);
+
+	/* remember the post, so it gets refreshed once per batch */
+	for (i = 0; i < *npostids; i++)
+		if (postids[i] == postid)
+			return;
+
+	if (*npostids < WATCH_BATCH)
+		postids[(*npostids)++] = postid;
+}
+
+static void *watcher(void *arg)
+{
+	char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for (;;) {
+		unsigned int postids[WATCH_BATCH];
+		size_t npostids;
+		ssize_t len;
+		char *ptr;
+		size_t i;
+
+		len = read(watch_fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			cmn_err(CE_ERROR, "inotify read failed: %s",
+				xstrerror(-errno));
+			break;
+		}
+
+		npostids = 0;
+
+		for (ptr = buf; ptr < buf + len;
+		     ptr += sizeof(struct inotify_event) +
+			    ((struct inotify_event *) ptr)->len)
+			process_event((struct inotify_event *) ptr, postids,
+				      &npostids);
+
+		/* reparse all the affected posts in the background */
+		for (i = 0; i < npostids; i++)
+			if (taskq_dispatch(refresh_tq, __tq_refresh_post,
+					   (void *) (uintptr_t) postids[i]))
+				cmn_err(CE_WARN, "failed to queue refresh of "
+					"post %u", postids[i]);
+	}
+
+	return NULL;
+}
+
+bool init_watch_subsys(void)
+{
+	pthread_t thread;
+	int ret;
+
+	watch_fd = inotify_init1(IN_CLOEXEC);
+	if (watch_fd < 0) {
+		cmn_err(CE_WARN, "failed to initialize inotify: %s",
+			xstrerror(-errno));
+		return false;
+	}
+
+	refresh_tq = taskq_create_fixed("watch-refresh", WATCH_REFRESH_THREADS);
+	if (IS_ERR(refresh_tq)) {
+		cmn_err(CE_WARN, "failed to create refresh taskq: %s",
+			xstrerror(PTR_ERR(refresh_tq)));
+		close(watch_fd);
+		return false;
+	}
+
+	rb_create(&watch_dirs, watch_cmp, sizeof(struct watch_dir),
+		  offsetof(struct watch_dir, node));
+
+	snprintf(posts_dir, sizeof(posts_dir), "%s/posts",
+		 str_cstr(config.data_dir));
+	posts_dir_len = strlen(posts_dir);
+	template_dir = str_cstr(config.template_dir);
+
+	watch_tree(posts_dir);
+	watch_tree(template_dir);
+
+	ret = xthr_create(&thread, watcher, NULL);
+	if (ret)
+		panic("failed to create filesystem watcher thread: %s",
+		      xstrerror(ret));
+
+	return true;
+}
+
+#else
+
+bool init_watch_subsys(void)
+{
+	return false;
+}
+
+#endif